@@ -0,0 +1,62 @@
+#include "filter_args.h"
+#include <boost/locale.hpp>
+#include <boost/algorithm/string.hpp>
+#include <array>
+#include <tuple>
+#include <ranges>
+
+using namespace std;
+using pak::name_filter;
+namespace conv = boost::locale::conv;
+
+namespace
+{
+    constexpr array kinds =
+    {
+        tuple{ name_filter::kind::contains, 'c' },
+        tuple{ name_filter::kind::glob, 'g' },
+        tuple{ name_filter::kind::regex, 'r' }
+    };
+}
+
+name_filter make_filter(const vector<filter_term_t>& terms)
+{
+    name_filter filter;
+    for (const auto& t : terms)
+    {
+        if (t.include)
+            filter.include(t.kind, t.pattern);
+        else
+            filter.exclude(t.kind, t.pattern);
+    }
+    return filter;
+}
+
+string encode_filter(const vector<filter_term_t>& terms)
+{
+    string text;
+    for (const auto& t : terms)
+    {
+        text += t.include ? '+' : '-';
+        text += get<1>(*ranges::find(kinds, t.kind, [](const auto& v) { return get<0>(v); }));
+        text += conv::utf_to_utf<char>(t.pattern);
+        text += '\n';
+    }
+    return text;
+}
+
+vector<filter_term_t> decode_filter(const string& text)
+{
+    vector<filter_term_t> terms;
+    vector<string> lines;
+    boost::split(lines, text, [](auto c) { return c == '\n'; });
+    for (const auto& line : lines | views::filter([](const auto& v) { return !v.empty(); }))
+    {
+        const auto k = ranges::find(kinds, line.size() >= 2 ? line[1] : '\0', [](const auto& v) { return get<1>(v); });
+        if ((line[0] != '+' && line[0] != '-') || k == end(kinds))
+            throw runtime_error("Malformed filter.");
+
+        terms.push_back({ .include = line[0] == '+', .kind = get<0>(*k), .pattern = conv::utf_to_utf<wchar_t>(line.substr(2)) });
+    }
+    return terms;
+}
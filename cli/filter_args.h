@@ -0,0 +1,21 @@
+#ifndef FILTER_ARGS_H_INCLUDED
+#define FILTER_ARGS_H_INCLUDED
+#include <filter.h>
+#include <string>
+#include <vector>
+
+//A filter term from the command line
+struct filter_term_t
+{
+    bool include = true;
+    pak::name_filter::kind kind = pak::name_filter::kind::contains;
+    std::wstring pattern;
+};
+
+pak::name_filter make_filter(const std::vector<filter_term_t>& terms);
+
+//Text form of the terms for sending to a server, one UTF-8 line per term
+std::string encode_filter(const std::vector<filter_term_t>& terms);
+std::vector<filter_term_t> decode_filter(const std::string& text);
+
+#endif
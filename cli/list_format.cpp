@@ -0,0 +1,232 @@
+#include "list_format.h"
+#include <boost/locale.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <iostream>
+#include <format>
+#include <array>
+#include <tuple>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+using namespace pak;
+namespace conv = boost::locale::conv;
+
+namespace
+{
+    constexpr array formats =
+    {
+        tuple{ "plain", list_writer_c::format_t::plain },
+        tuple{ "tsv", list_writer_c::format_t::tsv },
+        tuple{ "json", list_writer_c::format_t::json },
+        tuple{ "ndjson", list_writer_c::format_t::ndjson }
+    };
+
+    string method_name(uint16_t method)
+    {
+        switch (method)
+        {
+        case 0:
+            return "store";
+        case 8:
+            return "deflate";
+        case 12:
+            return "bzip2";
+        case 14:
+            return "lzma";
+        case 93:
+            return "zstd";
+        default:
+            return to_string(method);
+        }
+    }
+
+    void append_utf8(string& out, wstring_view text)
+    {
+        out += conv::utf_to_utf<char>(text.data(), text.data() + text.size());
+    }
+
+    //Tabs and line breaks would break the columns, so they are escaped like in PostgreSQL's text format
+    void append_tsv(string& out, wstring_view text)
+    {
+        const auto first = out.size();
+        append_utf8(out, text);
+        if (none_of(begin(out) + first, end(out), [](auto c) { return c == '\t' || c == '\n' || c == '\r' || c == '\\'; }))
+            return;
+
+        string escaped;
+        for (const auto c : string_view{ out }.substr(first))
+        {
+            switch (c)
+            {
+            case '\t': escaped += "\\t"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\\': escaped += "\\\\"; break;
+            default: escaped += c; break;
+            }
+        }
+        out.resize(first);
+        out += escaped;
+    }
+
+    void append_json_string(string& out, wstring_view text)
+    {
+        out += '"';
+        for (const auto c : conv::utf_to_utf<char>(text.data(), text.data() + text.size()))
+        {
+            switch (c)
+            {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20u)
+                    format_to(back_inserter(out), "\\u{:04x}", static_cast<unsigned>(c));
+                else
+                    out += c;
+                break;
+            }
+        }
+        out += '"';
+    }
+}
+
+list_row_t make_row(wstring_view pack, const pack_i::entry_info_t& info)
+{
+    return list_row_t{ .pack = pack, .name = info.name, .size = info.size, .stored_size = info.stored_size,
+        .offset = info.offset, .method = info.method, .crc = info.crc, .timestamp = info.timestamp };
+}
+
+list_writer_c::list_writer_c(format_t f, bool show_pack)
+    : m_format(f), m_show_pack(show_pack)
+{
+    if (m_format == format_t::tsv)
+        m_buf = "pack\tname\tsize\tstored_size\tmethod\tcrc\ttimestamp\toffset\n";
+    else if (m_format == format_t::json)
+        m_buf = "[";
+}
+
+list_writer_c::~list_writer_c()
+{
+    try
+    {
+        finish();
+    }
+    catch (const exception&)
+    {
+    }
+}
+
+list_writer_c::format_t list_writer_c::parse_format(const string& name)
+{
+    if (const auto r = ranges::find(formats, name, [](const auto& v) { return string_view{ get<0>(v) }; }); r != end(formats))
+        return get<1>(*r);
+    throw runtime_error(format("Unknown list format {}, use plain, tsv, json or ndjson.", name));
+}
+
+void list_writer_c::add(const list_row_t& row)
+{
+    switch (m_format)
+    {
+    case format_t::plain:
+        if (m_show_pack)
+            m_wbuf.append(row.pack).append(L":");
+        m_wbuf.append(L" ").append(row.name).append(L"\n");
+        break;
+    case format_t::tsv:
+        add_tsv(row);
+        break;
+    case format_t::json:
+    case format_t::ndjson:
+        add_json(row);
+        break;
+    }
+    m_first = false;
+
+    if (m_buf.size() >= flush_size || m_wbuf.size() >= flush_size)
+        flush();
+}
+
+void list_writer_c::add_tsv(const list_row_t& row)
+{
+    auto field = [this](const auto& v, auto f)
+    {
+        m_buf += '\t';
+        if (v.has_value())
+            f(*v);
+        else
+            m_buf += '-';
+    };
+    auto number = [this](auto n) { format_to(back_inserter(m_buf), "{}", n); };
+
+    append_tsv(m_buf, row.pack);
+    m_buf += '\t';
+    append_tsv(m_buf, row.name);
+    field(row.size, number);
+    field(row.stored_size, number);
+    field(row.method, [this](auto m) { m_buf += method_name(m); });
+    field(row.crc, [this](auto crc) { format_to(back_inserter(m_buf), "{:08x}", crc); });
+    field(row.timestamp, [this](const auto& ts) { m_buf += boost::posix_time::to_iso_extended_string(ts); });
+    field(row.offset, number);
+    m_buf += '\n';
+}
+
+void list_writer_c::add_json(const list_row_t& row)
+{
+    auto field = [this](const char* key, const auto& v, auto f)
+    {
+        format_to(back_inserter(m_buf), ",\"{}\":", key);
+        if (v.has_value())
+            f(*v);
+        else
+            m_buf += "null";
+    };
+    auto number = [this](auto n) { format_to(back_inserter(m_buf), "{}", n); };
+
+    if (m_format == format_t::json && !m_first)
+        m_buf += ',';
+    if (m_format == format_t::json)
+        m_buf += "\n  ";
+
+    m_buf += "{\"pack\":";
+    append_json_string(m_buf, row.pack);
+    m_buf += ",\"name\":";
+    append_json_string(m_buf, row.name);
+    field("size", row.size, number);
+    field("stored_size", row.stored_size, number);
+    field("method", row.method, [this](auto m) { format_to(back_inserter(m_buf), "\"{}\"", method_name(m)); });
+    field("crc", row.crc, [this](auto crc) { format_to(back_inserter(m_buf), "\"{:08x}\"", crc); });
+    field("timestamp", row.timestamp, [this](const auto& ts) { format_to(back_inserter(m_buf), "\"{}\"", boost::posix_time::to_iso_extended_string(ts)); });
+    field("offset", row.offset, number);
+    m_buf += '}';
+    if (m_format == format_t::ndjson)
+        m_buf += '\n';
+}
+
+void list_writer_c::flush()
+{
+    if (!m_wbuf.empty())
+        wcout.write(m_wbuf.data(), static_cast<streamsize>(m_wbuf.size()));
+    if (!m_buf.empty())
+        cout.write(m_buf.data(), static_cast<streamsize>(m_buf.size()));
+    m_wbuf.clear();
+    m_buf.clear();
+}
+
+void list_writer_c::finish()
+{
+    if (m_finished)
+        return;
+    m_finished = true;
+
+    if (m_format == format_t::json)
+        m_buf += m_first ? "]\n" : "\n]\n";
+    flush();
+    if (m_format == format_t::plain)
+        wcout.flush();
+    else
+        cout.flush();
+}
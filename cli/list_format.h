@@ -0,0 +1,55 @@
+#ifndef LIST_FORMAT_H_INCLUDED
+#define LIST_FORMAT_H_INCLUDED
+#include <pack.h>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <cstdint>
+
+//One line of -l output. Packs read from stdin only know some of it.
+struct list_row_t
+{
+    std::wstring_view pack;
+    std::wstring_view name;
+    std::optional<std::uint64_t> size, stored_size, offset;
+    std::optional<std::uint16_t> method;
+    std::optional<std::uint32_t> crc;
+    std::optional<pak::pack_i::filetime_t> timestamp;
+};
+
+list_row_t make_row(std::wstring_view pack, const pak::pack_i::entry_info_t& info);
+
+//Writes -l output. plain is the name list -l has always printed, the others have
+//every column and are written as UTF-8. Output is buffered and goes out in large
+//blocks, so nothing is flushed until finish() or the buffer is full.
+class list_writer_c
+{
+public:
+    enum class format_t { plain, tsv, json, ndjson };
+
+    list_writer_c(format_t f, bool show_pack);
+    list_writer_c(const list_writer_c&) = delete;
+    list_writer_c& operator=(const list_writer_c&) = delete;
+    ~list_writer_c();
+
+    void add(const list_row_t& row);
+    void finish();
+
+    //Name given to --format, throws on anything unknown
+    static format_t parse_format(const std::string& name);
+private:
+    static constexpr size_t flush_size = 0x100000;
+
+    format_t m_format;
+    bool m_show_pack;
+    bool m_first = true;
+    bool m_finished = false;
+    std::string m_buf;
+    std::wstring m_wbuf;
+
+    void flush();
+    void add_json(const list_row_t& row);
+    void add_tsv(const list_row_t& row);
+};
+
+#endif
@@ -2,12 +2,28 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/locale.hpp>
 #include <boost/crc.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <iostream>
-#include <future>
+#include <atomic>
+#include <mutex>
 #include <format>
 #include <numeric>
+#include <bit>
+#include <unordered_set>
+#include <unordered_map>
 #include <pack.h>
+#include <scheduler.h>
+#include <journal.h>
 #include "paktoolver.h"
+#include "server.h"
+#include "filter_args.h"
+#include "list_format.h"
+#include "spill_sort.h"
+#include "prefetch.h"
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 namespace po = boost::program_options;
 namespace fs = std::filesystem;
@@ -16,8 +32,8 @@ using namespace std;
 using namespace pak;
 
 
-template <typename Tfunc>
-concept file_filter = std::is_invocable_r_v<bool, Tfunc, wstring_view>;
+//Input or output name for stdin/stdout
+static constexpr auto STDIO = "-"sv;
 
 static void warn_func(const wstring& entry, const wstring& msg)
 {
@@ -29,20 +45,130 @@ static fs::path path_strip(const string& str)
     return fs::path(boost::trim_right_copy_if(str, [](auto c) { return c == fs::path::preferred_separator; }));
 }
 
-static int list_pack(const vector<string>& packs, file_filter auto filter)
+//Size in bytes with an optional K, M or G suffix (powers of 1024)
+static uint64_t parse_size(const string& str)
 {
+    size_t pos = 0;
+    const auto v = stoull(str, &pos);
+    const auto suffix = boost::to_upper_copy(str.substr(pos));
+    constexpr array units = { tuple{ "", 0 }, tuple{ "K", 10 }, tuple{ "M", 20 }, tuple{ "G", 30 } };
+    if (auto u = ranges::find(units | views::keys, suffix).base(); u != end(units) && v > 0)
+        return v << get<1>(*u);
+
+    throw runtime_error(format("Invalid size: {}", str));
+}
+
+//The padding has to fit in a zip extra field, which is at most 64 KB
+static uint32_t parse_align(const string& str)
+{
+    const auto v = parse_size(str);
+    if (!has_single_bit(v) || v > 0x8000u)
+        throw runtime_error(format("Invalid alignment: {}, use a power of two up to 32K.", str));
+    return static_cast<uint32_t>(v);
+}
+
+//True for folder, false for the default stored
+static bool parse_layout(const string& str)
+{
+    if (str == "stored" || str == "folder")
+        return str == "folder";
+    throw runtime_error(format("Unknown layout {}, use stored or folder.", str));
+}
+
+static pack_i::link parse_dedupe(const string& str)
+{
+    if (str == "reflink")
+        return pack_i::link::reflink;
+    if (str == "hardlink")
+        return pack_i::link::hardlink;
+    throw runtime_error(format("Unknown link type {}, use reflink or hardlink.", str));
+}
+
+static unique_ptr<stream_pack_i> open_stdin()
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return stream_pack_i::open_stream(cin, &warn_func);
+}
+
+static bool copy_data(pack_i& inp, pack_i& outp)
+{
+    return outp.write_from(inp);
+}
+
+static bool copy_data(auto& inp, pack_i& outp)
+{
+    uint8_t buf[0xFFFF];
+    for (auto s = inp.read(buf, size(buf)); s > 0; s = inp.read(buf, size(buf)))
+    {
+        if (outp.write(buf, s) != s)
+            return false;
+    }
+    return true;
+}
+
+static int list_pack(const vector<string>& packs, const name_filter& filter, list_writer_c::format_t fmt = list_writer_c::format_t::plain, bool low_memory = false)
+{
+    list_writer_c out(fmt, packs.size() > 1);
     for (const auto name : packs
         | views::transform([](const auto& v) { return fs::path(v); }))
     {
-        if (auto ppack = pack_i::open_pack(name, pack_i::mode::read_only, &warn_func))
+        const auto label = fmt == list_writer_c::format_t::plain ? name.filename().wstring() : name.wstring();
+        unique_ptr<stream_pack_i> pstream;
+        if (name == STDIO && (pstream = open_stdin()) == nullptr)
+        {
+            cerr << "stdin: Unknown pack format." << endl;
+            return 1;
+        }
+        else if (name != STDIO && low_memory && (pstream = stream_pack_i::scan_pack(name, &warn_func)) == nullptr)
         {
-            for (const auto& ename : ppack->file_names() | views::filter(filter))
+            cerr << name << ": Could not open." << endl;
+            return 1;
+        }
+
+        if (pstream)
+        {
+            //Entries come in the order they are stored, not sorted
+            for (auto ename = pstream->next_entry(); ename.has_value(); ename = pstream->next_entry())
             {
-                if (packs.size() > 1)
-                    wcout << name.filename().wstring() << L":";
-                wcout << " " << ename << endl;
+                if (!filter(*ename))
+                    continue;
+
+                list_row_t row;
+                row.pack = label;
+                row.name = *ename;
+                if (fmt == list_writer_c::format_t::plain)
+                {
+                    out.add(row);
+                    continue;
+                }
+                if (const auto info = pstream->entry_info())
+                {
+                    out.add(make_row(label, *info));
+                    continue;
+                }
+
+                //A stream has no directory, but the entry is read through anyway to get to the next one
+                boost::crc_32_type crc;
+                uint64_t size = 0;
+                uint8_t buf[0xFFFF];
+                for (auto s = pstream->read(buf, sizeof(buf)); s > 0; s = pstream->read(buf, sizeof(buf)))
+                {
+                    crc.process_bytes(buf, s);
+                    size += s;
+                }
+                row.size = size;
+                row.crc = crc.checksum();
+                row.timestamp = pstream->entry_timestamp();
+                out.add(row);
             }
         }
+        else if (auto ppack = pack_i::open_pack(name, pack_i::mode::read_only, &warn_func))
+        {
+            for (const auto& info : ppack->entries(filter))
+                out.add(make_row(label, info));
+        }
         else
         {
             cerr << name << ": Could not open." << endl;
@@ -52,20 +178,22 @@ static int list_pack(const vector<string>& packs, file_filter auto filter)
     return 0;
 }
 
-static auto calc_chksums(const string& pack)
+static auto calc_chksums(pack_i* ppack, bool from_directory)
 {
     vector<tuple<wstring, uint64_t>> stats;
-    
-    auto ppack = pack_i::open_pack(pack, pack_i::mode::read_only);
-    if (ppack == nullptr)
-        throw runtime_error(format("Could not open {}", pack));
-    
     stats.reserve(ppack->count());
 
-    ranges::transform(ppack->file_names(), back_inserter(stats), [&](const auto& nm)
+    ranges::transform(ppack->entries(name_filter{}, pack_i::order::offset), back_inserter(stats), [&](const auto& info)
     {
+        const wstring nm{ info.name };
         boost::crc_optimal<64, 0x42f0e1eba9ea3693ULL, 0, 0, false, false> crc64;
-        if (ppack->open_entry(wstring{ nm }))
+        if (from_directory)
+        {
+            //The stored CRC and size stand in for the contents
+            const array<uint64_t, 2> key = { info.size, info.crc.value_or(0) };
+            crc64.process_bytes(key.data(), sizeof(key));
+        }
+        else if (ppack->open_entry(info))
         {
             uint8_t buf[0xFFFF];
             for (auto s = ppack->read(buf, size(buf)); s > 0; s = ppack->read(buf, size(buf)))
@@ -74,7 +202,7 @@ static auto calc_chksums(const string& pack)
             ppack->close_read_entry();
         }
         
-        return make_tuple(wstring{ nm }, crc64.checksum());
+        return make_tuple(nm, crc64.checksum());
     });
 
     ranges::sort(stats, {}, [](const auto& v) { return get<1>(v); });
@@ -84,9 +212,20 @@ static auto calc_chksums(const string& pack)
 
 static int compare_packs(const string& pack1, const string& pack2)
 {
-    auto t2 = async(calc_chksums, pack2);
-    const auto st1 = calc_chksums(pack1);
-    const auto st2 = t2.get();
+    auto ppack1 = pack_i::open_pack(pack1, pack_i::mode::read_only);
+    auto ppack2 = pack_i::open_pack(pack2, pack_i::mode::read_only);
+    if (ppack1 == nullptr || ppack2 == nullptr)
+        throw runtime_error(format("Could not open {}", ppack1 == nullptr ? pack1 : pack2));
+
+    //Nothing has to be decompressed if both directories have checksums for everything
+    auto has_crc = [](const auto& info) { return info.crc.has_value(); };
+    const auto from_directory = ranges::all_of(ppack1->entries(), has_crc) && ranges::all_of(ppack2->entries(), has_crc);
+
+    decltype(calc_chksums(nullptr, false)) st1, st2;
+    task_group_c hashing;
+    hashing.run([&]() { st1 = calc_chksums(ppack1.get(), from_directory); });
+    hashing.run([&]() { st2 = calc_chksums(ppack2.get(), from_directory); });
+    hashing.wait();
 
     auto packname1 = fs::path(pack1).filename().wstring();
     auto packname2 = fs::path(pack2).filename().wstring();
@@ -156,84 +295,915 @@ static int compare_packs(const string& pack1, const string& pack2)
     return results.empty() ? 0 : 1;
 }
 
-static int convert_pack(const vector<string>& inpack, const string& outpack, file_filter auto filter)
+//Reads a spill_sort_c one record ahead, so runs of equal keys can be found
+struct sorted_cursor_t
+{
+    spill_sort_c& sorted;
+    optional<spill_sort_c::record_t> cur = sorted.next();
+
+    void advance()
+    {
+        cur = sorted.next();
+    }
+};
+
+//Checksums every entry in one pass over the pack's directory into sorts by checksum and by name
+static void spill_chksums(stream_pack_i& scan, optional<wstring> nm, bool from_directory, spill_sort_c& by_chk, spill_sort_c& by_name)
+{
+    for (; nm.has_value(); nm = scan.next_entry())
+    {
+        boost::crc_optimal<64, 0x42f0e1eba9ea3693ULL, 0, 0, false, false> crc64;
+        const auto info = scan.entry_info();
+        if (from_directory && info.has_value())
+        {
+            const array<uint64_t, 2> key = { info->size, info->crc.value_or(0) };
+            crc64.process_bytes(key.data(), sizeof(key));
+        }
+        else
+        {
+            uint8_t buf[0xFFFF];
+            for (auto s = scan.read(buf, size(buf)); s > 0; s = scan.read(buf, size(buf)))
+                crc64.process_bytes(buf, s);
+        }
+
+        const auto chk = format(L"{:016x}", crc64.checksum());
+        by_chk.add(chk, *nm);
+        by_name.add(std::move(*nm), chk);
+    }
+}
+
+//Same result as compare_packs, but names and checksums go through sorts that spill to disk
+//and are joined by merging, so memory use doesn't depend on the number of entries
+static int compare_packs_low_memory(const string& pack1, const string& pack2)
+{
+    constexpr size_t sort_memory = 16u << 20;
+    auto scan1 = stream_pack_i::scan_pack(path_strip(pack1), &warn_func);
+    auto scan2 = stream_pack_i::scan_pack(path_strip(pack2), &warn_func);
+    if (scan1 == nullptr || scan2 == nullptr)
+        throw runtime_error(format("Could not open {}", scan1 == nullptr ? pack1 : pack2));
+
+    //Checksums are a property of the format, so the first entries tell if all have them
+    auto first1 = scan1->next_entry();
+    auto first2 = scan2->next_entry();
+    auto has_crc = [](const auto& scan, const auto& first) { return !first.has_value() || (scan->entry_info() && scan->entry_info()->crc.has_value()); };
+    const auto from_directory = has_crc(scan1, first1) && has_crc(scan2, first2);
+
+    spill_sort_c by_chk1(sort_memory), by_name1(sort_memory), by_chk2(sort_memory), by_name2(sort_memory);
+    task_group_c hashing;
+    hashing.run([&]() { spill_chksums(*scan1, std::move(first1), from_directory, by_chk1, by_name1); });
+    hashing.run([&]() { spill_chksums(*scan2, std::move(first2), from_directory, by_chk2, by_name2); });
+    hashing.wait();
+
+    auto packname1 = fs::path(pack1).filename().wstring();
+    auto packname2 = fs::path(pack2).filename().wstring();
+    if (boost::iequals(packname1, packname2))
+    {
+        packname1 = L"first";
+        packname2 = L"second";
+    }
+
+    spill_sort_c results(sort_memory), unmatched1(sort_memory), unmatched2(sort_memory);
+    bool any = false;
+    auto add_result = [&](wstring nm, wstring msg)
+    {
+        results.add(std::move(nm), std::move(msg));
+        any = true;
+    };
+
+    //Entries with the same checksum in both packs are the same file, possibly renamed
+    sorted_cursor_t c1{ by_chk1 }, c2{ by_chk2 };
+    while (c1.cur.has_value() || c2.cur.has_value())
+    {
+        const auto chk = !c2.cur.has_value() || (c1.cur.has_value() && get<0>(*c1.cur) < get<0>(*c2.cur)) ? get<0>(*c1.cur) : get<0>(*c2.cur);
+        vector<wstring> names1, names2;
+        for (; c1.cur.has_value() && get<0>(*c1.cur) == chk; c1.advance())
+            names1.push_back(std::move(get<1>(*c1.cur)));
+        for (; c2.cur.has_value() && get<0>(*c2.cur) == chk; c2.advance())
+            names2.push_back(std::move(get<1>(*c2.cur)));
+
+        //The sorts order records by name within a checksum, so both lists are sorted
+        for (auto& nm : names1)
+        {
+            if (names2.empty())
+                unmatched1.add(std::move(nm), {});
+            else if (!ranges::binary_search(names2, nm))
+                add_result(std::move(nm), names2.size() > 1u
+                    ? format(L"Different names in {}: {}", packname2, boost::join(names2, L", "))
+                    : format(L"Different name in {}: {}", packname2, names2.front()));
+        }
+        if (names1.empty())
+        {
+            for (auto& nm : names2)
+                unmatched2.add(std::move(nm), {});
+        }
+    }
+
+    //What is left either exists under the same name with other contents or only in one pack
+    sorted_cursor_t u1{ unmatched1 }, n2{ by_name2 };
+    for (; u1.cur.has_value(); u1.advance())
+    {
+        const auto& nm = get<0>(*u1.cur);
+        while (n2.cur.has_value() && get<0>(*n2.cur) < nm)
+            n2.advance();
+        add_result(nm, n2.cur.has_value() && get<0>(*n2.cur) == nm ? L"File is different"s : format(L"Only in {}", packname1));
+    }
+
+    sorted_cursor_t u2{ unmatched2 }, n1{ by_name1 };
+    for (; u2.cur.has_value(); u2.advance())
+    {
+        const auto& nm = get<0>(*u2.cur);
+        while (n1.cur.has_value() && get<0>(*n1.cur) < nm)
+            n1.advance();
+        if (!n1.cur.has_value() || get<0>(*n1.cur) != nm)
+            add_result(nm, format(L"Only in {}", packname2));
+    }
+
+    if (!any)
+    {
+        wcout << L"No differences found." << endl;
+        return 0;
+    }
+
+    for (auto r = results.next(); r.has_value(); r = results.next())
+        wcout << get<0>(*r) << L": " << get<1>(*r) << L"\n";
+    wcout.flush();
+    return 1;
+}
+
+static int find_dupes(const vector<string>& packs, const name_filter& filter)
+{
+    struct entry_t
+    {
+        size_t pack;
+        wstring name;
+        pack_i::entry_info_t info;
+        uint64_t hash = 0;
+    };
+
+    vector<unique_ptr<pack_i>> ppacks(packs.size());
+    vector<vector<entry_t>> listed(packs.size());
+    task_group_c opening;
+    for (size_t i = 0; i < packs.size(); ++i)
+    {
+        opening.run([&, i]()
+        {
+            ppacks[i] = pack_i::open_pack(path_strip(packs[i]), pack_i::mode::read_only, &warn_func);
+            if (ppacks[i] == nullptr)
+                throw runtime_error(format("Could not open {}", packs[i]));
+            for (const auto& info : ppacks[i]->entries(filter, pack_i::order::offset))
+                listed[i].push_back({ i, wstring{ info.name }, info });
+        });
+    }
+    opening.wait();
+
+    //Only files with the same size can be the same, and not if the directory has different CRCs for them
+    vector<entry_t> entries;
+    for (auto& l : listed)
+        ranges::move(l, back_inserter(entries));
+    listed = {};
+    ranges::sort(entries, {}, [](const auto& e) { return make_tuple(e.info.size, e.info.crc); });
+
+    vector<entry_t*> candidates;
+    for (auto it = begin(entries); it != end(entries);)
+    {
+        const auto size = it->info.size;
+        const auto next = find_if(it, end(entries), [&](const auto& e) { return e.info.size != size; });
+        //Entries without a CRC sort first and could match any of the others
+        const auto any_crc = find_if(it, next, [](const auto& e) { return e.info.crc.has_value(); });
+        const auto first = candidates.size();
+        for (auto run = it; run != next && size > 0u;)
+        {
+            const auto run_end = find_if(run, next, [&](const auto& e) { return e.info.crc != run->info.crc; });
+            if (any_crc != it || distance(run, run_end) > 1)
+                ranges::transform(run, run_end, back_inserter(candidates), [](auto& e) { return &e; });
+            run = run_end;
+        }
+        if (candidates.size() - first == 1u)
+            candidates.pop_back();
+        it = next;
+    }
+
+    //Candidates are hashed in parallel through readers of their own, in file order within a pack
+    ranges::sort(candidates, {}, [](const auto* e) { return make_tuple(e->pack, e->info.offset.value_or(0)); });
+    vector<mutex> pack_locks(packs.size());
+    task_group_c hashing;
+    for (auto* e : candidates)
+    {
+        hashing.run([&, e]()
+        {
+            boost::crc_optimal<64, 0x42f0e1eba9ea3693ULL, 0, 0, false, false> crc64;
+            vector<uint8_t> buf(0x40000);
+            auto& ppack = *ppacks[e->pack];
+            if (auto reader = ppack.open_reader(e->name))
+            {
+                for (auto s = reader->read(buf.data(), buf.size()); s > 0; s = reader->read(buf.data(), buf.size()))
+                    crc64.process_bytes(buf.data(), s);
+            }
+            else
+            {
+                //Formats that can only read the current entry are read one entry at a time
+                lock_guard lock(pack_locks[e->pack]);
+                if (!ppack.open_entry(e->info))
+                    throw runtime_error(format("Could not read {}", conv::from_utf(e->name, "UTF-8")));
+                for (auto s = ppack.read(buf.data(), buf.size()); s > 0; s = ppack.read(buf.data(), buf.size()))
+                    crc64.process_bytes(buf.data(), s);
+                ppack.close_read_entry();
+            }
+            e->hash = crc64.checksum();
+        });
+    }
+    hashing.wait();
+
+    //Groups with the most space to gain first. Keeping the copy that takes the least space,
+    //the others are what could be reclaimed.
+    auto content = [](const entry_t* e) { return make_tuple(e->info.size, e->hash); };
+    ranges::sort(candidates, {}, content);
+    vector<tuple<uint64_t, vector<const entry_t*>>> groups;
+    for (auto it = begin(candidates); it != end(candidates);)
+    {
+        const auto next = find_if(it, end(candidates), [&](const auto* e) { return content(e) != content(*it); });
+        if (distance(it, next) > 1)
+        {
+            vector<const entry_t*> copies(it, next);
+            auto stored = copies | views::transform([](const auto* e) { return e->info.stored_size; });
+            const auto wasted = accumulate(begin(stored), end(stored), uint64_t(0)) - ranges::min(stored);
+            groups.emplace_back(wasted, std::move(copies));
+        }
+        it = next;
+    }
+    ranges::sort(groups, greater{}, [](const auto& g) { return get<0>(g); });
+
+    uint64_t total = 0;
+    for (const auto& [wasted, copies] : groups)
+    {
+        total += wasted;
+        wcout << format(L"{} copies of {} bytes, {} bytes wasted:\n", copies.size(), copies.front()->info.size, wasted);
+        for (const auto* e : copies)
+            wcout << L"\t" << conv::utf_to_utf<wchar_t>(packs[e->pack]) << L"\t" << e->name << L"\n";
+    }
+    wcout << format(L"Groups of duplicates: {}, bytes wasted: {}.", groups.size(), total) << endl;
+    return groups.empty() ? 0 : 1;
+}
+
+static int test_packs(const vector<string>& packs)
 {
-    vector<tuple<unique_ptr<pack_i>, fs::path>> inpacks;
-    ranges::transform(inpack, back_inserter(inpacks),
-        [](const auto& v)
+    //Every pack is a task and the entries of a pack are tasks of their own, so many
+    //small packs and a few large ones both keep all threads busy
+    vector<vector<pack_i::problem_t>> results(packs.size());
+    task_group_c tasks;
+    for (size_t i = 0; i < packs.size(); ++i)
+    {
+        tasks.run([&, i]()
         {
-            const auto p = path_strip(v);
-            return make_tuple(pack_i::open_pack(v, pack_i::mode::read_only, &warn_func), p);
+            try
+            {
+                auto ppack = pack_i::open_pack(path_strip(packs[i]), pack_i::mode::read_only);
+                results[i] = ppack == nullptr
+                    ? vector<pack_i::problem_t>{ { L"", L"Could not open, not a pack or the directory is damaged." } }
+                    : ppack->verify();
+            }
+            catch (const exception& e)
+            {
+                results[i] = { { L"", conv::to_utf<wchar_t>(e.what(), "Latin1") } };
+            }
         });
+    }
+    tasks.wait();
+
+    //One line per problem: pack, entry (empty for the whole pack) and message, separated by tabs
+    size_t bad = 0;
+    for (size_t i = 0; i < packs.size(); ++i)
+    {
+        bad += results[i].empty() ? 0 : 1;
+        for (const auto& [entry, msg] : results[i])
+            wcout << conv::utf_to_utf<wchar_t>(packs[i]) << L"\t" << entry << L"\t" << msg << L"\n";
+    }
+    wcout.flush();
+    wcerr << packs.size() - bad << L" of " << packs.size() << L" packs OK." << endl;
+    return bad == 0 ? 0 : 1;
+}
+
+//Copies entries in the order the input gives them, holding only the current one
+static int convert_stream(unique_ptr<stream_pack_i> pstream, const string& outpack, const name_filter& filter, const pack_i::write_options_t& wopts)
+{
+    auto& progress = outpack == STDIO ? wcerr : wcout;
+    unique_ptr<pack_i> outp;
+    for (auto filename = pstream->next_entry(); filename.has_value(); filename = pstream->next_entry())
+    {
+        if (!filter(*filename))
+            continue;
+
+        //The output isn't created until there is something to put in it
+        if (outp == nullptr)
+        {
+            if ((outp = pack_i::open_pack(path_strip(outpack), pack_i::mode::rw_new, warn_func)) == nullptr)
+            {
+                cerr << "Open failed: " << outpack << endl;
+                return 1;
+            }
+            outp->set_write_options(wopts);
+        }
+
+        progress << *filename << L"...";
+        progress.flush();
+        const auto info = pstream->entry_info();
+        if (outp->new_entry(*filename, pstream->entry_timestamp(), info.has_value() ? info->size : 0))
+        {
+            if (!copy_data(*pstream, *outp))
+            {
+                cerr << "Write error." << endl;
+                return 1;
+            }
+            outp->close_write_entry();
+            progress << L"OK" << endl;
+        }
+        else
+        {
+            cerr << "Failed" << endl;
+        }
+    }
+    if (outp)
+        outp->close_pack();
+    return 0;
+}
+
+//How a conversion writes its output and splits it over several files
+struct output_opts_t
+{
+    optional<uint64_t> max_size;
+    optional<size_t> max_entries;
+    wstring name_template;
+    pack_i::write_options_t write;
+    bool by_folder = false;     //Entries are grouped by folder instead of kept in input order
+    bool resume = false;        //Continue from the journal next to the output if there is one
+};
+
+static int convert_pack(const vector<string>& inpack, const string& outpack, const name_filter& filter, const output_opts_t& oopts = {}, bool low_memory = false)
+{
+    if (oopts.resume)
+    {
+        //The journal keeps one file, and it is only of use if the same entries come in the same order again
+        const char* unsupported = outpack == STDIO ? "standard output"
+            : boost::iequals(path_strip(outpack).extension().wstring(), L".grp") ? ".grp files"
+            : oopts.max_size || oopts.max_entries ? "volumes"
+            : low_memory ? "--low-memory"
+            : ranges::find(inpack, STDIO) != end(inpack) ? "standard input"
+            : nullptr;
+        if (unsupported != nullptr)
+        {
+            cerr << "--resume can't be used with " << unsupported << "." << endl;
+            return 1;
+        }
+
+        //The journal is deleted when an output is complete, like the earlier packs of a -x that was stopped
+        auto journal_path = path_strip(outpack);
+        journal_path += L".journal";
+        if (fs::exists(path_strip(outpack)) && !fs::exists(journal_path))
+        {
+            cout << outpack << " is complete, skipped." << endl;
+            return 0;
+        }
+    }
+
+    //Streamed conversions write entries as they come, into one output
+    if ((low_memory || ranges::find(inpack, STDIO) != end(inpack)) && (oopts.max_size || oopts.max_entries || oopts.by_folder))
+    {
+        cerr << "Volumes and --layout folder can't be used with --low-memory or standard input." << endl;
+        return 1;
+    }
+
+    if (ranges::find(inpack, STDIO) != end(inpack))
+    {
+        if (inpack.size() == 1u)
+        {
+            auto pstream = open_stdin();
+            if (pstream == nullptr)
+            {
+                cerr << "stdin: Unknown pack format." << endl;
+                return 1;
+            }
+            return convert_stream(std::move(pstream), outpack, filter, oopts.write);
+        }
+
+        cerr << "Standard input can't be combined with other inputs." << endl;
+        return 1;
+    }
+
+    if (low_memory)
+    {
+        //Which input wins for a name can't be known without indexing all of them
+        if (inpack.size() > 1u)
+        {
+            cerr << "--low-memory converts one input at a time." << endl;
+            return 1;
+        }
+        auto pscan = stream_pack_i::scan_pack(path_strip(inpack.front()), &warn_func);
+        if (pscan == nullptr)
+        {
+            cerr << "Open failed: " << path_strip(inpack.front()) << endl;
+            return 1;
+        }
+        return convert_stream(std::move(pscan), outpack, filter, oopts.write);
+    }
+
+    //Inputs are opened at the same time, they are often on different disks
+    vector<unique_ptr<pack_i>> inpacks(inpack.size());
+    task_group_c opening;
+    for (size_t i = 0; i < inpack.size(); ++i)
+        opening.run([&, i]() { inpacks[i] = pack_i::open_pack(path_strip(inpack[i]), pack_i::mode::read_only, &warn_func); });
+    opening.wait();
 
-    if (auto failed = inpacks | views::filter([](const auto& v) { return get<0>(v) == nullptr; }); !failed.empty())
+    if (auto failed = views::iota(size_t(0), inpack.size()) | views::filter([&](auto i) { return inpacks[i] == nullptr; }); !failed.empty())
     {
-        for (const auto& failpath : failed | views::values)
-            cerr << "Open failed: " << failpath << endl;
+        for (const auto i : failed)
+            cerr << "Open failed: " << path_strip(inpack[i]) << endl;
         return 1;
     }
 
-    auto pinputs = inpacks | views::keys;
-    const auto file_cnt = accumulate(begin(pinputs), end(pinputs), size_t(0),
-        [&](auto a, const auto& v) { return a + v->count(filter); });
+    struct planned_t
+    {
+        size_t input;
+        wstring name;
+        uint64_t size;
+        size_t index;   //In the input's directory, so opening it needs no name lookup
+        optional<pack_i::filetime_t> timestamp;
+    };
+    //Entries are copied in the order they are stored so the inputs are read from start to end
+    vector<vector<planned_t>> listed(inpacks.size());
+    for (size_t i = 0; i < inpacks.size(); ++i)
+    {
+        opening.run([&, i]()
+        {
+            for (const auto& info : inpacks[i]->entries(filter, pack_i::order::offset))
+            {
+                //File will appear in a later pack so we skip the earlier occurance
+                wstring filename{ info.name };
+                if (ranges::none_of(inpacks | views::drop(i + 1), [&](const auto& p) { return p->contains_entry(filename); }))
+                    listed[i].push_back({ i, std::move(filename), info.size, info.index, info.timestamp });
+            }
+        });
+    }
+    opening.wait();
+
+    vector<planned_t> entries;
+    for (auto& l : listed)
+        ranges::move(l, back_inserter(entries));
+    listed = {};
 
-    if (file_cnt == 0)
+    if (entries.empty())
         return 0;
-    
-    auto outp = pack_i::open_pack(path_strip(outpack), pack_i::mode::rw_new, warn_func);
-    if (outp == nullptr)
+
+    auto reorder = [&](auto& keys)
+    {
+        ranges::sort(keys);
+        vector<planned_t> ordered;
+        ordered.reserve(entries.size());
+        for (const auto i : keys | views::elements<1>)
+            ordered.push_back(std::move(entries[i]));
+        entries = std::move(ordered);
+    };
+
+    if (oopts.by_folder)
+    {
+        //Folders are kept together for readers that load a folder at a time. Within a folder
+        //the input order is kept, so the inputs are still read mostly from start to end.
+        vector<tuple<wstring, size_t>> keys;
+        keys.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const auto& name = entries[i].name;
+            const auto slash = name.rfind(L'/');
+            keys.emplace_back(boost::to_lower_copy(name.substr(0, slash == wstring::npos ? 0 : slash)), i);
+        }
+        reorder(keys);
+    }
+    else if (inpacks.size() > 1u)
+    {
+        //The inputs are interleaved by how far into each one an entry is, so all of them are
+        //read from start to end at the same rate and inputs on different disks are busy at once
+        vector<uint64_t> totals(inpacks.size()), done(inpacks.size());
+        for (const auto& e : entries)
+            totals[e.input] += e.size + 1u;
+
+        vector<tuple<double, size_t>> keys;
+        keys.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const auto& e = entries[i];
+            keys.emplace_back(static_cast<double>(done[e.input]) / static_cast<double>(totals[e.input]), i);
+            done[e.input] += e.size + 1u;
+        }
+        reorder(keys);
+    }
+
+    const auto outpath = path_strip(outpack);
+    //Volumes are planned from the source sizes and the output format's worst case,
+    //so they can be written at the same time. Nothing is created until they are.
+    auto plan = pack_i::plan_pack(outpath);
+    if (plan == nullptr)
     {
         cerr << "Open failed: " << outpack << endl;
         return 1;
     }
+    plan->set_write_options(oopts.write);
+    vector<vector<planned_t>> volumes(1);
+    const auto max_entries = min(oopts.max_entries.value_or(numeric_limits<size_t>::max()), plan->max_entries());
+    const auto max_size = oopts.max_size.value_or(numeric_limits<uint64_t>::max());
+    auto vol_size = plan->empty_size();
+    for (auto& e : entries)
+    {
+        const auto need = plan->space_needed(e.name, e.size);
+        if (!volumes.back().empty() && (volumes.back().size() >= max_entries || vol_size + need > max_size))
+        {
+            volumes.emplace_back();
+            vol_size = plan->empty_size();
+        }
+        if (vol_size + need > max_size)
+            wcerr << e.name << L": Larger than the maximum volume size." << endl;
 
-    if (!outp->pre_reserve(file_cnt))
+        vol_size += need;
+        volumes.back().push_back(std::move(e));
+    }
+
+    if (volumes.size() > 1u && outpack == STDIO)
+    {
+        cerr << "Standard output can't be split into volumes." << endl;
+        return 1;
+    }
+    if (volumes.size() > 1u && oopts.resume)
     {
-        cerr << "Failed to reserve space in file " << outpack << endl;
+        cerr << "--resume can't be used when the output is split into volumes." << endl;
         return 1;
     }
+    //Volumes after the first would overwrite packs that may not be from an earlier conversion
+    for (size_t vol = 1; vol < volumes.size(); ++vol)
+    {
+        if (const auto volpath = pack_i::volume_path(outpath, vol, oopts.name_template); fs::exists(volpath))
+        {
+            cerr << volpath.string() << " already exists." << endl;
+            return 1;
+        }
+    }
+
+    auto journal_path = outpath;
+    journal_path += L".journal";
+    shared_ptr<journal_c> journal;
+    unique_ptr<pack_i> outp;
+    if (oopts.resume && fs::exists(journal_path) && fs::exists(outpath))
+    {
+        journal = make_shared<journal_c>(journal_path, true);
+        if ((outp = pack_i::resume_pack(outpath, *journal, warn_func)) == nullptr)
+        {
+            cerr << "Can't resume " << outpack << ", remove " << journal_path.string() << " to start over." << endl;
+            return 1;
+        }
+
+        //What the journal has is in the pack already
+        unordered_set<wstring> done;
+        for (const auto& e : journal->entries())
+            done.insert(boost::to_lower_copy(e.name));
+        for (auto& v : volumes)
+            erase_if(v, [&](const auto& e) { return done.contains(boost::to_lower_copy(e.name)); });
+        wcout << L"Resuming after " << journal->entries().size() << L" files." << endl;
+    }
+    else
+    {
+        if ((outp = pack_i::open_pack(outpath, pack_i::mode::rw_new, warn_func)) == nullptr)
+        {
+            cerr << "Open failed: " << outpack << endl;
+            return 1;
+        }
+        if (oopts.resume)
+            journal = make_shared<journal_c>(journal_path, false);
+    }
+    outp->set_write_options(oopts.write);
+    outp->set_journal(journal);
+
+    //Entries are read ahead from the packs opened above, which only hand out readers of their own
+    vector<const pack_i*> readable;
+    ranges::transform(inpacks, back_inserter(readable), [](const auto& p) { return p.get(); });
+    const auto ahead_budget = max<uint64_t>(uint64_t(16) << 20, (uint64_t(256) << 20) / volumes.size());
 
-    for (auto pinp = begin(pinputs); pinp != end(pinputs); ++pinp)
+    auto& progress = outpack == STDIO ? wcerr : wcout;
+    mutex progress_lock;
+    auto write_volume = [&](size_t vol, pack_i& outp, vector<unique_ptr<pack_i>>& sources)
     {
-        const auto& inp = *pinp;  
-        for (const auto& filename : inp->file_names() | views::filter(filter)
-            | views::transform([](const auto& v) { return wstring{ v }; }))
+        auto sizes = volumes[vol] | views::transform(&planned_t::size);
+        if (!outp.pre_reserve(volumes[vol].size(), accumulate(begin(sizes), end(sizes), uint64_t(0))))
         {
-            if (find_if(pinp + 1, end(pinputs),
-                [&](const auto& p) { return p->contains_entry(filename); }) != end(pinputs))
+            cerr << "Failed to reserve space in file " << pack_i::volume_path(outpath, vol, oopts.name_template) << endl;
+            return 1;
+        }
+
+        vector<tuple<size_t, pack_i::entry_info_t>> items;
+        for (const auto& e : volumes[vol])
+        {
+            pack_i::entry_info_t info;
+            info.name = e.name;
+            info.size = e.size;
+            info.index = e.index;
+            items.emplace_back(e.input, info);
+        }
+        prefetch_c ahead(readable, std::move(items), ahead_budget);
+
+        for (size_t n = 0; n < volumes[vol].size(); ++n)
+        {
+            const auto& [input, filename, size, index, timestamp] = volumes[vol][n];
+            if (sources[input] == nullptr && (sources[input] = pack_i::open_pack(path_strip(inpack[input]), pack_i::mode::read_only, &warn_func)) == nullptr)
             {
-                //File will appear in a later pack so we skip the earlier occurance
+                cerr << "Open failed: " << path_strip(inpack[input]) << endl;
+                return 1;
+            }
+
+            auto& inp = *sources[input];
+            pack_i::entry_info_t info;
+            info.name = filename;
+            info.index = index;
+            const auto data = ahead.take(n);
+            const auto ok = (data || inp.open_entry(info)) && outp.new_entry(filename, timestamp, size);
+            if (ok)
+            {
+                if (!(data ? outp.write(data->data(), data->size()) == data->size() : copy_data(inp, outp)))
+                {
+                    cerr << "Write error." << endl;
+                    return 1;
+                }
+                outp.close_write_entry();
+                inp.close_read_entry();
+            }
+
+            lock_guard lock(progress_lock);
+            progress << filename << (ok ? L"...OK" : L"...Failed") << endl;
+        }
+        outp.close_pack();
+        return 0;
+    };
+
+    if (volumes.size() == 1u)
+    {
+        const auto r = write_volume(0, *outp, inpacks);
+        if (r == 0 && journal)
+            journal->remove();
+        return r;
+    }
+
+    //The largest volumes are started first so a big one doesn't finish alone at the end
+    vector<tuple<uint64_t, size_t>> vol_sizes;
+    for (size_t vol = 1; vol < volumes.size(); ++vol)
+    {
+        auto sizes = volumes[vol] | views::transform(&planned_t::size);
+        vol_sizes.emplace_back(accumulate(begin(sizes), end(sizes), uint64_t(0)), vol);
+    }
+    ranges::stable_sort(vol_sizes, greater{}, [](const auto& v) { return get<0>(v); });
+    const vector<size_t> vol_order(begin(vol_sizes | views::elements<1>), end(vol_sizes | views::elements<1>));
+
+    //Packs can't be shared between threads, so every volume borrows a set of source
+    //packs that no other volume is using. They are opened as they are needed.
+    mutex pool_lock;
+    vector<vector<unique_ptr<pack_i>>> source_pool;
+    atomic<int> result = 0;
+    task_group_c tasks;
+    auto failed = [&]()
+    {
+        result = 1;
+        tasks.cancel();
+    };
+
+    auto write_other = [&](size_t vol)
+    {
+        vector<unique_ptr<pack_i>> sources(inpack.size());
+        {
+            lock_guard lock(pool_lock);
+            if (!source_pool.empty())
+            {
+                sources = std::move(source_pool.back());
+                source_pool.pop_back();
+            }
+        }
+
+        const auto volpath = pack_i::volume_path(outpath, vol, oopts.name_template);
+        auto volp = pack_i::open_pack(volpath, pack_i::mode::rw_new, warn_func);
+        if (volp == nullptr)
+        {
+            cerr << "Open failed: " << volpath << endl;
+            return failed();
+        }
+        volp->set_write_options(oopts.write);
+        if (write_volume(vol, *volp, sources) != 0)
+            return failed();
+
+        lock_guard lock(pool_lock);
+        source_pool.push_back(std::move(sources));
+    };
+
+    tasks.run([&]()
+    {
+        if (write_volume(0, *outp, inpacks) != 0)
+            failed();
+    });
+    for (const auto vol : vol_order)
+        tasks.run([&write_other, vol]() { write_other(vol); });
+    tasks.wait();
+    return result;
+}
+
+//Removes a temporary output when it goes out of scope, unless it has been kept. Anything writing
+//to it has to be gone by then.
+struct temp_output_t
+{
+    fs::path path;
+    bool keep = false;
+
+    ~temp_output_t()
+    {
+        error_code ec;
+        if (!keep)
+            fs::remove(path, ec);
+    }
+};
+
+//Rewrites a pack from the folder it was made from. Files whose size and time stamp are the
+//same as in the pack have their data copied from it as it is stored, so only the files that
+//changed are compressed. Files that are gone from the folder are dropped.
+static int sync_pack(const string& folder, const string& outpack, const name_filter& filter, const output_opts_t& oopts)
+{
+    const auto inpath = path_strip(folder);
+    const auto outpath = path_strip(outpack);
+    if (!fs::is_directory(inpath))
+    {
+        cerr << inpath.string() << " is not a directory." << endl;
+        return 1;
+    }
+    if (outpack == STDIO || fs::is_directory(outpath) || outpath.extension().empty() || oopts.max_size || oopts.max_entries || oopts.resume)
+    {
+        cerr << "--sync needs a pack file as output and can't be used with volumes or --resume." << endl;
+        return 1;
+    }
+    if (!fs::exists(outpath))
+        return convert_pack({ folder }, outpack, filter, oopts);
+
+    auto inp = pack_i::open_pack(inpath, pack_i::mode::read_only, &warn_func);
+    auto oldp = pack_i::open_pack(outpath, pack_i::mode::read_only, &warn_func);
+    if (inp == nullptr || oldp == nullptr)
+    {
+        cerr << "Open failed: " << (inp == nullptr ? inpath : outpath).string() << endl;
+        return 1;
+    }
+
+    //Same folder, so the new pack can be renamed over the old one
+    const auto tmp = outpath.parent_path() / (outpath.stem().wstring() + L"-sync" + outpath.extension().wstring());
+    if (fs::exists(tmp))
+    {
+        cerr << tmp.string() << " already exists." << endl;
+        return 1;
+    }
+    temp_output_t tmp_output{ tmp };
+    auto outp = pack_i::open_pack(tmp, pack_i::mode::rw_new, warn_func);
+    if (outp == nullptr)
+    {
+        cerr << "Open failed: " << tmp.string() << endl;
+        return 1;
+    }
+    outp->set_write_options(oopts.write);
+
+    const auto entries = inp->entries(filter, pack_i::order::offset);
+    auto sizes = entries | views::transform(&pack_i::entry_info_t::size);
+    outp->pre_reserve(entries.size(), accumulate(begin(sizes), end(sizes), uint64_t(0)));
+
+    size_t unchanged = 0, written = 0;
+    auto write_all = [&]()
+    {
+        for (const auto& e : entries)
+        {
+            //Zip time stamps are in steps of two seconds
+            const wstring name{ e.name };
+            const auto old = oldp->entry_info(name);
+            if (old && old->name == e.name && old->size == e.size && old->timestamp && e.timestamp
+                && abs((*e.timestamp - *old->timestamp).total_seconds()) < 2
+                && outp->copy_stored(*oldp, *old, e.timestamp))
+            {
+                ++unchanged;
                 continue;
             }
-            wcout << filename << L"...";
-            wcout.flush();
-            if (inp->open_entry(filename) && outp->new_entry(filename, inp->entry_timestamp()))
+
+            const auto ok = inp->open_entry(e) && outp->new_entry(name, e.timestamp, e.size);
+            if (ok)
             {
-                uint8_t buf[0xFFFF];
-                for (auto s = inp->read(buf, size(buf)); s > 0; s = inp->read(buf, size(buf)))
+                if (!copy_data(*inp, *outp))
                 {
-                    if (outp->write(buf, s) != s)
-                    {
-                        cerr << "Write error." << endl;
-                        return 1;
-                    }
+                    cerr << "Write error." << endl;
+                    return false;
                 }
                 outp->close_write_entry();
                 inp->close_read_entry();
-                wcout << L"OK" << endl;
-            }
-            else
-            {
-                cerr << "Failed" << endl;
+                ++written;
             }
+            wcout << name << (ok ? L"...OK" : L"...Failed") << endl;
+        }
+        return true;
+    };
+
+    if (!write_all() || !outp->close_pack())
+        return 1;
+    outp.reset();
+    oldp.reset();
+    fs::rename(tmp, outpath);
+    tmp_output.keep = true;
+    wcout << outpath.wstring() << L": " << unchanged << L" unchanged, " << written << L" written" << endl;
+    return 0;
+}
+
+//Rewrites .pk3 files with every entry compressed the best of several ways. A pack is
+//only replaced if the new one is smaller.
+static int recompress_packs(const vector<string>& packs, const output_opts_t& oopts)
+{
+    for (const auto& pack : packs)
+    {
+        const auto path = path_strip(pack);
+        if (!boost::iequals(path.extension().wstring(), L".pk3"))
+        {
+            cerr << "Only .pk3 files can be recompressed: " << pack << endl;
+            return 1;
+        }
+
+        //Same folder, so the new pack can be renamed over the old one
+        const auto tmp = path.parent_path() / (path.stem().wstring() + L"-recompress.pk3");
+        if (fs::exists(tmp))
+        {
+            cerr << tmp.string() << " already exists." << endl;
+            return 1;
+        }
+
+        const auto before = fs::file_size(path);
+        temp_output_t tmp_output{ tmp };
+        if (auto r = convert_pack({ pack }, tmp.string(), name_filter{}, oopts); r != 0)
+            return r;
+
+        //A pack that didn't get smaller is left to be removed
+        const auto after = fs::file_size(tmp);
+        if (after < before)
+        {
+            fs::rename(tmp, path);
+            tmp_output.keep = true;
         }
-        inp->close_pack();
+        wcout << path.wstring() << L": " << before << L" -> " << min(before, after) << L" bytes" << endl;
+    }
+    return 0;
+}
+
+static int stat_entry(const string& pack, const string& entry)
+{
+    auto ppack = pack_i::open_pack(path_strip(pack), pack_i::mode::read_only, &warn_func);
+    if (ppack == nullptr)
+    {
+        cerr << "Open failed: " << pack << endl;
+        return 1;
+    }
+
+    const auto info = ppack->entry_info(conv::utf_to_utf<wchar_t>(entry));
+    if (!info.has_value())
+        return 1;
+
+    wcout << stat_line(*info) << endl;
+    return 0;
+}
+
+static int cat_entry(const string& pack, const string& entry)
+{
+    auto ppack = pack_i::open_pack(path_strip(pack), pack_i::mode::read_only, &warn_func);
+    if (ppack == nullptr)
+    {
+        cerr << "Open failed: " << pack << endl;
+        return 1;
+    }
+
+    if (!ppack->open_entry(conv::utf_to_utf<wchar_t>(entry)))
+        return 1;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    uint8_t buf[0xFFFF];
+    for (auto s = ppack->read(buf, size(buf)); s > 0; s = ppack->read(buf, size(buf)))
+        cout.write(reinterpret_cast<const char*>(buf), static_cast<streamsize>(s));
+    cout.flush();
+    return cout.fail() ? 1 : 0;
+}
+
+static int remote_packs(const string& socket_path, request_t req, const vector<string>& packs, const vector<string>& args)
+{
+    //The server has its own working directory
+    auto to_arg = [](const auto& v) { return conv::utf_to_utf<char>(fs::absolute(path_strip(v)).wstring()); };
+    for (const auto& pack : packs)
+    {
+        vector reqargs{ to_arg(pack) };
+        reqargs.insert(end(reqargs), begin(args), end(args));
+        if (auto r = remote_request(socket_path, req, reqargs); r != 0)
+            return r;
     }
-    outp->close_pack();
     return 0;
 }
 
-static int extract_pack(const vector<string>& inpack, const string& outpack, file_filter auto filter)
+static int extract_pack(const vector<string>& inpack, const string& outpack, const name_filter& filter, const output_opts_t& oopts = {}, bool low_memory = false)
 {
     const auto outdir = fs::path{ outpack };
     if (!fs::is_directory(outdir))
@@ -242,11 +1212,29 @@ static int extract_pack(const vector<string>& inpack, const string& outpack, fil
         return 1;
     }
 
-    for (const auto [inp, outp] : inpack
-        | views::transform([&](const auto& v)
-            { return make_tuple(v, (outpack / fs::path(v).filename().replace_extension(L""))); }))
+    auto stem = [](const string& v) { return v == STDIO ? fs::path("stdin") : fs::path(v).filename().replace_extension(L""); };
+
+    //Packs with the same name in different folders, like v1/pak0.pk3 and v2/pak0.pk3, get the
+    //name of their folder in front, v1_pak0 and v2_pak0, and a number after it if that's not enough
+    unordered_map<wstring, size_t> stems;
+    for (const auto& v : inpack)
+        ++stems[stem(v).wstring()];
+
+    unordered_set<wstring> used;
+    for (const auto& inp : inpack)
     {
-        if (auto r = convert_pack({ inp }, outp.string(), filter); r != 0)
+        auto name = stem(inp).wstring();
+        if (stems[name] > 1u)
+        {
+            if (const auto parent = fs::absolute(fs::path(inp)).parent_path().filename(); inp != STDIO && !parent.empty())
+                name = parent.wstring() + L"_" + name;
+        }
+        const auto base = name;
+        for (auto n = 2u; used.contains(name); ++n)
+            name = format(L"{}_{}", base, n);
+        used.insert(name);
+
+        if (auto r = convert_pack({ inp }, (outdir / name).string(), filter, oopts, low_memory); r != 0)
             return r;
     }
     return 0;
@@ -257,41 +1245,162 @@ int main(int argc, char** argv)
     po::options_description desc(format("Paktool {}.{}.{} usage", PAKTOOL_MAJOR, PAKTOOL_MINOR, PAKTOOL_PATCH));
     desc.add_options()
         ("help,h", "Display usage instructions.")
-        ("list,l", po ::value<vector<string>>()->multitoken(), "List contents of the specified file(s).")
-        ("output,o", po::value<string>(), "Output file (or folder) to convert to (use with -c).")
+        ("list,l", po ::value<vector<string>>()->multitoken(), "List contents of the specified file(s). Use - to read a pack from stdin.")
+        ("output,o", po::value<string>(), "Output file (or folder) to convert to (use with -c). Use - to write a .pk3 to stdout.")
         ("extract,x", po::value<vector<string>>()->multitoken(), "Extract the contents of the pack file, a new subfolder will be created and named after each pack.")
         ("convert,c", po::value<vector<string>>()->multitoken(), "Convert one or more packs to other formats. Output format determined by file extension.")
         ("compare", po::value<vector<string>>()->multitoken(), "Compare the contents of two packs. Exactly two -i parameters must be given.")
-        ("filter", po::value<string>(), "Filter for -l, -x, or -c, will match all files that contain the parameter anywhere in the name.");
+        ("dupes", po::value<vector<string>>()->multitoken(), "Find files with the same contents in any of the specified packs and folders, and how much space the copies take.")
+        ("filter", po::value<vector<string>>()->composing(), "Filter for -l, -x, or -c, will match all files that contain the parameter anywhere in the name.")
+        ("include", po::value<vector<string>>()->composing(), "Only use files that match the glob pattern (*, ?, [a-z], **). Can be given more than once.")
+        ("exclude", po::value<vector<string>>()->composing(), "Skip files that match the glob pattern. Can be given more than once.")
+        ("regex", po::value<vector<string>>()->composing(), "Only use files where the regular expression is found in the name. Can be given more than once.")
+        ("jobs,j", po::value<unsigned>(), "Number of threads to use for everything paktool does in parallel. The default is one per core.")
+        ("low-memory", "Read packs in one pass over their directory without indexing them, for packs with more entries than fit in memory. Works with -l, -x, -c and --compare.")
+        ("format", po::value<string>(), "Output of -l: plain (names only), tsv, json or ndjson with sizes, method, CRC, time stamp and offset.")
+        ("max-volume-size", po::value<string>(), "Split the output of -c into volumes no larger than this. Sizes can end with K, M or G.")
+        ("max-entries", po::value<size_t>(), "Split the output of -c into volumes with at most this many files.")
+        ("volume-name", po::value<string>(), "Name of the volumes after the first, {name} is the output name without number and {n} the volume number.")
+        ("align", po::value<string>(), "Start the data of files stored without compression in a .pk3 at a multiple of this many bytes, like 4K, so they can be memory mapped.")
+        ("optimize", "Compress every file in a .pk3 written by -c several ways on all cores and keep the smallest.")
+        ("sync", po::value<string>(), "Bring the pack given with -o up to date with the specified folder. Files with the same size and time stamp as in the pack are copied without compressing them again.")
+        ("recompress", po::value<vector<string>>()->multitoken(), "Rewrite the specified .pk3 files like --optimize, keeping each only if it gets smaller.")
+        ("dedupe", po::value<string>(), "Files extracted by -x or written to a folder by -c with the same contents as one written before by the same run become a reflink (falling back to a hard link) or a hard link to it instead of another copy. Files already in the output folder aren't matched.")
+        ("resume", "Continue a -c or -x that was stopped, from the journal kept next to the output while it is written. Files that were completely written are not copied again, outputs that have no journal left are complete and skipped.")
+        ("layout", po::value<string>(), "Order of the files written by -c: stored (as in the inputs, the default) or folder (grouped by folder).")
+        ("test,t", po::value<vector<string>>()->multitoken(), "Check the integrity of the specified file(s) and list problems found.")
+        ("stat", po::value<vector<string>>()->multitoken(), "Show information about one entry. Give the pack followed by the entry name.")
+        ("cat", po::value<vector<string>>()->multitoken(), "Write one entry to stdout. Give the pack followed by the entry name.")
+        ("serve", po::value<string>(), "Keep packs open and answer requests on the specified local socket.")
+        ("socket", po::value<string>(), "Send -l, -x, --stat and --cat requests to a server on the specified local socket.");
 
     try
     {
         po::variables_map vm;
         po::store(parse_command_line(argc, argv, desc), vm);
         po::notify(vm);
+        const auto low_memory = vm.count("low-memory") > 0;
+        if (vm.count("jobs") > 0)
+            scheduler_c::set_default_threads(max(1u, vm["jobs"].as<unsigned>()));
 
-        auto make_filter = [&]()
+        auto filter_terms = [&]()
         {
             auto enc = boost::locale::util::get_system_locale();
             if (auto r = ranges::find(enc, '.'); r != end(enc))
                 enc = { r + 1, end(enc) };
 
-            const auto s = vm.count("filter") > 0
-                ? conv::to_utf<wchar_t>(vm["filter"].as<string>(), enc)
-                : wstring{};
+            constexpr array opts =
+            {
+                tuple{ "filter", true, name_filter::kind::contains },
+                tuple{ "include", true, name_filter::kind::glob },
+                tuple{ "exclude", false, name_filter::kind::glob },
+                tuple{ "regex", true, name_filter::kind::regex }
+            };
 
-            return [s](const wstring_view& v) { return s.empty() || boost::icontains(v, s); };
+            vector<filter_term_t> terms;
+            for (const auto& [opt, include, kind] : opts | views::filter([&](const auto& v) { return vm.count(get<0>(v)) > 0; }))
+            {
+                ranges::transform(vm[opt].as<vector<string>>(), back_inserter(terms),
+                    [&](const auto& v) { return filter_term_t{ include, kind, conv::to_utf<wchar_t>(v, enc) }; });
+            }
+            return terms;
+        };
+
+        //Options for how packs are written, shared by -c and --recompress
+        output_opts_t oopts;
+        if (vm.count("align") > 0)
+            oopts.write.align = parse_align(vm["align"].as<string>());
+        if (vm.count("layout") > 0)
+            oopts.by_folder = parse_layout(vm["layout"].as<string>());
+        oopts.write.optimize = vm.count("optimize") > 0 || vm.count("recompress") > 0;
+        if (vm.count("dedupe") > 0)
+            oopts.write.dedupe = parse_dedupe(vm["dedupe"].as<string>());
+        oopts.resume = vm.count("resume") > 0;
+
+        auto entry_args = [&](const char* opt)
+        {
+            auto args = vm[opt].as<vector<string>>();
+            if (args.size() != 2u)
+                throw runtime_error(format("--{} takes a pack and an entry name.", opt));
+            return args;
         };
 
         if (vm.count("help") > 0)
         {
             cout << desc << endl;
         }
+        else if (vm.count("serve") > 0)
+        {
+            return serve_packs(vm["serve"].as<string>());
+        }
+        else if (vm.count("socket") > 0)
+        {
+            const auto sock = vm["socket"].as<string>();
+            const auto filter = encode_filter(filter_terms());
+            if (vm.count("format") > 0)
+            {
+                cerr << "--format can't be used with --socket." << endl;
+                return 1;
+            }
+            if (vm.count("list") > 0)
+                return remote_packs(sock, request_t::list, vm["list"].as<vector<string>>(), { filter });
+            else if (vm.count("extract") > 0)
+            {
+                const auto outpath = vm.count("output") > 0 ? fs::path(vm["output"].as<string>()) : fs::current_path();
+                return remote_packs(sock, request_t::extract, vm["extract"].as<vector<string>>(),
+                    { conv::utf_to_utf<char>(fs::absolute(outpath).wstring()), filter });
+            }
+            else if (vm.count("stat") > 0)
+            {
+                const auto args = entry_args("stat");
+                return remote_packs(sock, request_t::stat, { args[0] }, { args[1] });
+            }
+            else if (vm.count("cat") > 0)
+            {
+                const auto args = entry_args("cat");
+                return remote_packs(sock, request_t::read, { args[0] }, { args[1] });
+            }
+
+            cerr << "Only -l, -x, --stat and --cat can be sent to a server." << endl;
+            return 1;
+        }
+        else if (vm.count("recompress") > 0)
+        {
+            return recompress_packs(vm["recompress"].as<vector<string>>(), oopts);
+        }
+        else if (vm.count("dupes") > 0)
+        {
+            return find_dupes(vm["dupes"].as<vector<string>>(), make_filter(filter_terms()));
+        }
+        else if (vm.count("test") > 0)
+        {
+            return test_packs(vm["test"].as<vector<string>>());
+        }
+        else if (vm.count("stat") > 0)
+        {
+            const auto args = entry_args("stat");
+            return stat_entry(args[0], args[1]);
+        }
+        else if (vm.count("cat") > 0)
+        {
+            const auto args = entry_args("cat");
+            return cat_entry(args[0], args[1]);
+        }
         else if (vm.count("list") > 0)
         {
-            if (auto r = list_pack(vm["list"].as<vector<string>>(), make_filter()); r != 0)
+            const auto fmt = vm.count("format") > 0 ? list_writer_c::parse_format(vm["format"].as<string>()) : list_writer_c::format_t::plain;
+            if (auto r = list_pack(vm["list"].as<vector<string>>(), make_filter(filter_terms()), fmt, low_memory); r != 0)
                 return r;
         }
+        else if (vm.count("sync") > 0)
+        {
+            if (vm.count("output") <= 0)
+            {
+                cerr << "No output file." << endl;
+                return 1;
+            }
+            return sync_pack(vm["sync"].as<string>(), vm["output"].as<string>(), make_filter(filter_terms()), oopts);
+        }
         else if (vm.count("convert") > 0)
         {
             if (vm.count("output") <= 0)
@@ -300,7 +1409,13 @@ int main(int argc, char** argv)
                 return 1;
             }
 
-            if (auto r = convert_pack(vm["convert"].as<vector<string>>(), vm["output"].as<string>(), make_filter()); r != 0)
+            if (vm.count("max-volume-size") > 0)
+                oopts.max_size = parse_size(vm["max-volume-size"].as<string>());
+            if (vm.count("max-entries") > 0)
+                oopts.max_entries = max(size_t(1), vm["max-entries"].as<size_t>());
+            if (vm.count("volume-name") > 0)
+                oopts.name_template = conv::utf_to_utf<wchar_t>(vm["volume-name"].as<string>());
+            if (auto r = convert_pack(vm["convert"].as<vector<string>>(), vm["output"].as<string>(), make_filter(filter_terms()), oopts, low_memory); r != 0)
                 return r;
         }
         else if (vm.count("extract") > 0)
@@ -309,14 +1424,14 @@ int main(int argc, char** argv)
                 ? vm["output"].as<string>()
                 : fs::current_path().string();
 
-            if (auto r = extract_pack(vm["extract"].as<vector<string>>(), outpath, make_filter()); r != 0)
+            if (auto r = extract_pack(vm["extract"].as<vector<string>>(), outpath, make_filter(filter_terms()), oopts, low_memory); r != 0)
                 return r;
         }
         else if (vm.count("compare") > 0)
         {
             const auto cmp = vm["compare"].as<vector<string>>();
             if (cmp.size() == 2u)
-                return compare_packs(cmp[0], cmp[1]);
+                return low_memory ? compare_packs_low_memory(cmp[0], cmp[1]) : compare_packs(cmp[0], cmp[1]);
 
             cerr << "Specify 2 input files to compare with." << endl;
             return 1;
@@ -0,0 +1,98 @@
+#include "prefetch.h"
+
+using namespace std;
+using namespace pak;
+
+prefetch_c::prefetch_c(const vector<const pack_i*>& inputs, vector<tuple<size_t, pack_i::entry_info_t>> items, uint64_t budget)
+    : m_packs(inputs), m_items(std::move(items)), m_inputs(inputs.size()), m_budget(budget)
+{
+    for (size_t pos = 0; pos < m_items.size(); ++pos)
+        m_inputs[get<0>(m_items[pos])].items.push_back(pos);
+
+    lock_guard lock(m_lock);
+    start();
+}
+
+optional<prefetch_c::data_t> prefetch_c::take(size_t n)
+{
+    unique_lock lock(m_lock);
+    auto& in = m_inputs[get<0>(m_items[n])];
+    const auto current = [&]() { return in.next < in.items.size() && in.items[in.next] == n; };
+    m_done.wait(lock, [&]() { return !(in.running && current()); });
+
+    optional<data_t> data;
+    if (const auto r = m_ready.find(n); r != end(m_ready))
+    {
+        data = std::move(r->second);
+        m_ready.erase(r);
+    }
+    else if (current())
+    {
+        //Not started yet, a task that is waiting for it skips it
+        ++in.next;
+    }
+
+    if (n < m_window)
+        m_window_size -= get<1>(m_items[n]).size;
+    m_taken = n + 1;
+    start();
+    return data;
+}
+
+void prefetch_c::start()
+{
+    m_window = max(m_window, m_taken);
+    while (m_window < m_items.size() && m_window_size + get<1>(m_items[m_window]).size <= m_budget)
+        m_window_size += get<1>(m_items[m_window++]).size;
+
+    for (size_t i = 0; i < m_inputs.size(); ++i)
+    {
+        auto& in = m_inputs[i];
+        if (in.queued || in.next >= in.items.size() || in.items[in.next] >= m_window)
+            continue;
+
+        in.queued = true;
+        m_tasks.run([this, i, pos = in.items[in.next]]() { read(i, pos); });
+    }
+}
+
+void prefetch_c::read(size_t input, size_t pos)
+{
+    auto& in = m_inputs[input];
+    {
+        lock_guard lock(m_lock);
+        if (in.next >= in.items.size() || in.items[in.next] != pos)
+        {
+            //The writer got there first
+            in.queued = false;
+            start();
+            return;
+        }
+        in.running = true;
+    }
+
+    const auto& info = get<1>(m_items[pos]);
+    optional<data_t> data;
+    try
+    {
+        if (auto reader = m_packs[input]->open_reader(info))
+        {
+            data.emplace(static_cast<size_t>(info.size));
+            if (reader->read(data->data(), data->size()) != data->size())
+                data.reset();
+        }
+    }
+    catch (const exception&)
+    {
+        data.reset();
+    }
+
+    lock_guard lock(m_lock);
+    if (data)
+        m_ready.emplace(pos, std::move(*data));
+    ++in.next;
+    in.running = false;
+    in.queued = false;
+    m_done.notify_all();
+    start();
+}
@@ -0,0 +1,57 @@
+#ifndef PREFETCH_H_INCLUDED
+#define PREFETCH_H_INCLUDED
+#include <pack.h>
+#include <scheduler.h>
+#include <vector>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+//Reads the entries a conversion writes ahead of the writer, from all inputs at the same time,
+//so inputs on different disks are all kept busy. Every input is read in the order its entries
+//are written, one entry at a time, as tasks on scheduler_c::instance(). Only entries within
+//budget bytes of the writer are read ahead. Entries that couldn't be read ahead are left to
+//the writer, which reports any errors, so this never fails on its own.
+class prefetch_c
+{
+public:
+    using data_t = std::vector<std::uint8_t>;
+
+    //items are (input, entry) in the order they are written. The names in the entries and
+    //the packs must stay valid until this is destroyed.
+    prefetch_c(const std::vector<const pak::pack_i*>& inputs, std::vector<std::tuple<size_t, pak::pack_i::entry_info_t>> items,
+        std::uint64_t budget);
+    prefetch_c(const prefetch_c&) = delete;
+    prefetch_c& operator=(const prefetch_c&) = delete;
+
+    //Content of item n, items are taken in order. nullopt if the writer has to read it itself.
+    std::optional<data_t> take(size_t n);
+private:
+    struct input_t
+    {
+        std::vector<size_t> items;  //Positions in m_items
+        size_t next = 0;            //In items, the next one to read
+        bool queued = false;        //A task for items[next] is waiting or running
+        bool running = false;
+    };
+
+    std::vector<const pak::pack_i*> m_packs;
+    std::vector<std::tuple<size_t, pak::pack_i::entry_info_t>> m_items;
+    std::vector<input_t> m_inputs;
+    std::uint64_t m_budget;
+    size_t m_taken = 0;             //Items before this are written
+    size_t m_window = 0;            //Items before this may be read ahead
+    std::uint64_t m_window_size = 0;
+    std::map<size_t, data_t> m_ready;
+    std::mutex m_lock;
+    std::condition_variable m_done;
+    pak::task_group_c m_tasks;      //Last, so the tasks are done before anything they use is gone
+
+    void read(size_t input, size_t pos);
+    //Queues the next entry of every input that is idle, with m_lock held
+    void start();
+};
+
+#endif
@@ -0,0 +1,399 @@
+#include "server.h"
+#include "filter_args.h"
+#include <pack.h>
+#include <boost/asio.hpp>
+#include <boost/endian.hpp>
+#include <boost/locale.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <iostream>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <chrono>
+
+namespace asio = boost::asio;
+namespace fs = std::filesystem;
+namespace conv = boost::locale::conv;
+using namespace std;
+using namespace pak;
+
+wstring stat_line(const pack_i::entry_info_t& info)
+{
+    auto or_dash = [](const auto& v, auto f) { return v.has_value() ? f(*v) : L"-"s; };
+    return format(L"{}\t{}\t{}\t{}\t{}\t{}", info.name,
+        or_dash(info.timestamp, [](const auto& ts) { return boost::posix_time::to_iso_extended_wstring(ts); }),
+        info.size, info.stored_size,
+        or_dash(info.crc, [](auto crc) { return format(L"{:08x}", crc); }),
+        or_dash(info.offset, [](auto offs) { return to_wstring(offs); }));
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using local_socket = asio::local::stream_protocol::socket;
+
+namespace
+{
+    //All messages are frames of a 32 bit little endian length followed by that many bytes.
+    //A request is a single frame with the request byte followed by length prefixed UTF-8 arguments.
+    //The answer is a status frame, '+' or '-' followed by a message, then data frames ending with an empty frame.
+    //A connection carries one request, and is dropped if the request doesn't come within request_timeout.
+    constexpr uint32_t max_request = 1u << 20;
+    constexpr auto request_timeout = chrono::seconds(10);
+    constexpr size_t chunk_size = 0x10000;
+
+    void write_frame(local_socket& s, string_view data)
+    {
+        const auto len = boost::endian::native_to_little(static_cast<uint32_t>(data.size()));
+        asio::write(s, array{ asio::buffer(&len, sizeof(len)), asio::buffer(data.data(), data.size()) });
+    }
+
+    optional<string> read_frame(local_socket& s, uint32_t max_len = numeric_limits<uint32_t>::max())
+    {
+        uint32_t len = 0;
+        boost::system::error_code ec;
+        asio::read(s, asio::buffer(&len, sizeof(len)), ec);
+        if (ec == asio::error::eof)
+            return {};
+        else if (ec)
+            throw boost::system::system_error(ec);
+
+        len = boost::endian::little_to_native(len);
+        if (len > max_len)
+            throw runtime_error("Frame too large.");
+        string data(len, '\0');
+        asio::read(s, asio::buffer(data));
+        return data;
+    }
+
+    //Like read_frame, but gives up on a client that doesn't send the whole request in time
+    optional<string> read_request(asio::io_context& ctx, local_socket& s)
+    {
+        uint32_t len = 0;
+        string data;
+        boost::system::error_code result;
+        auto done = false;
+        asio::async_read(s, asio::buffer(&len, sizeof(len)), [&](const boost::system::error_code& ec, size_t)
+        {
+            len = boost::endian::little_to_native(len);
+            if (ec || len > max_request)
+            {
+                result = ec ? ec : asio::error::message_size;
+                done = true;
+                return;
+            }
+            data.resize(len);
+            asio::async_read(s, asio::buffer(data), [&](const boost::system::error_code& ec, size_t)
+            {
+                result = ec;
+                done = true;
+            });
+        });
+        ctx.restart();
+        ctx.run_for(request_timeout);
+        if (!done)
+        {
+            //Cancels the read, its handler has to run before the buffers go away
+            s.close();
+            ctx.restart();
+            ctx.run();
+            throw runtime_error("No request in time.");
+        }
+
+        if (result == asio::error::eof && data.empty())
+            return {};
+        else if (result == asio::error::message_size)
+            throw runtime_error("Frame too large.");
+        else if (result)
+            throw boost::system::system_error(result);
+        return data;
+    }
+
+    string encode_request(request_t req, const vector<string>& args)
+    {
+        string data(1, static_cast<char>(req));
+        for (const auto& arg : args)
+        {
+            const auto len = boost::endian::native_to_little(static_cast<uint32_t>(arg.size()));
+            data.append(reinterpret_cast<const char*>(&len), sizeof(len));
+            data.append(arg);
+        }
+        return data;
+    }
+
+    tuple<request_t, vector<string>> decode_request(string_view data)
+    {
+        if (data.empty())
+            throw runtime_error("Empty request.");
+
+        const auto req = static_cast<request_t>(data.front());
+        vector<string> args;
+        for (data.remove_prefix(1); !data.empty(); )
+        {
+            uint32_t len = 0;
+            if (data.size() < sizeof(len))
+                throw runtime_error("Malformed request.");
+            memcpy(&len, data.data(), sizeof(len));
+            len = boost::endian::little_to_native(len);
+            data.remove_prefix(sizeof(len));
+            if (data.size() < len)
+                throw runtime_error("Malformed request.");
+            args.emplace_back(data.substr(0, len));
+            data.remove_prefix(len);
+        }
+        return { req, std::move(args) };
+    }
+
+    class pack_cache_c
+    {
+    public:
+        //Packs kept open at most, the one used longest ago is closed to make room
+        static constexpr size_t max_packs = 64;
+
+        pack_i& get(const string& name)
+        {
+            const auto path = fs::weakly_canonical(fs::path(conv::utf_to_utf<wchar_t>(name)));
+            const auto mtime = fs::last_write_time(path);
+
+            if (auto r = m_packs.find(path); r != end(m_packs))
+            {
+                //Reopen if it has been modified since last time
+                if (r->second.mtime == mtime)
+                {
+                    r->second.used = ++m_uses;
+                    return *r->second.pack;
+                }
+                m_packs.erase(r);
+            }
+            if (m_packs.size() >= max_packs)
+                m_packs.erase(ranges::min_element(m_packs, {}, [](const auto& v) { return v.second.used; }));
+
+            auto ppack = pack_i::open_pack(path, pack_i::mode::read_only, [this](auto entry, auto msg) { m_warnings.emplace_back(entry, msg); });
+            if (ppack == nullptr)
+                throw runtime_error(format("Could not open {}", name));
+
+            return *m_packs.emplace(path, cached_t{ std::move(ppack), mtime, ++m_uses }).first->second.pack;
+        }
+
+        vector<tuple<wstring, wstring>> take_warnings()
+        {
+            return std::exchange(m_warnings, {});
+        }
+    private:
+        struct cached_t
+        {
+            unique_ptr<pack_i> pack;
+            fs::file_time_type mtime;
+            uint64_t used;
+        };
+        map<fs::path, cached_t> m_packs;
+        uint64_t m_uses = 0;
+        vector<tuple<wstring, wstring>> m_warnings;
+    };
+
+    //Sends text lines in frames of reasonable size
+    class line_writer_c
+    {
+    public:
+        explicit line_writer_c(local_socket& s) : m_sock(s)
+        {
+        }
+        void add(wstring_view line)
+        {
+            m_buf += conv::utf_to_utf<char>(line.data(), line.data() + line.size());
+            m_buf += '\n';
+            if (m_buf.size() >= chunk_size)
+                flush();
+        }
+        void flush()
+        {
+            if (!m_buf.empty())
+                write_frame(m_sock, m_buf);
+            m_buf.clear();
+        }
+    private:
+        local_socket& m_sock;
+        string m_buf;
+    };
+
+    //answered is set once the '+' status frame is sent, an error after that can't be a status frame
+    void handle_request(local_socket& s, pack_cache_c& cache, request_t req, const vector<string>& args, bool& answered)
+    {
+        constexpr array arg_count = { 2u, 2u, 2u, 3u };
+        const auto reqidx = static_cast<size_t>(req) - 1;
+        if (reqidx >= arg_count.size() || args.size() != arg_count[reqidx])
+            throw runtime_error("Invalid request.");
+
+        auto& pack = cache.get(args[0]);
+        const auto entry = conv::utf_to_utf<wchar_t>(args[1]);
+        line_writer_c lines(s);
+        auto answer = [&]()
+        {
+            write_frame(s, "+");
+            answered = true;
+        };
+
+        switch (req)
+        {
+        case request_t::list:
+            answer();
+            for (const auto& name : pack.file_names(make_filter(decode_filter(args[1]))))
+                lines.add(name);
+            break;
+        case request_t::stat:
+            if (const auto info = pack.entry_info(entry))
+            {
+                answer();
+                lines.add(stat_line(*info));
+                break;
+            }
+            throw runtime_error("Entry not found.");
+        case request_t::read:
+            if (!pack.open_entry(entry))
+                throw runtime_error("Entry not found.");
+            answer();
+            {
+                vector<char> buf(chunk_size);
+                for (auto n = pack.read(reinterpret_cast<uint8_t*>(buf.data()), buf.size()); n > 0;
+                    n = pack.read(reinterpret_cast<uint8_t*>(buf.data()), buf.size()))
+                {
+                    write_frame(s, { buf.data(), n });
+                }
+                pack.close_read_entry();
+            }
+            break;
+        case request_t::extract:
+            {
+                const auto outpath = fs::path(conv::utf_to_utf<wchar_t>(args[1]))
+                    / fs::path(conv::utf_to_utf<wchar_t>(args[0])).filename().replace_extension(L"");
+                auto outp = pack_i::open_pack(outpath, pack_i::mode::rw_new);
+                if (outp == nullptr)
+                    throw runtime_error(format("Could not create {}", outpath.string()));
+
+                answer();
+                for (const auto& info : pack.entries(make_filter(decode_filter(args[2])), pack_i::order::offset))
+                {
+                    const wstring name{ info.name };
+                    if (!pack.open_entry(info) || !outp->new_entry(name, info.timestamp, info.size))
+                    {
+                        lines.add(format(L"{}: Failed", name));
+                        continue;
+                    }
+                    uint8_t buf[chunk_size];
+                    for (auto n = pack.read(buf, size(buf)); n > 0; n = pack.read(buf, size(buf)))
+                    {
+                        if (outp->write(buf, n) != n)
+                            throw runtime_error("Write error.");
+                    }
+                    outp->close_write_entry();
+                    pack.close_read_entry();
+                    lines.add(format(L"{}: OK", name));
+                }
+                outp->close_pack();
+            }
+            break;
+        }
+
+        for (const auto& [wentry, msg] : cache.take_warnings())
+            lines.add(format(L"{}: {}", wentry, msg));
+        lines.flush();
+        write_frame(s, {});
+    }
+}
+
+int serve_packs(const string& socket_path)
+{
+    asio::io_context ctx;
+    //A stale socket from an earlier server is replaced, anything else is left alone
+    if (fs::is_socket(socket_path))
+        fs::remove(socket_path);
+    else if (fs::exists(socket_path))
+    {
+        cerr << socket_path << " exists and is not a socket." << endl;
+        return 1;
+    }
+    asio::local::stream_protocol::acceptor acceptor(ctx, asio::local::stream_protocol::endpoint(socket_path));
+    pack_cache_c cache;
+
+    //Packs aren't thread safe so clients are served one at a time, one request per connection
+    //so a client that keeps its connection open can't hold up the others
+    for (;;)
+    {
+        local_socket s(ctx);
+        acceptor.accept(s);
+        try
+        {
+            if (auto frame = read_request(ctx, s))
+            {
+                const auto [req, args] = decode_request(*frame);
+                auto answered = false;
+                try
+                {
+                    handle_request(s, cache, req, args, answered);
+                }
+                catch (const boost::system::system_error&)
+                {
+                    throw;
+                }
+                catch (const exception& e)
+                {
+                    //Data frames have gone out, the client sees the answer end without the empty frame
+                    if (answered)
+                        throw;
+                    cache.take_warnings();
+                    write_frame(s, "-"s + e.what());
+                    write_frame(s, {});
+                }
+            }
+        }
+        catch (const exception& e)
+        {
+            cerr << "Connection dropped: " << e.what() << endl;
+        }
+    }
+}
+
+int remote_request(const string& socket_path, request_t req, const vector<string>& args)
+{
+    asio::io_context ctx;
+    local_socket s(ctx);
+    s.connect(asio::local::stream_protocol::endpoint(socket_path));
+    write_frame(s, encode_request(req, args));
+
+    const auto status = read_frame(s);
+    if (!status.has_value() || status->empty())
+        throw runtime_error("No answer from server.");
+
+    if (status->front() != '+')
+        cerr << string_view{ *status }.substr(1) << endl;
+
+    auto frame = read_frame(s);
+    for (; frame.has_value() && !frame->empty(); frame = read_frame(s))
+        cout.write(frame->data(), static_cast<streamsize>(frame->size()));
+    cout.flush();
+
+    //The server closes the connection if it fails after answering
+    if (!frame.has_value())
+    {
+        cerr << "The server failed while answering." << endl;
+        return 1;
+    }
+
+    return status->front() == '+' ? 0 : 1;
+}
+#else
+int serve_packs(const string& socket_path)
+{
+    boost::ignore_unused(socket_path);
+    cerr << "Local sockets are not supported on this platform." << endl;
+    return 1;
+}
+
+int remote_request(const string& socket_path, request_t req, const vector<string>& args)
+{
+    boost::ignore_unused(socket_path, req, args);
+    cerr << "Local sockets are not supported on this platform." << endl;
+    return 1;
+}
+#endif
@@ -0,0 +1,27 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <pack.h>
+
+//Requests understood by a paktool server
+enum class request_t : std::uint8_t
+{
+    list = 1,   //pack, filter
+    stat,       //pack, entry
+    read,       //pack, entry
+    extract     //pack, output folder, filter
+};
+
+//Tab separated name, time stamp, size, stored size, CRC-32 and offset, with - for what's unknown.
+//Shared by --stat and the server so both print the same thing.
+std::wstring stat_line(const pak::pack_i::entry_info_t& info);
+
+//Keeps packs open between requests and serves them on a local socket until killed
+int serve_packs(const std::string& socket_path);
+
+//Sends a single request to a server and writes the answer to stdout
+int remote_request(const std::string& socket_path, request_t req, const std::vector<std::string>& args);
+
+#endif
@@ -0,0 +1,147 @@
+#include "spill_sort.h"
+#include <fstream>
+#include <random>
+#include <format>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct spill_sort_c::run_t
+{
+    static constexpr size_t buf_size = 0x40000;
+
+    fs::path path;
+    fstream file;
+    vector<char> buf = vector<char>(buf_size);
+
+    ~run_t()
+    {
+        file.close();
+        error_code ec;
+        fs::remove(path, ec);
+    }
+
+    void write(const wstring& s)
+    {
+        const auto len = static_cast<uint32_t>(s.size());
+        file.write(reinterpret_cast<const char*>(&len), sizeof(len));
+        file.write(reinterpret_cast<const char*>(s.data()), static_cast<streamsize>(s.size() * sizeof(wchar_t)));
+    }
+
+    optional<wstring> read()
+    {
+        uint32_t len = 0;
+        if (!file.read(reinterpret_cast<char*>(&len), sizeof(len)))
+            return {};
+        wstring s(len, L'\0');
+        if (!file.read(reinterpret_cast<char*>(s.data()), static_cast<streamsize>(len * sizeof(wchar_t))))
+            throw runtime_error("Read error in temporary file.");
+        return s;
+    }
+
+    optional<record_t> read_record()
+    {
+        auto key = read();
+        if (!key.has_value())
+            return {};
+        auto value = read();
+        if (!value.has_value())
+            throw runtime_error("Read error in temporary file.");
+        return record_t{ std::move(*key), std::move(*value) };
+    }
+};
+
+spill_sort_c::spill_sort_c(size_t mem_limit)
+    : m_mem_limit(mem_limit)
+{
+}
+
+spill_sort_c::~spill_sort_c() = default;
+
+void spill_sort_c::add(wstring key, wstring value)
+{
+    if (m_reading)
+        throw runtime_error("Records added to a sort that is being read.");
+
+    m_mem_used += sizeof(record_t) + (key.size() + value.size()) * sizeof(wchar_t);
+    m_records.emplace_back(std::move(key), std::move(value));
+    if (m_mem_used >= m_mem_limit)
+        spill();
+}
+
+void spill_sort_c::spill()
+{
+    ranges::sort(m_records);
+
+    auto run = make_unique<run_t>();
+    random_device rd;
+    run->path = fs::temp_directory_path() / format("paktool-{:08x}{:08x}.run", rd(), rd());
+    run->file.rdbuf()->pubsetbuf(run->buf.data(), static_cast<streamsize>(run->buf.size()));
+    run->file.open(run->path, ios::binary | ios::in | ios::out | ios::trunc);
+    if (!run->file.is_open())
+        throw runtime_error("Could not create temporary file.");
+
+    for (const auto& [key, value] : m_records)
+    {
+        run->write(key);
+        run->write(value);
+    }
+    if (!run->file.flush())
+        throw runtime_error("Write error in temporary file.");
+
+    m_runs.push_back(std::move(run));
+    m_records = {};
+    m_mem_used = 0;
+}
+
+void spill_sort_c::start_reading()
+{
+    m_reading = true;
+    if (m_runs.empty())
+    {
+        //Everything fit in memory
+        ranges::sort(m_records);
+        return;
+    }
+
+    if (!m_records.empty())
+        spill();
+
+    for (size_t i = 0; i < m_runs.size(); ++i)
+    {
+        m_runs[i]->file.seekg(0);
+        if (auto rec = m_runs[i]->read_record())
+            m_heads.emplace_back(std::move(*rec), i);
+    }
+    ranges::make_heap(m_heads, greater{});
+}
+
+optional<spill_sort_c::record_t> spill_sort_c::next()
+{
+    if (!m_reading)
+        start_reading();
+
+    if (m_runs.empty())
+    {
+        if (m_mem_next >= m_records.size())
+            return {};
+        return std::move(m_records[m_mem_next++]);
+    }
+
+    if (m_heads.empty())
+        return {};
+
+    ranges::pop_heap(m_heads, greater{});
+    auto [rec, run] = std::move(m_heads.back());
+    m_heads.pop_back();
+    if (auto next = m_runs[run]->read_record())
+    {
+        m_heads.emplace_back(std::move(*next), run);
+        ranges::push_heap(m_heads, greater{});
+    }
+    return std::move(rec);
+}
@@ -0,0 +1,42 @@
+#ifndef SPILL_SORT_H_INCLUDED
+#define SPILL_SORT_H_INCLUDED
+#include <string>
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <memory>
+#include <filesystem>
+
+//Sorts more key/value pairs than fit in memory. Pairs are collected up to mem_limit bytes,
+//then sorted and written to a temporary file as a run. Reading merges the runs back together.
+class spill_sort_c
+{
+public:
+    using record_t = std::tuple<std::wstring, std::wstring>;
+
+    explicit spill_sort_c(size_t mem_limit = 64u << 20);
+    spill_sort_c(const spill_sort_c&) = delete;
+    spill_sort_c& operator=(const spill_sort_c&) = delete;
+    ~spill_sort_c();
+
+    void add(std::wstring key, std::wstring value);
+
+    //Records in (key, value) order. Nothing can be added once reading has started.
+    std::optional<record_t> next();
+private:
+    struct run_t;
+
+    size_t m_mem_limit;
+    size_t m_mem_used = 0;
+    std::vector<record_t> m_records;
+    std::vector<std::unique_ptr<run_t>> m_runs;
+    //Current record of every run that isn't used up, as a heap on the record
+    std::vector<std::tuple<record_t, size_t>> m_heads;
+    size_t m_mem_next = 0;
+    bool m_reading = false;
+
+    void spill();
+    void start_reading();
+};
+
+#endif
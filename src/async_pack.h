@@ -0,0 +1,379 @@
+#ifndef ASYNC_PACK_H_INCLUDED
+#define ASYNC_PACK_H_INCLUDED
+#include "pack.h"
+#include "scheduler.h"
+#include <coroutine>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <exception>
+#include <atomic>
+#include <future>
+#include <shared_mutex>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pak
+{
+    //Where the blocking part of an async operation runs. The coroutine that waits for it
+    //is resumed on the same thread once it is done.
+    class executor_i
+    {
+    public:
+        virtual ~executor_i() = default;
+        virtual void post(std::function<void()> work) = 0;
+    };
+
+    //Runs the blocking parts on threads of its own, so coroutines waiting for the disk don't
+    //tie up scheduler_c::instance(). Any number of operations can be in flight, only threads
+    //of them block at the same time.
+    class pool_executor_c : public executor_i
+    {
+    public:
+        explicit pool_executor_c(unsigned threads = 4) : m_sched(std::max(1u, threads) + 1u)
+        {
+        }
+
+        void post(std::function<void()> work) override
+        {
+            m_sched.post(std::move(work));
+        }
+    private:
+        scheduler_c m_sched;
+    };
+
+    //Coroutine that runs right away and that nobody waits for
+    struct detached_task_t
+    {
+        struct promise_type
+        {
+            detached_task_t get_return_object() noexcept
+            {
+                return {};
+            }
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept
+            {
+                return {};
+            }
+            void return_void() noexcept
+            {
+            }
+            void unhandled_exception() noexcept
+            {
+                std::terminate();
+            }
+        };
+    };
+
+    //Coroutine that starts when it is awaited. When it is done the awaiting coroutine
+    //continues on whatever thread finished it.
+    template<typename T = void>
+    class task
+    {
+        //Goes on with whatever awaits the task without growing the stack
+        struct final_t
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+            template<typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+            {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        struct promise_base
+        {
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+            std::exception_ptr error;
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+            auto final_suspend() noexcept
+            {
+                return final_t{};
+            }
+            void unhandled_exception() noexcept
+            {
+                error = std::current_exception();
+            }
+        };
+
+        struct value_promise : promise_base
+        {
+            std::optional<T> value;
+
+            template<typename V>
+            void return_value(V&& v)
+            {
+                value.emplace(std::forward<V>(v));
+            }
+            T result()
+            {
+                if (this->error)
+                    std::rethrow_exception(this->error);
+                return std::move(*value);
+            }
+        };
+
+        struct void_promise : promise_base
+        {
+            void return_void() noexcept
+            {
+            }
+            void result()
+            {
+                if (this->error)
+                    std::rethrow_exception(this->error);
+            }
+        };
+    public:
+        struct promise_type : std::conditional_t<std::is_void_v<T>, void_promise, value_promise>
+        {
+            task get_return_object() noexcept
+            {
+                return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+            }
+        };
+
+        task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr))
+        {
+        }
+        task& operator=(task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (m_handle)
+                    m_handle.destroy();
+                m_handle = std::exchange(other.m_handle, nullptr);
+            }
+            return *this;
+        }
+        ~task()
+        {
+            if (m_handle)
+                m_handle.destroy();
+        }
+
+        auto operator co_await() && noexcept
+        {
+            struct awaiter_t
+            {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept
+                {
+                    handle.promise().continuation = waiting;
+                    return handle;
+                }
+                T await_resume()
+                {
+                    return handle.promise().result();
+                }
+            };
+            return awaiter_t{ m_handle };
+        }
+
+        //Runs the task and blocks until it is done, for code that isn't a coroutine itself
+        T get() &&
+        {
+            //The task and promise go in the frame, so nothing here is touched once it is set
+            std::promise<T> done;
+            auto finished = done.get_future();
+            [](task t, std::promise<T> done) -> detached_task_t
+            {
+                try
+                {
+                    if constexpr (std::is_void_v<T>)
+                    {
+                        co_await std::move(t);
+                        done.set_value();
+                    }
+                    else
+                    {
+                        done.set_value(co_await std::move(t));
+                    }
+                }
+                catch (...)
+                {
+                    done.set_exception(std::current_exception());
+                }
+            }(std::move(*this), std::move(done));
+            return finished.get();
+        }
+    private:
+        std::coroutine_handle<promise_type> m_handle;
+
+        explicit task(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle)
+        {
+        }
+    };
+
+    //Awaitable that calls work on ex and continues the awaiting coroutine there with its result
+    template<typename F>
+    auto run_on(executor_i& ex, F work)
+    {
+        using result_t = std::invoke_result_t<F&>;
+        static_assert(!std::is_void_v<result_t>, "work must return a value.");
+
+        struct awaiter_t
+        {
+            executor_i& ex;
+            F work;
+            std::optional<result_t> result;
+            std::exception_ptr error;
+
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<> waiting)
+            {
+                //The awaiter is gone once the coroutine continues, so nothing may touch it after that
+                ex.post([this, waiting]()
+                {
+                    try
+                    {
+                        result.emplace(work());
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                    waiting.resume();
+                });
+            }
+            result_t await_resume()
+            {
+                if (error)
+                    std::rethrow_exception(error);
+                return std::move(*result);
+            }
+        };
+        return awaiter_t{ ex, std::move(work), {}, {} };
+    }
+
+    //Runs the tasks at the same time and goes on once all of them are done, with the results
+    //in the same order. The first exception is rethrown after the others have finished.
+    template<typename T>
+    task<std::vector<T>> when_all(std::vector<task<T>> tasks)
+    {
+        static_assert(!std::is_void_v<T>, "Tasks must return a value.");
+
+        struct state_t
+        {
+            std::vector<std::optional<T>> results;
+            std::vector<std::exception_ptr> errors;
+            std::atomic<size_t> left;
+            std::coroutine_handle<> waiting;
+        };
+        state_t state{ std::vector<std::optional<T>>(tasks.size()), std::vector<std::exception_ptr>(tasks.size()), tasks.size() + 1u, {} };
+
+        struct awaiter_t
+        {
+            std::vector<task<T>>& tasks;
+            state_t& state;
+
+            bool await_ready() noexcept
+            {
+                return tasks.empty();
+            }
+            bool await_suspend(std::coroutine_handle<> waiting)
+            {
+                state.waiting = waiting;
+                for (size_t i = 0; i < tasks.size(); ++i)
+                {
+                    [](task<T> t, state_t& state, size_t i) -> detached_task_t
+                    {
+                        try
+                        {
+                            state.results[i].emplace(co_await std::move(t));
+                        }
+                        catch (...)
+                        {
+                            state.errors[i] = std::current_exception();
+                        }
+                        if (--state.left == 0u)
+                            state.waiting.resume();
+                    }(std::move(tasks[i]), state, i);
+                }
+                //The extra count keeps the last task from resuming before this returns
+                return --state.left != 0u;
+            }
+            void await_resume() noexcept
+            {
+            }
+        };
+        co_await awaiter_t{ tasks, state };
+
+        for (const auto& e : state.errors)
+        {
+            if (e)
+                std::rethrow_exception(e);
+        }
+        std::vector<T> results;
+        results.reserve(state.results.size());
+        for (auto& r : state.results)
+            results.push_back(std::move(*r));
+        co_return results;
+    }
+
+    //pack_i for coroutines. Every entry is read with an entry_reader_i of its own, so any
+    //number of them can be read at once, with the blocking reads done on the executor.
+    //Writes are done one at a time and wait for the reads that are going on.
+    class async_pack_c
+    {
+    public:
+        async_pack_c(std::unique_ptr<pack_i> pack, executor_i& ex) noexcept : m_pack(std::move(pack)), m_ex(ex)
+        {
+        }
+        async_pack_c(const async_pack_c&) = delete;
+        async_pack_c& operator=(const async_pack_c&) = delete;
+
+        //nullptr if the pack can't be opened, like pack_i::open_pack
+        static task<std::unique_ptr<async_pack_c>> open(executor_i& ex, std::filesystem::path path,
+            pack_i::mode m, pack_i::warning_func_t warn_func = nullptr);
+
+        //nullptr if there is no such entry or it can't be read without opening it
+        task<std::unique_ptr<entry_reader_i>> open_entry(std::wstring name);
+        //reader and buf must stay valid until the read is done
+        task<size_t> read(entry_reader_i& reader, std::span<std::uint8_t> buf);
+        //Reads the rest of the entry
+        task<std::vector<std::uint8_t>> read_all(entry_reader_i& reader);
+
+        //Writes and closes a whole entry, false if it couldn't be written in full
+        task<bool> write_entry(std::wstring name, std::vector<std::uint8_t> data,
+            std::optional<pack_i::filetime_t> ft = {});
+        task<bool> close();
+
+        //For anything that isn't worth a thread switch, like listing the entries.
+        //Not to be used while operations are going on.
+        pack_i& pack() noexcept
+        {
+            return *m_pack;
+        }
+    private:
+        std::unique_ptr<pack_i> m_pack;
+        executor_i& m_ex;
+        std::shared_mutex m_lock;   //Shared by reads, held alone by writes
+    };
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef ENTRY_CACHE_H_INCLUDED
+#define ENTRY_CACHE_H_INCLUDED
+#include "pack.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pak
+{
+    //Keeps the content of recently read entries, up to budget bytes, and throws out the ones
+    //that haven't been used for the longest time. One cache can be shared by any number of packs
+    //and threads. Entries are known by the pack they came from and pack_i changes how it is known
+    //whenever it is closed or an entry is written to it, its old entries are left to age out.
+    class entry_cache_c
+    {
+    public:
+        //The data stays valid for as long as it is held, even if the cache has dropped it
+        using data_t = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+        struct stats_t
+        {
+            std::uint64_t hits = 0;
+            std::uint64_t misses = 0;
+            std::uint64_t evictions = 0;
+            std::uint64_t bytes = 0;        //Content kept right now
+            size_t entries = 0;
+        };
+
+        //Entries larger than max_entry aren't kept, the default is an eighth of the budget
+        explicit entry_cache_c(std::uint64_t budget, std::uint64_t max_entry = 0);
+        entry_cache_c(const entry_cache_c&) = delete;
+        entry_cache_c& operator=(const entry_cache_c&) = delete;
+
+        //Content of an entry, read from the pack if it isn't cached. nullptr if there is no such
+        //entry, it is too large to keep or it can only be read with pack_i::open_entry().
+        data_t get(const pack_i& pack, const std::wstring& name);
+
+        stats_t stats() const;
+        void clear();
+    private:
+        friend class pack_i;
+
+        struct key_t
+        {
+            std::uint64_t pack;
+            size_t idx;
+
+            bool operator==(const key_t&) const = default;
+        };
+        struct key_hash
+        {
+            size_t operator()(const key_t& k) const noexcept
+            {
+                return std::hash<std::uint64_t>{}(k.pack * 0x9E3779B97F4A7C15ull ^ k.idx);
+            }
+        };
+        using lru_t = std::list<std::tuple<key_t, data_t>>;    //Most recently used first
+
+        std::uint64_t m_budget, m_max_entry;
+        mutable std::mutex m_lock;
+        lru_t m_lru;
+        std::unordered_map<key_t, lru_t::iterator, key_hash> m_map;
+        stats_t m_stats;
+
+        data_t get(const pack_i& pack, size_t idx);
+    };
+}
+#endif
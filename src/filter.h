@@ -0,0 +1,85 @@
+#ifndef FILTER_H_INCLUDED
+#define FILTER_H_INCLUDED
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <regex>
+#include <variant>
+#include <locale>
+
+namespace pak
+{
+    //A set of include and exclude terms that entry names are matched against, case insensitive.
+    //A name passes if it matches any include term (or there are none) and no exclude term.
+    class name_filter
+    {
+    public:
+        enum class kind
+        {
+            contains,   //Pattern appears anywhere in the name
+            glob,       //*, ?, [a-z] and ** (across folders). Without a '/' only the file name is matched
+            regex       //ECMAScript regular expression searched for in the name
+        };
+
+        name_filter();
+
+        void include(kind k, std::wstring_view pattern);
+        void exclude(kind k, std::wstring_view pattern);
+
+        bool operator()(std::wstring_view name) const;
+        bool empty() const noexcept
+        {
+            return m_include.empty() && m_exclude.empty();
+        }
+
+        //Lower case prefixes that all matching names start with, sorted and non-overlapping.
+        //Empty if some include term can match anywhere.
+        std::optional<std::vector<std::wstring>> prefixes() const;
+    private:
+        struct glob_token
+        {
+            enum class type { literal, any_char, star, globstar, globstar_dir, set } t = type::literal;
+            wchar_t c = L'\0';
+            bool negate = false;
+            std::vector<std::pair<wchar_t, wchar_t>> ranges;
+        };
+
+        struct contains_term
+        {
+            std::wstring pattern;
+        };
+
+        struct glob_term
+        {
+            std::vector<glob_token> tokens;
+            bool basename = false;
+        };
+
+        struct regex_term
+        {
+            std::wregex re;
+            std::wstring prefix;
+        };
+
+        using term_t = std::variant<contains_term, glob_term, regex_term>;
+
+        std::vector<term_t> m_include, m_exclude;
+        std::locale m_locale;
+        const std::ctype<wchar_t>* m_ctype = nullptr;
+
+        wchar_t fold(wchar_t c) const
+        {
+            if (c < 128)
+                return c >= L'A' && c <= L'Z' ? c + (L'a' - L'A') : c;
+            return m_ctype->tolower(c);
+        }
+
+        term_t compile(kind k, std::wstring_view pattern) const;
+        bool matches(const term_t& term, std::wstring_view name) const;
+        bool glob_match(const glob_term& g, std::wstring_view name) const;
+        std::optional<std::wstring> prefix(const term_t& term) const;
+    };
+}
+
+#endif
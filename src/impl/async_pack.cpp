@@ -0,0 +1,72 @@
+#include "../async_pack.h"
+#include <mutex>
+
+using namespace std;
+
+namespace pak
+{
+    //static
+    task<unique_ptr<async_pack_c>> async_pack_c::open(executor_i& ex, filesystem::path path,
+        pack_i::mode m, pack_i::warning_func_t warn_func)
+    {
+        auto pack = co_await run_on(ex, [&]() { return pack_i::open_pack(path, m, warn_func); });
+        co_return pack ? make_unique<async_pack_c>(std::move(pack), ex) : nullptr;
+    }
+
+    task<unique_ptr<entry_reader_i>> async_pack_c::open_entry(wstring name)
+    {
+        //The pk3 reader reads the local header here, so this is done on the executor too
+        co_return co_await run_on(m_ex, [&]()
+        {
+            shared_lock lock(m_lock);
+            return m_pack->open_reader(name);
+        });
+    }
+
+    task<size_t> async_pack_c::read(entry_reader_i& reader, span<uint8_t> buf)
+    {
+        co_return co_await run_on(m_ex, [&]()
+        {
+            shared_lock lock(m_lock);
+            return reader.read(buf.data(), buf.size());
+        });
+    }
+
+    task<vector<uint8_t>> async_pack_c::read_all(entry_reader_i& reader)
+    {
+        constexpr size_t block = 0x40000;
+        vector<uint8_t> data;
+        for (;;)
+        {
+            const auto pos = data.size();
+            data.resize(pos + block);
+            const auto r = co_await read(reader, span{ data }.subspan(pos));
+            data.resize(pos + r);
+            if (r < block)
+                co_return data;
+        }
+    }
+
+    task<bool> async_pack_c::write_entry(wstring name, vector<uint8_t> data, optional<pack_i::filetime_t> ft)
+    {
+        co_return co_await run_on(m_ex, [&]()
+        {
+            unique_lock lock(m_lock);
+            if (!m_pack->new_entry(name, ft, data.size()))
+                return false;
+            //Closed even if the write came up short, the next entry mustn't be started over an open one
+            const auto written = m_pack->write(data.data(), data.size()) == data.size();
+            m_pack->close_write_entry();
+            return written;
+        });
+    }
+
+    task<bool> async_pack_c::close()
+    {
+        co_return co_await run_on(m_ex, [&]()
+        {
+            unique_lock lock(m_lock);
+            return m_pack->close_pack();
+        });
+    }
+}
@@ -0,0 +1,79 @@
+#include "../entry_cache.h"
+
+using namespace std;
+
+namespace pak
+{
+    entry_cache_c::entry_cache_c(uint64_t budget, uint64_t max_entry)
+        : m_budget(budget), m_max_entry(max_entry > 0u ? min(max_entry, budget) : budget / 8u)
+    {
+    }
+
+    entry_cache_c::data_t entry_cache_c::get(const pack_i& pack, const wstring& name)
+    {
+        const auto idx = pack.find_entry(name);
+        return idx ? get(pack, *idx) : nullptr;
+    }
+
+    entry_cache_c::data_t entry_cache_c::get(const pack_i& pack, size_t idx)
+    {
+        const key_t key{ pack.m_generation, idx };
+        {
+            lock_guard lock(m_lock);
+            if (auto it = m_map.find(key); it != end(m_map))
+            {
+                ++m_stats.hits;
+                m_lru.splice(begin(m_lru), m_lru, it->second);
+                return std::get<1>(*it->second);
+            }
+            ++m_stats.misses;
+        }
+
+        const auto size = pack.entry_info_impl(idx).size;
+        if (size > m_max_entry)
+            return nullptr;
+        auto reader = pack.open_reader_impl(idx);
+        if (!reader)
+            return nullptr;
+
+        //Read without the lock, other threads can use the cache meanwhile
+        auto content = make_shared<vector<uint8_t>>(static_cast<size_t>(size));
+        if (reader->read(content->data(), content->size()) != content->size())
+            throw runtime_error("Entry is shorter than the directory says.");
+        data_t data = std::move(content);
+
+        lock_guard lock(m_lock);
+        if (auto it = m_map.find(key); it != end(m_map))
+            return std::get<1>(*it->second);     //Another thread read it at the same time
+
+        m_lru.emplace_front(key, data);
+        m_map.emplace(key, begin(m_lru));
+        m_stats.bytes += size;
+        ++m_stats.entries;
+        while (m_stats.bytes > m_budget)
+        {
+            const auto& [old_key, old_data] = m_lru.back();
+            m_stats.bytes -= old_data->size();
+            --m_stats.entries;
+            ++m_stats.evictions;
+            m_map.erase(old_key);
+            m_lru.pop_back();
+        }
+        return data;
+    }
+
+    entry_cache_c::stats_t entry_cache_c::stats() const
+    {
+        lock_guard lock(m_lock);
+        return m_stats;
+    }
+
+    void entry_cache_c::clear()
+    {
+        lock_guard lock(m_lock);
+        m_map.clear();
+        m_lru.clear();
+        m_stats.bytes = 0;
+        m_stats.entries = 0;
+    }
+}
@@ -0,0 +1,250 @@
+#include "../filter.h"
+#include <algorithm>
+#include <ranges>
+
+using namespace std;
+
+namespace pak
+{
+    name_filter::name_filter()
+        : m_ctype(&use_facet<ctype<wchar_t>>(m_locale))
+    {
+    }
+
+    void name_filter::include(kind k, wstring_view pattern)
+    {
+        m_include.push_back(compile(k, pattern));
+    }
+
+    void name_filter::exclude(kind k, wstring_view pattern)
+    {
+        m_exclude.push_back(compile(k, pattern));
+    }
+
+    name_filter::term_t name_filter::compile(kind k, wstring_view pattern) const
+    {
+        switch (k)
+        {
+        case kind::contains:
+            {
+                contains_term t;
+                ranges::transform(pattern, back_inserter(t.pattern), [this](auto c) { return fold(c); });
+                return t;
+            }
+        case kind::regex:
+            {
+                regex_term t;
+                t.re.assign(pattern.begin(), pattern.end(), regex_constants::ECMAScript | regex_constants::icase | regex_constants::optimize);
+                //A literal start after ^ can be looked up in the index
+                constexpr wstring_view special = L".[]()*+?{}|\\$^";
+                if (pattern.starts_with(L'^') && pattern.find(L'|') == wstring_view::npos)
+                {
+                    auto lit = pattern.substr(1);
+                    lit = lit.substr(0, min(lit.find_first_of(special), lit.size()));
+                    //The last character belongs to a quantifier if one follows
+                    if (const auto next = 1 + lit.size(); next < pattern.size() && wstring_view{ L"*?{" }.find(pattern[next]) != wstring_view::npos && !lit.empty())
+                        lit.remove_suffix(1);
+                    ranges::transform(lit, back_inserter(t.prefix), [this](auto c) { return fold(c); });
+                }
+                return t;
+            }
+        case kind::glob:
+            break;
+        }
+
+        glob_term g;
+        using type = glob_token::type;
+        g.basename = pattern.find(L'/') == wstring_view::npos;
+        for (size_t i = 0; i < pattern.size(); ++i)
+        {
+            glob_token t;
+            switch (const auto c = pattern[i])
+            {
+            case L'*':
+                if (i + 1 < pattern.size() && pattern[i + 1] == L'*')
+                {
+                    ++i;
+                    t.t = type::globstar;
+                    if (i + 1 < pattern.size() && pattern[i + 1] == L'/')
+                    {
+                        //Also matches no folder at all
+                        ++i;
+                        t.t = type::globstar_dir;
+                    }
+                }
+                else
+                {
+                    t.t = type::star;
+                }
+                break;
+            case L'?':
+                t.t = type::any_char;
+                break;
+            case L'[':
+                if (const auto close = pattern.find(L']', i + 2); close != wstring_view::npos)
+                {
+                    t.t = type::set;
+                    auto set = pattern.substr(i + 1, close - i - 1);
+                    if (set.starts_with(L'!') || set.starts_with(L'^'))
+                    {
+                        t.negate = true;
+                        set.remove_prefix(1);
+                    }
+                    for (size_t j = 0; j < set.size(); ++j)
+                    {
+                        if (j + 2 < set.size() && set[j + 1] == L'-')
+                        {
+                            t.ranges.emplace_back(fold(set[j]), fold(set[j + 2]));
+                            j += 2;
+                        }
+                        else
+                        {
+                            t.ranges.emplace_back(fold(set[j]), fold(set[j]));
+                        }
+                    }
+                    i = close;
+                    break;
+                }
+                [[fallthrough]];
+            default:
+                t.c = fold(c);
+                break;
+            }
+            g.tokens.push_back(std::move(t));
+        }
+
+        //A folder name means everything in it
+        if (pattern.ends_with(L'/'))
+        {
+            g.tokens.emplace_back();
+            g.tokens.back().t = type::globstar;
+        }
+        return g;
+    }
+
+    bool name_filter::glob_match(const glob_term& g, wstring_view name) const
+    {
+        using type = glob_token::type;
+        if (g.basename)
+        {
+            if (const auto r = name.rfind(L'/'); r != wstring_view::npos)
+                name.remove_prefix(r + 1);
+        }
+
+        //Runs the pattern as an NFA where each token is a state
+        const auto ntok = g.tokens.size();
+        vector<char> cur(ntok + 1, 0), next(ntok + 1, 0);
+        //**/ matches no folders at all only where a folder name starts
+        auto close = [&](vector<char>& states, bool boundary)
+        {
+            for (size_t i = 0; i < ntok; ++i)
+            {
+                const auto t = g.tokens[i].t;
+                if (states[i] && t != type::literal && t != type::any_char && t != type::set && (t != type::globstar_dir || boundary))
+                    states[i + 1] = 1;
+            }
+        };
+
+        cur[0] = 1;
+        close(cur, true);
+        for (const auto ch : name)
+        {
+            const auto c = fold(ch);
+            ranges::fill(next, 0);
+            bool any = false;
+            for (size_t i = 0; i < ntok; ++i)
+            {
+                if (!cur[i])
+                    continue;
+
+                const auto& t = g.tokens[i];
+                switch (t.t)
+                {
+                case type::literal:
+                    next[i + 1] |= c == t.c;
+                    break;
+                case type::any_char:
+                    next[i + 1] |= c != L'/';
+                    break;
+                case type::set:
+                    next[i + 1] |= t.negate != ranges::any_of(t.ranges, [c](const auto& r) { return c >= r.first && c <= r.second; });
+                    break;
+                case type::star:
+                    next[i] |= c != L'/';
+                    break;
+                case type::globstar:
+                    next[i] = 1;
+                    break;
+                case type::globstar_dir:
+                    next[i] = 1;
+                    next[i + 1] |= c == L'/';
+                    break;
+                }
+                any = any || next[i] || next[i + 1];
+            }
+            if (!any)
+                return false;
+            close(next, c == L'/');
+            swap(cur, next);
+        }
+        return cur[ntok] != 0;
+    }
+
+    bool name_filter::matches(const term_t& term, wstring_view name) const
+    {
+        return visit([&](const auto& t)
+        {
+            using T = decay_t<decltype(t)>;
+            if constexpr (is_same_v<T, contains_term>)
+                return ranges::search(name, t.pattern, {}, [this](auto c) { return fold(c); }).begin() != name.end() || t.pattern.empty();
+            else if constexpr (is_same_v<T, regex_term>)
+                return regex_search(name.begin(), name.end(), t.re);
+            else
+                return glob_match(t, name);
+        }, term);
+    }
+
+    bool name_filter::operator()(wstring_view name) const
+    {
+        if (!m_include.empty() && ranges::none_of(m_include, [&](const auto& t) { return matches(t, name); }))
+            return false;
+        return ranges::none_of(m_exclude, [&](const auto& t) { return matches(t, name); });
+    }
+
+    optional<wstring> name_filter::prefix(const term_t& term) const
+    {
+        if (const auto g = get_if<glob_term>(&term); g && !g->basename)
+        {
+            wstring p;
+            for (const auto& t : g->tokens | views::take_while([](const auto& t) { return t.t == glob_token::type::literal; }))
+                p.push_back(t.c);
+            return p;
+        }
+        else if (const auto r = get_if<regex_term>(&term); r && !r->prefix.empty())
+        {
+            return r->prefix;
+        }
+        return {};
+    }
+
+    optional<vector<wstring>> name_filter::prefixes() const
+    {
+        if (m_include.empty())
+            return {};
+
+        vector<wstring> result;
+        for (const auto& t : m_include)
+        {
+            auto p = prefix(t);
+            if (!p.has_value() || p->empty())
+                return {};
+            result.push_back(std::move(*p));
+        }
+
+        //A prefix that starts with another one is already covered by it
+        ranges::sort(result);
+        auto last = unique(begin(result), end(result), [](const auto& a, const auto& b) { return b.starts_with(a); });
+        result.erase(last, end(result));
+        return result;
+    }
+}
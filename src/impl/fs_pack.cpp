@@ -1,9 +1,14 @@
 #include "fs_pack.h"
+#include "scan_pack.h"
 #include <ranges>
 #include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/core/ignore_unused.hpp>
 #include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_set>
 #include <limits.h>
 #if defined(_MSC_VER) and not defined(PATH_MAX)
 #include <cstdlib>
@@ -36,6 +41,18 @@ namespace
 #endif
     }
 
+    pak::pack_i::filetime_t file_timestamp(const fs::path& path)
+    {
+        using namespace chrono;
+        const auto ftime = clock_cast<system_clock>(fs::last_write_time(path));
+        const auto ymd = year_month_day(floor<days>(ftime));
+        const auto tod = hh_mm_ss(ftime - floor<days>(ftime));
+        
+        return boost::posix_time::ptime(
+            { uint16_t(static_cast<int>(ymd.year())), uint16_t(static_cast<unsigned>(ymd.month())), uint16_t(static_cast<unsigned>(ymd.day()))},
+            { tod.hours().count(), tod.minutes().count(), tod.seconds().count() });
+    }
+
     auto list_dir_contents(const fs::path& dir, const fs::path& base_path)
     {
         return make_tuple(fs::directory_iterator(dir)
@@ -46,6 +63,30 @@ namespace
             | views::transform([](const auto& v) { return fs::path(v); })
             | views::filter([](const auto& v) { return fs::is_directory(v); }));
     }
+
+    //Files written with write_options_t::dedupe so far, by size and CRC-64 of their content
+    struct written_files_t
+    {
+        mutex lock;
+        map<tuple<uint64_t, uint64_t>, fs::path> files;
+    };
+
+    written_files_t& written_files()
+    {
+        static written_files_t written;
+        return written;
+    }
+
+    //Makes to a link to from. Returns whether it is a hard link, nothing if no link could be made.
+    optional<bool> link_file(const fs::path& from, const fs::path& to, pak::pack_i::link how)
+    {
+        if (how == pak::pack_i::link::reflink && pak_impl::clone_file(from, to))
+            return false;
+
+        error_code ec;
+        fs::create_hard_link(from, to, ec);
+        return ec ? nullopt : optional{ true };
+    }
 }
 
 namespace pak_impl
@@ -88,24 +129,54 @@ namespace pak_impl
         throw runtime_error("Could not create " + path.string());
     }
 
+    optional<size_t> fs_pack_c::resume_impl(const fs::path& path, span<const journal_entry_t> done)
+    {
+        //The conversion created the folder, so a file that isn't in the journal wasn't finished
+        if (!fs::is_directory(path))
+            return {};
+
+        unordered_set<wstring> names;
+        for (const auto& e : done)
+            names.insert(to_lower_copy(e.name));
+
+        m_files.clear();
+        read_contents(path, path);
+        for (const auto& f : m_files | views::filter([&](const auto& v) { return !names.contains(v.path); }))
+            fs::remove(f.syspath);
+        m_files.clear();
+        return done.size();
+    }
+
+    optional<tuple<uint64_t, uint64_t>> fs_pack_c::written_extent_impl() const
+    {
+        //Every entry is a file of its own
+        return tuple{ uint64_t(0), m_out_pos };
+    }
+
     bool fs_pack_c::open_entry_impl(size_t idx)
     {
         m_infile.open(m_files[idx].syspath, ios::in | ios::binary);
         return m_infile.is_open();
     }
 
+    unique_ptr<pak::entry_reader_i> fs_pack_c::open_reader_impl(size_t idx) const
+    {
+        return make_unique<file_reader_c>(m_files[idx].syspath);
+    }
+
     optional<pak::pack_i::filetime_t> fs_pack_c::entry_timestamp_impl(size_t idx) const
     {
-        using namespace chrono;
-        const auto ftime = clock_cast<system_clock>(fs::last_write_time(m_files[idx].syspath));
-        const auto ymd = year_month_day(floor<days>(ftime));
-        const auto tod = hh_mm_ss(ftime - floor<days>(ftime));
-        
-        return boost::posix_time::ptime(
-            { uint16_t(static_cast<int>(ymd.year())), uint16_t(static_cast<unsigned>(ymd.month())), uint16_t(static_cast<unsigned>(ymd.day()))},
-            { tod.hours().count(), tod.minutes().count(), tod.seconds().count() });
+        return file_timestamp(m_files[idx].syspath);
     }
     
+    pak::pack_i::entry_info_t fs_pack_c::entry_info_impl(size_t idx) const
+    {
+        //Every entry is a file of its own, so there is no offset
+        entry_info_t info;
+        info.size = info.stored_size = static_cast<uint64_t>(m_files[idx].size);
+        return info;
+    }
+
     optional<size_t> fs_pack_c::new_entry_impl(const wstring& name, const std::optional<filetime_t>& ft)
     {
         auto parts = name | views::split(L'/')
@@ -123,10 +194,13 @@ namespace pak_impl
 
         fs::create_directories(fullpath.parent_path());
 
-        m_outfile.open(fullpath, ios::binary);
-        if (m_outfile.is_open())
+        if (m_outfile.open(fullpath, file_c::access::create))
         {
+            m_out_pos = 0;
             m_pending_ft = ft;
+            m_dedupe_buf.clear();
+            m_dedupe_buffered = m_write_opts.dedupe != link::none;
+            m_dedupe_crc.reset();
             return idx;
         }
         
@@ -148,15 +222,96 @@ namespace pak_impl
     {
         if (m_outfile.is_open())
         {
-            m_outfile.write(reinterpret_cast<const char*>(buf), size);
-            if (m_outfile.fail())
-                return 0;
-
+            if (m_write_opts.dedupe != link::none)
+            {
+                m_dedupe_crc.process_bytes(buf, size);
+                if (m_dedupe_buffered && m_dedupe_buf.size() + size > dedupe_buffer)
+                {
+                    //Too large to keep, it is replaced by a link afterwards if it is a repeat
+                    m_outfile.write(m_dedupe_buf.data(), m_dedupe_buf.size(), 0);
+                    m_dedupe_buf.clear();
+                    m_dedupe_buffered = false;
+                }
+                if (m_dedupe_buffered)
+                {
+                    m_dedupe_buf.insert(end(m_dedupe_buf), buf, buf + size);
+                    m_out_pos += size;
+                    return size;
+                }
+            }
+            m_outfile.write(buf, size, m_out_pos);
+            m_out_pos += size;
             return size;
         }
         return 0;
     }
+
+    void fs_pack_c::reserve_entry_impl(uint64_t size)
+    {
+        if (m_dedupe_buffered && size <= dedupe_buffer)
+            m_dedupe_buf.reserve(static_cast<size_t>(size));
+        else
+            m_outfile.reserve(size);
+    }
+
+    optional<fs::path> fs_pack_c::earlier_copy(const fs::path& path)
+    {
+        if (m_out_pos == 0u)
+            return {};
+
+        const auto key = make_tuple(m_out_pos, m_dedupe_crc.checksum());
+        auto& written = written_files();
+        fs::path first;
+        {
+            lock_guard lock(written.lock);
+            const auto [it, added] = written.files.try_emplace(key, path);
+            if (added)
+                return {};
+            first = it->second;
+        }
+
+        //The first copy may have changed since, and the CRC can match by chance
+        if (first != path && same_content(first))
+            return first;
+
+        lock_guard lock(written.lock);
+        written.files.insert_or_assign(key, path);
+        return {};
+    }
+
+    bool fs_pack_c::same_content(const fs::path& other) const
+    {
+        file_c file;
+        if (!file.open(other, file_c::access::read) || file.size() != m_out_pos)
+            return false;
+
+        vector<uint8_t> theirs(static_cast<size_t>(min<uint64_t>(m_out_pos, 0x100000u)));
+        vector<uint8_t> ours(m_dedupe_buffered ? 0u : theirs.size());
+        for (uint64_t pos = 0; pos < m_out_pos; pos += theirs.size())
+        {
+            const auto sz = static_cast<size_t>(min<uint64_t>(theirs.size(), m_out_pos - pos));
+            if (file.read(theirs.data(), sz, pos) != sz)
+                return false;
+
+            const uint8_t* mine = ours.data();
+            if (m_dedupe_buffered)
+                mine = m_dedupe_buf.data() + pos;
+            else if (m_outfile.read(ours.data(), sz, pos) != sz)
+                return false;
+            if (memcmp(theirs.data(), mine, sz) != 0)
+                return false;
+        }
+        return true;
+    }
     
+    bool fs_pack_c::seek_entry_impl(uint64_t pos)
+    {
+        m_infile.clear();
+        if (!m_infile.seekg(0, ios::end) || pos > static_cast<uint64_t>(m_infile.tellg()))
+            return false;
+        return static_cast<bool>(m_infile.seekg(static_cast<streamoff>(pos)));
+    }
+
     void fs_pack_c::close_read_impl()
     {
         if (m_infile.is_open())
@@ -168,8 +323,32 @@ namespace pak_impl
         using namespace std::chrono;
         if (m_outfile.is_open())
         {
+            const auto path = m_base_path / m_files[*m_write_idx].syspath;
+
+            //A repeat is linked under another name first, so the entry can still be written if that fails
+            auto link_path = path;
+            link_path += L".paktool-link";
+            optional<bool> hard_link;
+            if (m_write_opts.dedupe != link::none)
+            {
+                if (const auto first = earlier_copy(path))
+                {
+                    error_code ec;
+                    fs::remove(link_path, ec);
+                    hard_link = link_file(*first, link_path, m_write_opts.dedupe);
+                }
+                if (!hard_link && m_dedupe_buffered)
+                    m_outfile.write(m_dedupe_buf.data(), m_dedupe_buf.size(), 0);
+                m_dedupe_buf.clear();
+                m_dedupe_buffered = false;
+            }
+
             m_outfile.close();
-            if (m_pending_ft)
+            if (hard_link)
+                fs::rename(link_path, path);
+
+            //A hard link has the time stamp of the first copy, changing it would change both
+            if (m_pending_ft && !hard_link.value_or(false))
             {
                 const auto& ft = *m_pending_ft;
 
@@ -178,7 +357,7 @@ namespace pak_impl
                     + hours(ft.time_of_day().hours())
                     + minutes(ft.time_of_day().minutes()) + seconds(ft.time_of_day().seconds()) };
                 
-                fs::last_write_time(m_base_path / m_files[*m_write_idx].syspath, chrono::clock_cast<fs::file_time_type::clock>(zt.get_sys_time()));
+                fs::last_write_time(path, chrono::clock_cast<fs::file_time_type::clock>(zt.get_sys_time()));
             }
             m_pending_ft.reset();
         }
@@ -211,4 +390,48 @@ namespace pak_impl
     {
         return m_files[idx].path;
     }
+
+    bool fs_scan_c::open(const fs::path& path)
+    {
+        if (!fs::is_directory(path))
+            return false;
+        m_base_path = path;
+        m_it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied);
+        return true;
+    }
+
+    optional<wstring> fs_scan_c::next_entry()
+    {
+        if (m_infile.is_open())
+            m_infile.close();
+        m_totread = 0;
+
+        for (; m_it != fs::recursive_directory_iterator{}; ++m_it)
+        {
+            if (!m_it->is_regular_file())
+                continue;
+
+            m_cur_path = m_it->path();
+            ++m_it;
+            m_name = rel_path_make(m_cur_path, m_base_path);
+            m_info = {};
+            m_info.size = m_info.stored_size = fs::file_size(m_cur_path);
+            m_info.timestamp = file_timestamp(m_cur_path);
+            return m_name;
+        }
+        return {};
+    }
+
+    size_t fs_scan_c::read(uint8_t* data, size_t sz)
+    {
+        if (!m_infile.is_open() && m_totread == 0)
+            m_infile.open(m_cur_path, ios::in | ios::binary);
+        if (!m_infile.is_open())
+            return 0;
+
+        m_infile.read(reinterpret_cast<char*>(data), static_cast<streamsize>(sz));
+        const auto n = static_cast<size_t>(m_infile.gcount());
+        m_totread += n;
+        return n;
+    }
 }
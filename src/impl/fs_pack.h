@@ -1,8 +1,10 @@
 #ifndef FS_PACK_H_INCLUDED
 #define FS_PACK_H_INCLUDED
 #include "../pack.h"
+#include "pakutil.h"
 #include <vector>
 #include <fstream>
+#include <boost/crc.hpp>
 
 namespace pak_impl
 {
@@ -13,6 +15,7 @@ namespace pak_impl
         bool create_pack_impl(const std::filesystem::path& path) override;
         bool open_entry_impl(size_t idx) override;
         std::optional<filetime_t> entry_timestamp_impl(size_t idx) const override;
+        entry_info_t entry_info_impl(size_t idx) const override;
         std::optional<size_t> new_entry_impl(const std::wstring& name, const std::optional<filetime_t>& ft) override;
         size_t read_entry_impl(std::uint8_t* buf, size_t sz) override;
         size_t write_entry_impl(const std::uint8_t* buf, size_t size) override;
@@ -23,6 +26,11 @@ namespace pak_impl
         size_t max_file_count() const override;
         size_t entry_count() const override;
         const std::wstring& entry_name(size_t idx) const override;
+        void reserve_entry_impl(std::uint64_t size) override;
+        std::unique_ptr<pak::entry_reader_i> open_reader_impl(size_t idx) const override;
+        bool seek_entry_impl(std::uint64_t pos) override;
+        std::optional<size_t> resume_impl(const std::filesystem::path& path, std::span<const journal_entry_t> done) override;
+        std::optional<std::tuple<std::uint64_t, std::uint64_t>> written_extent_impl() const override;
     private:
         struct entry_t
         {
@@ -40,9 +48,19 @@ namespace pak_impl
         std::optional<filetime_t> m_pending_ft;
         
         std::ifstream m_infile;
-        std::ofstream m_outfile; 
+        file_c m_outfile;
+        std::uint64_t m_out_pos = 0;
+
+        //With write_options_t::dedupe the start of an entry is kept here until it is known
+        //whether the same content has been written before, so repeats are never written
+        static constexpr size_t dedupe_buffer = 0x1000000;
+        std::vector<std::uint8_t> m_dedupe_buf;
+        bool m_dedupe_buffered = false;     //Nothing has been written to m_outfile yet
+        boost::crc_optimal<64, 0x42f0e1eba9ea3693ULL, 0, 0, false, false> m_dedupe_crc;
 
         void read_contents(const std::filesystem::path& path, const std::filesystem::path& base_path);
+        std::optional<std::filesystem::path> earlier_copy(const std::filesystem::path& path);
+        bool same_content(const std::filesystem::path& other) const;
     };
 }
 
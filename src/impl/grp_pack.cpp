@@ -1,4 +1,5 @@
 #include "grp_pack.h"
+#include "scan_pack.h"
 #include "pakutil.h"
 #include <numeric>
 #include <boost/endian.hpp>
@@ -14,51 +15,51 @@ namespace pak_impl
 {
     static constexpr auto KEN = "KenSilverman"sv;
     constexpr size_t header_size = 12 + 4;
-    constexpr size_t entry_size = 12 + 4;
+    constexpr size_t dir_entry_size = 12 + 4;
 
     bool grp_pack_c::read_header()
     {
-        char ken[KEN.length()];
-        
-        if (read_file(m_pakfile, ken) != KEN.length() || string_view{ begin(ken), end(ken) } != KEN)
+        unsigned char header[header_size];
+        if (m_pakfile.read(header, sizeof(header), 0) != sizeof(header)
+            || string_view{ reinterpret_cast<const char*>(header), KEN.length() } != KEN)
             return false;
         
-        const auto file_cnt = little_to_native(read_file<uint32_t>(m_pakfile));  
-        const auto data_offs = header_size + file_cnt * entry_size;
-        
-        for (auto i = 0u; i < file_cnt; ++i)
+        const size_t file_cnt = load_little_u32(header + KEN.length());
+        const auto data_offs = header_size + file_cnt * dir_entry_size;
+        m_meta_ranges = { { 0, static_cast<streamoff>(data_offs) } };
+
+        //A damaged count mustn't make the directory huge
+        if (data_offs > m_pakfile.size())
+            return false;
+        vector<unsigned char> dir(file_cnt * dir_entry_size);
+        if (m_pakfile.read(dir.data(), dir.size(), header_size) != dir.size())
+            return false;
+
+        m_files.reserve(file_cnt);
+        for (auto rec = dir.data(); rec != dir.data() + dir.size(); rec += dir_entry_size)
         {
-            char filenbuf[12];
-            if (read_file(m_pakfile, filenbuf) != sizeof(filenbuf))
-                return false;
             //It should really be ASCII only but who knows with old DOS files
-            auto file_name = conv::to_utf<wchar_t>({ begin(filenbuf), ranges::find(filenbuf, '\0') }, "IBM437");
-            
-            const auto filesz = native_to_little(read_file<uint32_t>(m_pakfile));
-            const auto offs = i == 0 ? data_offs : m_files.back().pos + m_files.back().len;
-
+            const auto filenbuf = reinterpret_cast<const char*>(rec);
+            const auto offs = m_files.empty() ? data_offs : m_files.back().pos + m_files.back().len;
             m_files.emplace_back(entry_t{
                 .pos = static_cast<streamoff>(offs),
-                .len = filesz,
-                .name = std::move(file_name)});
+                .len = load_little_u32(rec + 12),
+                .name = { { filenbuf, static_cast<size_t>(find(filenbuf, filenbuf + 12, '\0') - filenbuf) }, &from_ibm437 } });
         }
 
-        if (!m_files.empty())
-        {
-            if (!seek_read(m_pakfile, 0, ios::end) || m_pakfile.tellg() != static_cast<streampos>(m_files.back().pos + m_files.back().len))
-                return false;
-        }
+        if (!m_files.empty() && m_pakfile.size() != static_cast<uint64_t>(m_files.back().pos + m_files.back().len))
+            return false;
         return true;
     }
 
     bool grp_pack_c::create_pack_impl(const fs::path& path)
     {
-        m_pakfile.open(path, ios::binary | ios::out | ios::in | ios::trunc);
-        if (!m_pakfile.is_open())
+        if (!m_pakfile.open(path, file_c::access::create))
             return false;
         
-        write_file(m_pakfile, KEN);
-        write_file<uint32_t>(m_pakfile, 0u);
+        unsigned char header[header_size] = {};
+        ranges::copy(KEN, header);
+        m_pakfile.write(header, sizeof(header), 0);
         return true;
     }
 
@@ -68,25 +69,20 @@ namespace pak_impl
 
         if (!m_pending_cnt.has_value())
         {
-            if (!notify_add(1))
+            if (!notify_add(1, 0))
                 return {};
         }
 
         if (!is_filename(name) || distance(ranges::find(name, L'.'), end(name)) != 4)
             emit_warning(name, L"Not a DOS 8.3 file name.");
 
-        const auto idx = m_files.size();
         m_files.emplace_back();
-        m_files.back().name = name;
-        boost::to_upper(m_files.back().name);
+        m_files.back().name = boost::to_upper_copy(name);
         
-        if (seek_write(m_pakfile, 0, ios::end))
-        {
-            m_files.back().pos = m_pakfile.tellp();
-            return idx;
-        }
-        m_files.pop_back();
-        return {};
+        //Data is appended, pak_pack_c writes it from m_write_offs
+        m_write_offs = static_cast<streamoff>(m_pakfile.size());
+        m_files.back().pos = m_write_offs;
+        return m_files.size() - 1;
     }
 
     void grp_pack_c::close_write_impl()
@@ -98,11 +94,24 @@ namespace pak_impl
             m_pending_used.reset();
         }
 
-        if (seek_write(m_pakfile, header_size + entry_size * m_write_idx.value()))
-        {
-            write_file(m_pakfile, boost::to_upper_copy(conv::from_utf(m_files[*m_write_idx].name, "CP437")));
-            write_file(m_pakfile, native_to_little(static_cast<uint32_t>(m_files[*m_write_idx].len)));
-        } 
+        const auto name = boost::to_upper_copy(conv::from_utf(m_files[*m_write_idx].name.get(), "CP437"));
+        unsigned char rec[dir_entry_size] = {};
+        copy_n(begin(name), min<size_t>(name.length(), 12u), rec);
+        store_little_u32(rec + 12, static_cast<uint32_t>(m_files[*m_write_idx].len));
+        m_pakfile.write(rec, sizeof(rec), header_size + dir_entry_size * m_write_idx.value());
+    }
+
+    optional<size_t> grp_pack_c::resume_impl(const fs::path& path, span<const journal_entry_t> done)
+    {
+        //The directory is in front of the data and moves it when it grows, so a stopped
+        //write can leave the data anywhere
+        boost::ignore_unused(path, done);
+        return {};
+    }
+
+    optional<tuple<uint64_t, uint64_t>> grp_pack_c::written_extent_impl() const
+    {
+        return {};
     }
 
     bool grp_pack_c::close_pack_impl()
@@ -113,16 +122,23 @@ namespace pak_impl
         return pak_pack_c::close_pack_impl();
     }
 
-    bool grp_pack_c::notify_add(size_t cnt)
+    bool grp_pack_c::notify_add(size_t cnt, uint64_t data_size)
     {
         if (m_pending_cnt.has_value() && m_pending_used.has_value())
             throw runtime_error("File operations already pending.");
 
-        if (shift_data(m_pending_cnt.value_or(0) + cnt)
-            && seek_write(m_pakfile, KEN.length()))
+        //Reserved first so the shifted data and the new entries all go into the allocation
+        if (data_size > 0u)
+            m_pakfile.reserve(m_pakfile.size() + cnt * dir_entry_size + data_size);
+        if (cnt == 0u)
+            return true;
+
+        if (shift_data(m_pending_cnt.value_or(0) + cnt))
         {
             m_pending_cnt = cnt;
-            write_file(m_pakfile, native_to_little(static_cast<uint32_t>(m_files.size() + cnt)));
+            unsigned char count[sizeof(uint32_t)];
+            store_little_u32(count, static_cast<uint32_t>(m_files.size() + cnt));
+            m_pakfile.write(count, sizeof(count), KEN.length());
             return true;
         }
         return false;
@@ -132,52 +148,39 @@ namespace pak_impl
     {
         //GRP files unfortunately have the file table before all the data, so adding
         //files requires shifting all the data towards the end
-        auto file_sizes = m_files | views::transform([](const auto& v) { return v.len; });
-        const auto data_size = accumulate(begin(file_sizes), end(file_sizes), size_t(0));
+        const auto table_end = header_size + m_files.size() * dir_entry_size;
+        const auto shift = num_files * dir_entry_size;
+        const auto data_end = m_pakfile.size();
 
-        if (const auto shiftpos = static_cast<streamsize>(min(num_files * entry_size, data_size)))
+        //Moved from the end backwards so nothing is overwritten before it has been copied
+        vector<unsigned char> buf(0x40000);
+        for (auto pos = data_end; pos > table_end; )
         {
-            if (seek_read(m_pakfile, -static_cast<streampos>(shiftpos), ios::end))
+            const auto n = static_cast<size_t>(min<uint64_t>(buf.size(), pos - table_end));
+            pos -= n;
+            if (m_pakfile.read(buf.data(), n, pos) != n)
                 return false;
-            
-            constexpr streamsize bsz = 4096;
-
-            vector<char> buf(max(bsz, shiftpos));
-
-            if (read_file(m_pakfile, buf.data(), shiftpos) != shiftpos)
-                return false;
-            
-            if (!seek_write(m_pakfile, 0, ios::end))
-                return false;
-            
-            write_file(m_pakfile, buf.data(), shiftpos);
-            
-            for (streampos i = data_size - bsz; i > 0; i -= bsz)
-            {
-                const auto rsz = min(static_cast<streamsize>(i), bsz);
-                if (!seek_read(m_pakfile, i))
-                    return false;
-            
-                if (!seek_write(m_pakfile, m_pakfile.tellg() + shiftpos))
-                    return false;
-                
-                m_pakfile.read(buf.data(), rsz);
-                if (read_file(m_pakfile, buf.data(), rsz) != rsz)
-                    return false;
-                
-                write_file(m_pakfile, buf.data(), rsz);
-            }
+            m_pakfile.write(buf.data(), n, pos + shift);
         }
+        for (auto& e : m_files)
+            e.pos += static_cast<streamoff>(shift);
 
-        if (!seek_write(m_pakfile, header_size + m_files.size() * entry_size))
-            return false;
-        
-        vector<char> placeholder(num_files * entry_size);
-        ranges::fill(placeholder, '\0');
-        write_file(m_pakfile, placeholder);
+        const vector<unsigned char> placeholder(shift, 0);
+        m_pakfile.write(placeholder.data(), placeholder.size(), table_end);
         return true;
     }
 
+    uint64_t grp_pack_c::space_needed_impl(const wstring& name, uint64_t size) const
+    {
+        boost::ignore_unused(name);
+        return size + dir_entry_size;
+    }
+
+    uint64_t grp_pack_c::empty_size_impl() const
+    {
+        return header_size;
+    }
+
     size_t grp_pack_c::max_filename_len_impl() const
     {
         return 12u;
@@ -188,4 +191,19 @@ namespace pak_impl
         //It will fail way before this,but it depends on entry sizes more than anything
         return numeric_limits<uint32_t>::max();
     }
+
+    bool dir_scan_c::open_grp(const fs::path& path)
+    {
+        unsigned char header[header_size];
+        if (!m_file.open(path, file_c::access::read) || m_file.read(header, sizeof(header), 0) != sizeof(header)
+            || string_view{ reinterpret_cast<const char*>(header), KEN.length() } != KEN)
+            return false;
+
+        m_grp = true;
+        m_rec_size = dir_entry_size;
+        m_dir_pos = header_size;
+        m_records_left = load_little_u32(header + KEN.length());
+        m_grp_data = header_size + m_records_left * dir_entry_size;
+        return true;
+    }
 }
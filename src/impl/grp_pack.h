@@ -16,7 +16,11 @@ namespace pak_impl
         void close_write_impl() override;
         size_t max_filename_len_impl() const override;
         size_t max_file_count() const override;
-        bool notify_add(size_t cnt) override;
+        bool notify_add(size_t cnt, std::uint64_t data_size) override;
+        std::uint64_t space_needed_impl(const std::wstring& name, std::uint64_t size) const override;
+        std::uint64_t empty_size_impl() const override;
+        std::optional<size_t> resume_impl(const std::filesystem::path& path, std::span<const journal_entry_t> done) override;
+        std::optional<std::tuple<std::uint64_t, std::uint64_t>> written_extent_impl() const override;
 
         bool read_header() override;
     private:
@@ -0,0 +1,133 @@
+#include "../journal.h"
+#include <boost/locale.hpp>
+#include <charconv>
+#include <format>
+#include <stdexcept>
+
+using namespace std;
+namespace fs = std::filesystem;
+namespace conv = boost::locale::conv;
+
+namespace
+{
+    constexpr auto header = "paktool journal 1\n"sv;
+
+    //Names are the last field of a line, so only what would end it has to be escaped
+    string escape(const wstring& name)
+    {
+        string escaped;
+        for (const auto c : conv::utf_to_utf<char>(name))
+        {
+            if (c == '\\' || c == '\n' || c == '\t')
+                escaped += c == '\n' ? "\\n" : c == '\t' ? "\\t" : "\\\\";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    optional<wstring> unescape(string_view str)
+    {
+        string name;
+        for (size_t i = 0; i < str.size(); ++i)
+        {
+            if (str[i] != '\\')
+            {
+                name += str[i];
+                continue;
+            }
+            if (++i == str.size())
+                return {};
+            name += str[i] == 'n' ? '\n' : str[i] == 't' ? '\t' : str[i];
+        }
+        return conv::utf_to_utf<wchar_t>(name);
+    }
+
+    template<typename T>
+    bool parse_field(string_view& line, T& v, int base = 10)
+    {
+        const auto [ptr, ec] = from_chars(line.data(), line.data() + line.size(), v, base);
+        if (ec != errc{} || ptr == line.data() + line.size() || *ptr != '\t')
+            return false;
+        line.remove_prefix(static_cast<size_t>(ptr - line.data()) + 1u);
+        return true;
+    }
+}
+
+namespace pak
+{
+    journal_c::journal_c(const fs::path& path, bool resume) : m_path(path)
+    {
+        if (!resume || !fs::exists(m_path))
+        {
+            m_file.open(m_path, ios::binary | ios::trunc);
+            if (!m_file.write(header.data(), static_cast<streamsize>(header.size())).flush())
+                throw runtime_error(format("Could not create {}.", m_path.string()));
+            return;
+        }
+
+        string text;
+        {
+            ifstream in(m_path, ios::binary);
+            text.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        if (!text.starts_with(header))
+            throw runtime_error(format("{} is not a journal.", m_path.string()));
+
+        //A line without its newline was being written when the process stopped
+        for (auto pos = header.size(); pos < text.size();)
+        {
+            const auto nl = text.find('\n', pos);
+            if (nl == string::npos)
+                break;
+
+            auto line = string_view{ text }.substr(pos, nl - pos);
+            pack_i::journal_entry_t e;
+            if (!parse_field(line, e.offset) || !parse_field(line, e.end) || !parse_field(line, e.size) || !parse_field(line, e.crc, 16))
+                break;
+            auto name = unescape(line);
+            if (!name)
+                break;
+            e.name = std::move(*name);
+            m_entries.push_back(std::move(e));
+            m_ends.push_back(nl + 1u);
+            pos = nl + 1u;
+        }
+        keep(m_entries.size());
+    }
+
+    void journal_c::add(pack_i::journal_entry_t entry)
+    {
+        const auto line = format("{}\t{}\t{}\t{:08x}\t{}\n", entry.offset, entry.end, entry.size, entry.crc, escape(entry.name));
+        if (!m_file.write(line.data(), static_cast<streamsize>(line.size())).flush())
+            throw runtime_error(format("Could not write to {}.", m_path.string()));
+
+        m_ends.push_back((m_ends.empty() ? header.size() : m_ends.back()) + line.size());
+        m_entries.push_back(std::move(entry));
+    }
+
+    void journal_c::keep(size_t count)
+    {
+        count = min(count, m_entries.size());
+        m_file.close();
+        fs::resize_file(m_path, count == 0u ? header.size() : m_ends[count - 1u]);
+        m_entries.resize(count);
+        m_ends.resize(count);
+        reopen();
+    }
+
+    void journal_c::remove()
+    {
+        m_file.close();
+        fs::remove(m_path);
+        m_entries.clear();
+        m_ends.clear();
+    }
+
+    void journal_c::reopen()
+    {
+        m_file.open(m_path, ios::binary | ios::app);
+        if (!m_file)
+            throw runtime_error(format("Could not open {}.", m_path.string()));
+    }
+}
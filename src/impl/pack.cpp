@@ -1,15 +1,17 @@
 #include "../pack.h"
-#include "fs_pack.h"
-#include "pak_pack.h"
-#include "pk3_pack.h"
-#include "grp_pack.h"
+#include "../entry_cache.h"
+#include "../journal.h"
+#include "../scheduler.h"
+#include "typed_pack.h"
+#include "scan_pack.h"
 #include "pakutil.h"
 #include <boost/algorithm/string.hpp>
 #include <boost/locale.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/core/ignore_unused.hpp>
 #include <format>
-#include <regex>
+#include <atomic>
+#include <zlib.h>
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -24,6 +26,8 @@ namespace
 
         return filename;
     }
+
+    atomic<uint64_t> next_generation = 1;
 }
 namespace pak
 {
@@ -31,21 +35,33 @@ namespace pak
     static constexpr auto PK3 = L".pk3";
     static constexpr auto ZIP = L".zip";
     static constexpr auto GRP = L".grp";
+    static constexpr auto STDIO = L"-";
     //static
-    unique_ptr<pack_i> pack_i::open_pack(const fs::path& path, mode m, warning_func_t warn_func)
+    unique_ptr<pack_i> pack_i::make_pack(const fs::path& path, mode m)
     {
         unique_ptr<pack_i> ppak;
-        if (fs::is_directory(path))
-            ppak = make_unique<pak_impl::fs_pack_c>();
+        if (path == STDIO)
+        {
+            if (m == mode::rw_new)
+                ppak = make_unique<pak_impl::typed_pack_c<pak_impl::pk3_stream_pack_c>>();
+        }
+        else if (fs::is_directory(path))
+            ppak = make_unique<pak_impl::typed_pack_c<pak_impl::fs_pack_c>>();
         else if (const auto ext = path.extension().wstring(); boost::iequals(ext, PAK))
-            ppak = make_unique<pak_impl::pak_pack_c>();
+            ppak = make_unique<pak_impl::typed_pack_c<pak_impl::pak_pack_c>>();
         else if (boost::iequals(ext, PK3) || boost::iequals(ext, ZIP))
-            ppak = make_unique<pak_impl::pk3_pack_c>();
+            ppak = make_unique<pak_impl::typed_pack_c<pak_impl::pk3_pack_c>>();
         else if (boost::iequals(ext, GRP))
-            ppak = make_unique<pak_impl::grp_pack_c>();
+            ppak = make_unique<pak_impl::typed_pack_c<pak_impl::grp_pack_c>>();
         else if (ext.empty() && m == mode::rw_new && fs::is_directory(path.parent_path()))
-            ppak = make_unique<pak_impl::fs_pack_c>();
+            ppak = make_unique<pak_impl::typed_pack_c<pak_impl::fs_pack_c>>();
+        return ppak;
+    }
 
+    //static
+    unique_ptr<pack_i> pack_i::open_pack(const fs::path& path, mode m, warning_func_t warn_func)
+    {
+        auto ppak = make_pack(path, m);
         if (ppak)
         {
             ppak->m_warn_func = warn_func;
@@ -62,46 +78,243 @@ namespace pak
             case mode::read_only:
                 if (!ppak->open_pack_impl(path, ppak->m_opened_write))
                     return nullptr;
-                ppak->rebuild_idx();
                 break;
             }
         }
         return ppak;
     }
 
-    bool pack_i::notify_add(size_t cnt)
+    //static
+    unique_ptr<pack_i> pack_i::resume_pack(const fs::path& path, journal_c& journal, warning_func_t warn_func)
+    {
+        auto ppak = make_pack(path, mode::read_write);
+        if (ppak == nullptr)
+            return nullptr;
+        ppak->m_warn_func = warn_func;
+        ppak->m_filepath = path;
+
+        //The journal is written after the data, which may still not have made it to the disk
+        auto intact = [&](const journal_entry_t& e)
+        {
+            try
+            {
+                auto reader = ppak->open_reader(e.name);
+                if (reader == nullptr)
+                    return false;
+
+                vector<uint8_t> buf(0x40000);
+                auto crc = crc32(0L, Z_NULL, 0);
+                uint64_t size = 0;
+                for (auto r = reader->read(buf.data(), buf.size()); r > 0; r = reader->read(buf.data(), buf.size()))
+                {
+                    crc = crc32(crc, buf.data(), static_cast<uInt>(r));
+                    size += r;
+                }
+                return size == e.size && crc == e.crc;
+            }
+            catch (const exception&)
+            {
+                return false;
+            }
+        };
+
+        //Every round keeps fewer entries, until all that are kept are intact
+        auto keep = journal.entries().size();
+        for (;;)
+        {
+            const auto done = span{ journal.entries() }.first(keep);
+            const auto kept = ppak->resume_impl(path, done);
+            if (!kept || !ppak->open_pack_impl(path, false))
+                return nullptr;
+
+            atomic<size_t> first_bad = *kept;
+            task_group_c checks;
+            for (size_t i = 0; i < *kept; ++i)
+            {
+                checks.run([&, i]()
+                {
+                    if (i < first_bad && !intact(done[i]))
+                    {
+                        for (auto bad = first_bad.load(); i < bad && !first_bad.compare_exchange_weak(bad, i);)
+                        {
+                        }
+                    }
+                });
+            }
+            checks.wait();
+            ppak->close_pack();
+
+            keep = first_bad;
+            if (keep == *kept)
+                break;
+        }
+        journal.keep(keep);
+
+        ppak->m_opened_write = true;
+        if (!ppak->open_pack_impl(path, true))
+            return nullptr;
+        //Folders that are opened are read only, this one is written to
+        ppak->m_opened_write = true;
+        return ppak;
+    }
+
+    //static
+    unique_ptr<stream_pack_i> stream_pack_i::scan_pack(const fs::path& path, pack_i::warning_func_t warn_func)
+    {
+        if (fs::is_directory(path))
+        {
+            auto pscan = make_unique<pak_impl::fs_scan_c>(warn_func);
+            return pscan->open(path) ? std::move(pscan) : nullptr;
+        }
+        
+        const auto ext = path.extension().wstring();
+        if (boost::iequals(ext, PAK) || boost::iequals(ext, GRP))
+        {
+            auto pscan = make_unique<pak_impl::dir_scan_c>(warn_func);
+            return (boost::iequals(ext, PAK) ? pscan->open_pak(path) : pscan->open_grp(path)) ? std::move(pscan) : nullptr;
+        }
+        else if (boost::iequals(ext, PK3) || boost::iequals(ext, ZIP))
+        {
+            auto pscan = make_unique<pak_impl::pk3_scan_c>(warn_func);
+            return pscan->open(path) ? std::move(pscan) : nullptr;
+        }
+        return nullptr;
+    }
+
+    bool pack_i::notify_add(size_t cnt, uint64_t data_size)
     {
         //Re-implement if the pack needs to allocate space in the file
         //before a large add operation
-        boost::ignore_unused(cnt);
+        boost::ignore_unused(cnt, data_size);
         return m_opened_write;
     }
 
-    bool pack_i::next_output()
+    void pack_i::reserve_entry_impl(uint64_t size)
     {
-        const auto name = m_filepath.filename().replace_extension(L"").string();
-        const regex re("^pak([0-9]+)$", regex_constants::icase);
-        std::smatch m;
-        if (regex_search(name, m, re) && m.size() == 2u)
-        {
-            const auto newnum = boost::lexical_cast<int>(m[1].str()) + 1;
+        //Re-implement if entries are files of their own
+        boost::ignore_unused(size);
+    }
+
+    unique_ptr<entry_reader_i> pack_i::open_reader_impl(size_t idx) const
+    {
+        //Re-implement if entries can be read without the current entry
+        boost::ignore_unused(idx);
+        return nullptr;
+    }
 
-            auto filepath = m_filepath.parent_path()
-                / format("{}{}{}", name.substr(0, 3), newnum, m_filepath.filename().extension().string());
+    bool pack_i::seek_entry_impl(uint64_t pos)
+    {
+        //Re-implement if the current entry can be read from anywhere
+        boost::ignore_unused(pos);
+        return false;
+    }
 
-            if (!fs::exists(filepath) && close_pack())
-            {
-                std::swap(filepath, m_filepath);
-                if (create_pack_impl(m_filepath))
-                    return true;
-                std::swap(filepath, m_filepath);
-            }
-        }
+    optional<size_t> pack_i::resume_impl(const fs::path& path, span<const journal_entry_t> done)
+    {
+        //Re-implement along with written_extent_impl if a stopped write can be continued
+        boost::ignore_unused(path, done);
+        return {};
+    }
+
+    optional<tuple<uint64_t, uint64_t>> pack_i::written_extent_impl() const
+    {
+        return {};
+    }
+
+    optional<size_t> pack_i::copy_stored_impl(const pack_i& src, size_t idx, const wstring& name, const optional<filetime_t>& ft)
+    {
+        //Re-implement if the format compresses, copying the data as it is saves compressing it again
+        boost::ignore_unused(src, idx, name, ft);
+        return {};
+    }
+
+    vector<pack_i::problem_t> pack_i::verify_impl() const
+    {
+        //Re-implement if the format has something to check
+        return {};
+    }
+
+    vector<pack_i::problem_t> pack_i::verify() const
+    {
+        auto problems = verify_impl();
+
+        //Only one of them can ever be opened
+        auto names = sorted_idx() | views::transform([this](auto v) { return fold_name(entry_name(v)); });
+        for (auto r = ranges::adjacent_find(names); r != end(names); r = ranges::adjacent_find(next(r), end(names)))
+            problems.emplace_back(entry_name(*r.base()), L"Duplicate entry.");
+
+        ranges::sort(problems);
+        return problems;
+    }
+
+    uint64_t pack_i::space_needed_impl(const wstring& name, uint64_t size) const
+    {
+        //Re-implement if entries need headers or directory records
+        boost::ignore_unused(name);
+        return size;
+    }
+
+    uint64_t pack_i::empty_size_impl() const
+    {
+        return 0;
+    }
+
+    //static
+    fs::path pack_i::volume_path(const fs::path& first, size_t volume, const wstring& name_template)
+    {
+        if (volume == 0)
+            return first;
+
+        const auto stem = first.filename().replace_extension(L"").wstring();
+        const auto digits = ranges::find_if_not(stem | views::reverse, [](auto c) { return c >= L'0' && c <= L'9'; }).base();
+        const auto name = wstring{ begin(stem), digits };
+        const auto start = digits == end(stem) ? size_t(1) : boost::lexical_cast<size_t>(wstring{ digits, end(stem) });
 
+        auto filename = name_template.empty() ? L"{name}{n}"s : name_template;
+        boost::replace_all(filename, L"{name}", name);
+        boost::replace_all(filename, L"{n}", to_wstring(start + volume));
+        return first.parent_path() / (filename + first.extension().wstring());
+    }
+
+    bool pack_i::next_output()
+    {
+        auto filepath = volume_path(m_filepath, 1);
+        if (!fs::exists(filepath) && close_pack())
+        {
+            std::swap(filepath, m_filepath);
+            if (create_pack_impl(m_filepath))
+                return true;
+            std::swap(filepath, m_filepath);
+        }
         return false;
     }
 
-    bool pack_i::new_entry(const wstring& name, const optional<filetime_t>& ft)
+    bool pack_i::new_entry(const wstring& name, const optional<filetime_t>& ft, uint64_t size_hint)
+    {
+        if (!check_new_name(name))
+            return false;
+        m_write_idx = new_entry_impl(name, ft);
+        if (m_write_idx && size_hint > 0u)
+            reserve_entry_impl(size_hint);
+        m_journal_crc = static_cast<uint32_t>(crc32(0L, Z_NULL, 0));
+        m_journal_size = 0;
+        return m_write_idx.has_value();
+    }
+
+    bool pack_i::copy_stored(const pack_i& src, const entry_info_t& info, const optional<filetime_t>& ft)
+    {
+        if (!info.crc || !check_new_name(wstring{ info.name }))
+            return false;
+        m_write_idx = copy_stored_impl(src, info.index, wstring{ info.name }, ft);
+        if (!m_write_idx)
+            return false;
+        m_journal_crc = *info.crc;
+        m_journal_size = info.size;
+        entry_written();
+        return true;
+    }
+
+    optional<wstring> pack_i::check_new_name(const wstring& name)
     {
         if (!m_opened_write)
             throw runtime_error("Pack not writeable.");
@@ -133,68 +346,285 @@ namespace pak
         if (auto e = find_entry(filename))
         {
             emit_warning(name, L"Duplicate entry."s);
-            return false;
+            return {};
         }
-        m_write_idx = new_entry_impl(name, ft);
-        return m_write_idx.has_value();
+        return filename;
     }
 
     bool pack_i::open_entry(const wstring& name)
     {
         const auto filename = conv_separators(name);
-        if (auto e = find_entry(filename); e && open_entry_impl(*e))
+        if (auto e = find_entry(filename); e && open_idx(*e))
+            return true;
+        emit_warning(filename, L"Entry not found.");
+        return false;
+    }
+
+    bool pack_i::open_entry(const entry_info_t& info)
+    {
+        //The info may be from another pack_i of the same file, or of a different one
+        if (info.index < entry_count() && entry_name(info.index) == info.name)
+            return open_idx(info.index);
+        return open_entry(wstring{ info.name });
+    }
+
+    bool pack_i::open_idx(size_t idx)
+    {
+        m_cached = m_cache ? m_cache->get(*this, idx) : nullptr;
+        m_cached_pos = 0;
+        if (m_cached || open_entry_impl(idx))
         {
-            m_read_idx = e;
+            m_read_idx = idx;
             return true;
         }
-        emit_warning(filename, L"Entry not found.");
         return false;
     }
 
+    unique_ptr<entry_reader_i> pack_i::open_reader(const wstring& name) const
+    {
+        const auto idx = find_entry(conv_separators(name));
+        return idx ? open_reader_impl(*idx) : nullptr;
+    }
+
+    unique_ptr<entry_reader_i> pack_i::open_reader(const entry_info_t& info) const
+    {
+        if (info.index < entry_count() && entry_name(info.index) == info.name)
+            return open_reader_impl(info.index);
+        return open_reader(wstring{ info.name });
+    }
+
     optional<size_t> pack_i::find_entry(const wstring& name) const
     {
-        auto names = m_file_idx
-            | views::transform([this](auto v) { return boost::to_lower_copy(entry_name(v)); });
+        const auto folded = fold_name(name);
+        auto lookup = [&]() -> optional<size_t>
+        {
+            auto names = m_file_idx
+                | views::transform([this](auto v) { return fold_name(entry_name(v)); });
+
+            if (auto r = ranges::lower_bound(names, folded); r != end(names) && *r == folded)
+                return *r.base();
+            return {};
+        };
 
-        if (auto r = ranges::lower_bound(names, boost::to_lower_copy(name));
-            r != end(names) && boost::iequals(name, *r))
+        //Nothing changes the index once it is ready, so it can be searched without the lock
+        if (m_idx_ready.load(memory_order_acquire))
+            return lookup();
+
+        lock_guard lock(m_idx_lock);
+        if (!m_idx_built)
         {
-            return *r.base();
+            build_idx();
+            m_idx_ready.store(true, memory_order_release);
         }
-        return {};
+        if (auto it = m_added.find(folded); it != end(m_added))
+            return it->second;
+        return lookup();
+    }
+
+    const vector<size_t>& pack_i::sorted_idx() const
+    {
+        if (m_idx_ready.load(memory_order_acquire))
+            return m_file_idx;
+
+        lock_guard lock(m_idx_lock);
+        if (!m_idx_built)
+        {
+            build_idx();
+        }
+        else if (!m_added.empty())
+        {
+            vector<tuple<wstring, size_t>> added(begin(m_added), end(m_added));
+            ranges::sort(added);
+            vector<size_t> merged;
+            merged.reserve(m_file_idx.size() + added.size());
+            ranges::merge(m_file_idx, added | views::elements<1>, back_inserter(merged),
+                [](const auto& a, const auto& b) { return get<0>(a) < get<0>(b); },
+                [this](auto v) { return make_tuple(fold_name(entry_name(v)), v); },
+                [this](auto v) { return make_tuple(fold_name(entry_name(v)), v); });
+            m_file_idx = std::move(merged);
+            m_added.clear();
+        }
+        m_idx_ready.store(true, memory_order_release);
+        return m_file_idx;
+    }
+
+    vector<size_t> pack_i::filtered_idx(const name_filter& filter, order o) const
+    {
+        //Names aren't decoded just to be let through by an empty filter
+        auto matches = [&](auto v) { return filter.empty() || filter(entry_name(v)); };
+        auto lowered = [this](auto v) { return fold_name(entry_name(v)); };
+
+        vector<size_t> idx;
+        if (o != order::name)
+        {
+            //Every entry is visited once anyway, so the name index isn't needed
+            ranges::copy(views::iota(size_t(0), entry_count()) | views::filter(matches), back_inserter(idx));
+            if (o == order::stored)
+                return idx;
+
+            //Entries that aren't in the file (like in a folder) go last in name order
+            vector<tuple<bool, uint64_t, wstring, size_t>> keys;
+            keys.reserve(idx.size());
+            ranges::transform(idx, back_inserter(keys), [&](auto v)
+            {
+                const auto offset = entry_info_impl(v).offset;
+                return make_tuple(!offset.has_value(), offset.value_or(0), offset ? wstring{} : lowered(v), v);
+            });
+            ranges::sort(keys);
+            ranges::copy(keys | views::elements<3>, begin(idx));
+            return idx;
+        }
+
+        const auto& sorted = sorted_idx();
+        if (const auto prefixes = filter.prefixes())
+        {
+            //Prefixes are sorted and don't overlap, so the result stays in index order
+            for (const auto& prefix : *prefixes)
+            {
+                const auto first = ranges::lower_bound(sorted, prefix, {}, lowered);
+                const auto last = ranges::partition_point(first, end(sorted),
+                    [&](auto v) { return lowered(v).starts_with(prefix); });
+                ranges::copy(ranges::subrange(first, last) | views::filter(matches), back_inserter(idx));
+            }
+        }
+        else
+        {
+            ranges::copy(sorted | views::filter(matches), back_inserter(idx));
+        }
+        return idx;
+    }
+
+    vector<wstring_view> pack_i::file_names(const name_filter& filter, order o) const
+    {
+        const auto idx = filtered_idx(filter, o);
+        vector<wstring_view> names;
+        names.reserve(idx.size());
+        ranges::transform(idx, back_inserter(names), [this](auto v) { return wstring_view{ entry_name(v) }; });
+        return names;
+    }
+
+    vector<pack_i::entry_info_t> pack_i::entries(const name_filter& filter, order o) const
+    {
+        const auto idx = filtered_idx(filter, o);
+        vector<entry_info_t> infos;
+        infos.reserve(idx.size());
+        ranges::transform(idx, back_inserter(infos), [this](auto v) { return make_info(v); });
+        return infos;
     }
 
     size_t pack_i::read(uint8_t* data, size_t sz)
     {
+        if (m_cached)
+        {
+            const auto len = static_cast<size_t>(min<uint64_t>(sz, m_cached->size() - m_cached_pos));
+            copy_n(m_cached->data() + m_cached_pos, len, data);
+            m_cached_pos += len;
+            return len;
+        }
         if (m_read_idx)
             return read_entry_impl(data, sz);
         return 0;
     }
 
+    bool pack_i::write_from(pack_i& src)
+    {
+        if (!m_write_idx)
+            return false;
+        //The typed loops write straight to the backend, past the journal's CRC
+        if (src.m_read_idx && !src.m_cached && !m_journal && src.m_backend_id != 0u && m_backend_id != 0u)
+            return pak_impl::typed_copy(src, src.m_backend_id, *this, m_backend_id);
+
+        uint8_t buf[0xFFFF];
+        for (auto s = src.read(buf, size(buf)); s > 0; s = src.read(buf, size(buf)))
+        {
+            if (write(buf, s) != s)
+                return false;
+        }
+        return true;
+    }
+
+    bool pack_i::seek(uint64_t pos)
+    {
+        if (m_cached)
+        {
+            if (pos > m_cached->size())
+                return false;
+            m_cached_pos = pos;
+            return true;
+        }
+        return m_read_idx && seek_entry_impl(pos);
+    }
+
     size_t pack_i::write(const uint8_t* data, size_t sz)
     {
-        if (m_write_idx)
-            return write_entry_impl(data, sz);
-        return 0;
+        if (!m_write_idx)
+            return 0;
+
+        const auto written = write_entry_impl(data, sz);
+        if (m_journal)
+        {
+            for (size_t pos = 0; pos < written; pos += 0x40000000u)
+                m_journal_crc = static_cast<uint32_t>(crc32(m_journal_crc, data + pos, static_cast<uInt>(min<size_t>(written - pos, 0x40000000u))));
+            m_journal_size += written;
+        }
+        return written;
     }
 
     void pack_i::close_read_entry()
     {
-        if (m_read_idx.has_value())
+        if (m_read_idx.has_value() && !m_cached)
             close_read_impl();
         m_read_idx.reset();
+        m_cached.reset();
     }
     
     void pack_i::close_write_entry()
     {
-        if (m_write_idx.has_value())
-            close_write_impl();
+        if (!m_write_idx.has_value())
+            return;
+        close_write_impl();
+        entry_written();
+    }
+
+    void pack_i::entry_written()
+    {
+        if (m_journal)
+        {
+            if (const auto extent = written_extent_impl())
+                m_journal->add({ entry_name(*m_write_idx), m_journal_size, m_journal_crc, get<0>(*extent), get<1>(*extent) });
+        }
+
+        //A folder pack overwrites the file when a name is written again, so what was read before
+        //may be gone
+        m_generation = new_generation();
+
+        //Added to the index without sorting it again, unless it hasn't been built yet
+        lock_guard lock(m_idx_lock);
+        if (m_idx_built)
+        {
+            m_added.emplace(fold_name(entry_name(*m_write_idx)), *m_write_idx);
+            m_idx_ready = false;
+        }
         m_write_idx.reset();
-        rebuild_idx();
     }
 
     bool pack_i::close_pack()
     {
+        //Whatever is opened after this is different content
+        m_generation = new_generation();
+        {
+            lock_guard lock(m_idx_lock);
+            m_file_idx.clear();
+            m_added.clear();
+            m_idx_built = false;
+            m_idx_ready = false;
+        }
         return close_pack_impl();
     }
+
+    //static
+    uint64_t pack_i::new_generation() noexcept
+    {
+        return next_generation++;
+    }
 }
@@ -1,4 +1,5 @@
 #include "pak_pack.h"
+#include "scan_pack.h"
 #include <boost/endian.hpp>
 #include <boost/locale.hpp>
 #include <boost/algorithm/string.hpp>
@@ -13,39 +14,13 @@ using boost::to_lower_copy;
 namespace conv = boost::locale::conv;
 using namespace boost::endian;
 
-namespace
-{
-    auto from_text(const string_view& str)
-    {
-        //Let's hope it's ascii
-        if (pak_impl::is_ascii(str))
-            return conv::to_utf<wchar_t>(string{ str }, "Latin1");
-        
-        try
-        {
-            //Maybe someone stored it as utf-8?
-            return conv::utf_to_utf<wchar_t, char>(string{ str });
-        }
-        catch (const conv::conversion_error& )
-        {
-        }
-        //It must be some legacy encoding and we can't tell which so we guess Win1252
-        return conv::to_utf<wchar_t>(string{ str }, "Windows-1252");
-    }
-}
-
 namespace pak_impl
 {
     static constexpr auto PACK = "PACK"sv;
 
     bool pak_pack_c::open_pack_impl(const fs::path& path, bool w)
     {
-        auto oflags = ios::in | ios::binary;
-        if (w)
-            oflags |= ios::out;
-
-        m_pakfile.open(path, oflags);
-        if (!m_pakfile.is_open())
+        if (!m_pakfile.open(path, w ? file_c::access::read_write : file_c::access::read))
             return false;
         if (!read_header())
         {
@@ -58,52 +33,68 @@ namespace pak_impl
 
     bool pak_pack_c::read_header()
     {
-        char buf[PACK.length()];
-        if (read_file(m_pakfile, buf) != sizeof(buf) || string_view{ buf, size(buf) } != PACK)
+        char header[PACK.length() + sizeof(int32_t) * 2];
+        if (m_pakfile.read(header, sizeof(header), 0) != sizeof(header) || string_view{ header, PACK.length() } != PACK)
             return false;
         
-        const auto ft_offset = little_to_native(read_file<int32_t>(m_pakfile));
-        const auto ft_size = little_to_native(read_file<int32_t>(m_pakfile));
+        const auto ft_offset = load_little_s32(reinterpret_cast<const unsigned char*>(header) + 4);
+        const auto ft_size = load_little_s32(reinterpret_cast<const unsigned char*>(header) + 8);
+        if (ft_offset < 0 || ft_size < 0)
+            return false;
 
         const size_t file_cnt = ft_size / 64u;
-        m_files.reserve(file_cnt);
+        m_meta_ranges = { { 0, static_cast<streamoff>(sizeof(header)) }, { ft_offset, ft_offset + ft_size } };
 
-        if (!seek_read(m_pakfile, ft_offset))
+        //The whole directory is read at once, a damaged header mustn't make that huge
+        if (static_cast<uint64_t>(ft_offset) + static_cast<uint64_t>(ft_size) > m_pakfile.size())
+            return false;
+        vector<unsigned char> dir(file_cnt * 64u);
+        if (m_pakfile.read(dir.data(), dir.size(), static_cast<uint64_t>(ft_offset)) != dir.size())
             return false;
-        
-        for (size_t i = 0; i < file_cnt; ++i)
-        {
-            char nmbuf[56];
-            if (read_file(m_pakfile, nmbuf) != sizeof(nmbuf))
-                return false;
 
+        m_files.reserve(file_cnt);
+        for (auto rec = dir.data(); rec != dir.data() + dir.size(); rec += 64)
+        {
+            const auto nmbuf = reinterpret_cast<const char*>(rec);
             m_files.emplace_back(entry_t{
-                .pos = little_to_native(read_file<int32_t>(m_pakfile)),
-                .len = static_cast<size_t>(little_to_native(read_file<int32_t>(m_pakfile))), 
-                .name = from_text(nmbuf)
+                .pos = load_little_s32(rec + 56),
+                .len = static_cast<size_t>(load_little_s32(rec + 60)),
+                .name = { { nmbuf, static_cast<size_t>(find(nmbuf, nmbuf + 56, '\0') - nmbuf) }, &from_text }
             });
-
         }
 
+        //New entries go after everything that is there, overwriting the directory if it's last
+        m_write_offs = ft_offset + ft_size;
+        for (const auto& e : m_files)
+            m_write_offs = max(m_write_offs, e.pos + static_cast<streamoff>(e.len));
+        if (m_write_offs == ft_offset + ft_size)
+            m_write_offs = ft_offset;
         return true;
     }
 
     bool pak_pack_c::create_pack_impl(const fs::path& path)
     {
-        m_pakfile.open(path, ios::binary | ios::out | ios::in | ios::trunc);
-        if (!m_pakfile.is_open())
+        if (!m_pakfile.open(path, file_c::access::create))
             return false;
         
-        write_file(m_pakfile, PACK);
-        write_file(m_pakfile, int32_t(0));
-        write_file(m_pakfile, int32_t(0));
-        m_write_offs = m_pakfile.tellp();
+        unsigned char header[PACK.length() + sizeof(int32_t) * 2] = {};
+        ranges::copy(PACK, header);
+        m_pakfile.write(header, sizeof(header), 0);
+        m_write_offs = sizeof(header);
         return true;
     }
 
     bool pak_pack_c::open_entry_impl(size_t idx)
     {
-        return seek_write(m_pakfile, m_files[idx].pos);
+        m_pakfile.will_need(m_files[idx].pos, m_files[idx].len);
+        return m_pakfile.is_open();
+    }
+
+    unique_ptr<pak::entry_reader_i> pak_pack_c::open_reader_impl(size_t idx) const
+    {
+        if (!m_pakfile.is_open())
+            return nullptr;
+        return make_unique<range_reader_c>(m_pakfile, m_files[idx].pos, m_files[idx].len);
     }
 
     optional<pak::pack_i::filetime_t> pak_pack_c::entry_timestamp_impl(size_t idx) const
@@ -113,30 +104,46 @@ namespace pak_impl
         return {};
     }
     
+    pak::pack_i::entry_info_t pak_pack_c::entry_info_impl(size_t idx) const
+    {
+        entry_info_t info;
+        info.size = info.stored_size = m_files[idx].len;
+        info.offset = static_cast<uint64_t>(m_files[idx].pos);
+        return info;
+    }
+
+    uint64_t pak_pack_c::space_needed_impl(const wstring& name, uint64_t size) const
+    {
+        boost::ignore_unused(name);
+        return size + sizeof(int32_t) * 2 + 1 + max_filename_len_impl();
+    }
+
+    uint64_t pak_pack_c::empty_size_impl() const
+    {
+        return PACK.length() + sizeof(int32_t) * 2;
+    }
+
     optional<size_t> pak_pack_c::new_entry_impl(const wstring& name, const optional<filetime_t>& ft)
     {
         boost::ignore_unused(ft);
 
-        const auto idx = m_files.size();
+        if (!m_pakfile.is_open())
+            return {};
+
         m_files.emplace_back();
         m_files.back().name = name;
-        
-        if (seek_write(m_pakfile, m_write_offs))
-        {
-            m_files.back().pos = m_pakfile.tellp();
-            return idx;
-        }
-        m_files.pop_back();
-        return {};
+        m_files.back().pos = m_write_offs;
+        return m_files.size() - 1;
     }
 
     size_t pak_pack_c::read_entry_impl(uint8_t* buf, size_t sz)
     {
         if (m_pakfile.is_open())
         {
-            if (const auto actrd = min(m_files[*m_read_idx].len - m_totread, sz); actrd > 0)
+            const auto& e = m_files[*m_read_idx];
+            if (const auto actrd = min(e.len - m_totread, sz); actrd > 0)
             {
-                const auto r = static_cast<size_t>(read_file(m_pakfile, buf, actrd));
+                const auto r = m_pakfile.read(buf, actrd, e.pos + m_totread);
                 m_totread += r;
                 return r;
             }
@@ -148,7 +155,8 @@ namespace pak_impl
     {
         if (m_pakfile.is_open())
         {
-            write_file(m_pakfile, buf, size);
+            m_pakfile.write(buf, size, m_write_offs);
+            m_write_offs += size;
 
             m_files[*m_write_idx].len += size;
             if (m_files[*m_write_idx].len > numeric_limits<int32_t>::max())
@@ -158,13 +166,66 @@ namespace pak_impl
         return 0;
     }
 
+    bool pak_pack_c::notify_add(size_t cnt, uint64_t data_size)
+    {
+        //Data and the directory after it, the file is trimmed to what was used on close
+        const auto rec_size = sizeof(int32_t) * 2 + 1 + max_filename_len_impl();
+        m_pakfile.reserve(static_cast<uint64_t>(m_write_offs) + data_size + (m_files.size() + cnt) * rec_size);
+        return m_pakfile.is_open();
+    }
+
+    vector<pak::pack_i::problem_t> pak_pack_c::verify_impl() const
+    {
+        //There is nothing to checksum, so it is all about the directory making sense
+        vector<problem_t> problems;
+        error_code ec;
+        const auto file_size = static_cast<streamoff>(fs::file_size(m_filepath, ec));
+        if (ec)
+            return { { L"", from_text(ec.message()) } };
+
+        for (const auto& [start, end] : m_meta_ranges | views::filter([&](const auto& v) { return v.second > file_size; }))
+            problems.emplace_back(L"", format(L"Directory at {} extends past the end of the file.", start));
+
+        vector<const entry_t*> by_pos;
+        for (const auto& e : m_files)
+        {
+            if (e.pos < 0 || e.pos > file_size || static_cast<streamoff>(e.len) > file_size - e.pos)
+                problems.emplace_back(e.name.get(), format(L"Data at {} with size {} is past the end of the file.", e.pos, e.len));
+            else if (e.len > 0)
+                by_pos.push_back(&e);
+        }
+
+        auto overlaps = [](streamoff s1, streamoff e1, streamoff s2, streamoff e2) { return s1 < e2 && s2 < e1; };
+        ranges::sort(by_pos, {}, &entry_t::pos);
+        for (auto e = begin(by_pos); e != end(by_pos); ++e)
+        {
+            const auto e_end = (*e)->pos + static_cast<streamoff>((*e)->len);
+            if (ranges::any_of(m_meta_ranges, [&](const auto& v) { return overlaps((*e)->pos, e_end, v.first, v.second); }))
+                problems.emplace_back((*e)->name.get(), L"Data overlaps the pack header or directory.");
+
+            //Sorted by position, so only the following entries that start before this ends can overlap
+            for (auto o = next(e); o != end(by_pos) && (*o)->pos < e_end; ++o)
+                problems.emplace_back((*o)->name.get(), format(L"Data overlaps {}.", (*e)->name.get()));
+        }
+        return problems;
+    }
+
     bool pak_pack_c::close_pack_impl()
     {
         m_files.clear();
+        m_meta_ranges.clear();
         m_pakfile.close();
         return !m_pakfile.is_open();
     }
 
+    bool pak_pack_c::seek_entry_impl(uint64_t pos)
+    {
+        if (pos > m_files[*m_read_idx].len)
+            return false;
+        m_totread = static_cast<size_t>(pos);
+        return true;
+    }
+
     void pak_pack_c::close_read_impl()
     {
         m_totread = 0;
@@ -172,40 +233,83 @@ namespace pak_impl
 
     void pak_pack_c::close_write_impl()
     {
-        const auto final_pos = static_cast<int64_t>(m_pakfile.tellp());
-        const auto dir_size = static_cast<int64_t>(m_files.size() * (sizeof(int32_t) * 2 + 1 + max_filename_len_impl()));
+        //The pack is complete after every entry, the data of the next one goes over the directory
+        write_directory();
+    }
+
+    optional<size_t> pak_pack_c::resume_impl(const fs::path& path, span<const journal_entry_t> done)
+    {
+        //The directory may be half overwritten by an entry that wasn't finished, so it is made
+        //again from the journal. Entries follow each other from the header on.
+        error_code ec;
+        const auto file_size = fs::file_size(path, ec);
+        if (ec)
+            return {};
+
+        size_t kept = 0;
+        auto end = empty_size_impl();
+        for (const auto& e : done)
+        {
+            if (e.offset != end || e.end != e.offset + e.size || e.end > file_size || e.size > numeric_limits<int32_t>::max())
+                break;
+            end = e.end;
+            ++kept;
+        }
+
+        m_files.clear();
+        fs::resize_file(path, end);
+        if (!m_pakfile.open(path, file_c::access::read_write))
+            return {};
+
+        unsigned char header[PACK.length() + sizeof(int32_t) * 2] = {};
+        ranges::copy(PACK, header);
+        m_pakfile.write(header, sizeof(header), 0);
+        for (const auto& e : done.first(kept))
+            m_files.push_back({ .pos = static_cast<streamoff>(e.offset), .len = static_cast<size_t>(e.size), .name = e.name });
+        m_write_offs = static_cast<streamoff>(end);
+        write_directory();
+
+        m_files.clear();
+        m_pakfile.close();
+        return kept;
+    }
+
+    optional<tuple<uint64_t, uint64_t>> pak_pack_c::written_extent_impl() const
+    {
+        const auto& e = m_files[*m_write_idx];
+        return tuple{ static_cast<uint64_t>(e.pos), static_cast<uint64_t>(e.pos) + e.len };
+    }
+
+    void pak_pack_c::write_directory()
+    {
+        const auto final_pos = static_cast<int64_t>(m_write_offs);
+        const auto rec_size = sizeof(int32_t) * 2 + 1 + max_filename_len_impl();
+        const auto dir_size = static_cast<int64_t>(m_files.size() * rec_size);
 
         if (const auto sz = final_pos + dir_size; sz > numeric_limits<int32_t>::max())
             throw runtime_error(format("PAK file size too large ({}) bytes.", sz));
         
-        vector<char> namebuf(1 + max_filename_len_impl());
-        for (const auto& v : m_files)
+        vector<unsigned char> dir(static_cast<size_t>(dir_size), '\0');
+        for (auto rec = dir.data(); const auto& v : m_files)
         {
-            const auto entry = conv::utf_to_utf<char>(v.name);
+            const auto entry = conv::utf_to_utf<char>(v.name.get());
             if (entry.length() > max_filename_len_impl())
             {
                 throw runtime_error(format("Entry name too long: {} (max is {}).",
-                    boost::locale::conv::from_utf(v.name, ""), max_filename_len_impl()));
+                    boost::locale::conv::from_utf(v.name.get(), ""), max_filename_len_impl()));
             }
 
-            fill(copy(begin(entry), end(entry), begin(namebuf)), end(namebuf), '\0');
-            write_file(m_pakfile, namebuf);
-            write_file(m_pakfile, native_to_little(static_cast<int32_t>(v.pos)));
-            write_file(m_pakfile, native_to_little(static_cast<int32_t>(v.len)));
-        }
-        m_pakfile.flush();
-        if (!m_pakfile.fail())
-        {
-            if (seek_write(m_pakfile, PACK.length()))
-            {
-                write_file(m_pakfile, native_to_little(static_cast<int32_t>(final_pos)));
-                write_file(m_pakfile, boost::endian::native_to_little(static_cast<int32_t>(dir_size)));
-            }
+            ranges::copy(entry, rec);
+            store_little_s32(rec + rec_size - 8, static_cast<int32_t>(v.pos));
+            store_little_s32(rec + rec_size - 4, static_cast<int32_t>(v.len));
+            rec += rec_size;
         }
-        m_pakfile.flush();
-        if (!seek_write(m_pakfile, final_pos))
-            throw runtime_error("Write fail.");
-        m_write_offs = final_pos;
+        m_pakfile.write(dir.data(), dir.size(), static_cast<uint64_t>(final_pos));
+
+        unsigned char dirpos[sizeof(int32_t) * 2];
+        store_little_s32(dirpos, static_cast<int32_t>(final_pos));
+        store_little_s32(dirpos + 4, static_cast<int32_t>(dir_size));
+        m_pakfile.write(dirpos, sizeof(dirpos), PACK.length());
     }
 
     size_t pak_pack_c::max_filename_len_impl() const
@@ -225,6 +329,81 @@ namespace pak_impl
 
     const wstring& pak_pack_c::entry_name(size_t idx) const
     {
-        return m_files[idx].name;
+        return m_files[idx].name.get();
+    }
+
+    bool dir_scan_c::open_pak(const fs::path& path)
+    {
+        unsigned char header[PACK.length() + sizeof(int32_t) * 2];
+        if (!m_file.open(path, file_c::access::read) || m_file.read(header, sizeof(header), 0) != sizeof(header)
+            || string_view{ reinterpret_cast<const char*>(header), PACK.length() } != PACK)
+            return false;
+
+        const auto ft_offset = load_little_s32(header + 4);
+        const auto ft_size = load_little_s32(header + 8);
+        if (ft_offset < 0 || ft_size < 0)
+            return false;
+
+        m_rec_size = 64;
+        m_dir_pos = static_cast<uint64_t>(ft_offset);
+        m_records_left = static_cast<uint64_t>(ft_size) / m_rec_size;
+        return true;
+    }
+
+    optional<wstring> dir_scan_c::next_entry()
+    {
+        m_totread = 0;
+        if (m_block_pos >= m_block.size())
+        {
+            if (m_records_left == 0)
+                return {};
+
+            const auto n = static_cast<size_t>(min<uint64_t>(m_records_left, block_records));
+            m_block.resize(n * m_rec_size);
+            if (m_file.read(m_block.data(), m_block.size(), m_dir_pos) != m_block.size())
+            {
+                emit_warning(L"", L"Directory extends past the end of the file.");
+                m_records_left = 0;
+                return {};
+            }
+            m_dir_pos += m_block.size();
+            m_records_left -= n;
+            m_block_pos = 0;
+        }
+
+        const auto rec = m_block.data() + m_block_pos;
+        m_block_pos += m_rec_size;
+        const auto name_len = m_rec_size - sizeof(int32_t) * (m_grp ? 1 : 2);
+        const auto nmbuf = reinterpret_cast<const char*>(rec);
+        const string_view rawname{ nmbuf, static_cast<size_t>(find(nmbuf, nmbuf + name_len, '\0') - nmbuf) };
+
+        m_info = {};
+        if (m_grp)
+        {
+            //Grp data follows in directory order
+            m_info.size = load_little_u32(rec + 12);
+            m_info.offset = m_grp_data;
+            m_grp_data += m_info.size;
+            m_name = from_ibm437(rawname);
+        }
+        else
+        {
+            m_info.offset = static_cast<uint64_t>(load_little_s32(rec + 56));
+            m_info.size = static_cast<uint64_t>(load_little_s32(rec + 60));
+            m_name = from_text(rawname);
+        }
+        m_info.stored_size = m_info.size;
+        return m_name;
+    }
+
+    size_t dir_scan_c::read(uint8_t* data, size_t sz)
+    {
+        const auto n = static_cast<size_t>(min<uint64_t>(sz, m_info.size - m_totread));
+        if (n == 0 || !m_info.offset.has_value())
+            return 0;
+
+        const auto r = m_file.read(data, n, *m_info.offset + m_totread);
+        m_totread += r;
+        return r;
     }
 }
\ No newline at end of file
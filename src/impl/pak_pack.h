@@ -1,7 +1,7 @@
 #ifndef PAK_PACK_H_INCLUDED
 #define PAK_PACK_H_INCLUDED
 #include "../pack.h"
-#include <fstream>
+#include "pakutil.h"
 
 namespace pak_impl
 {
@@ -12,6 +12,9 @@ namespace pak_impl
         bool create_pack_impl(const std::filesystem::path& path) override;
         bool open_entry_impl(size_t idx) override;
         std::optional<filetime_t> entry_timestamp_impl(size_t idx) const override;
+        entry_info_t entry_info_impl(size_t idx) const override;
+        std::uint64_t space_needed_impl(const std::wstring& name, std::uint64_t size) const override;
+        std::uint64_t empty_size_impl() const override;
         std::optional<size_t> new_entry_impl(const std::wstring& name, const std::optional<filetime_t>& ft) override;
         size_t read_entry_impl(std::uint8_t* buf, size_t sz) override;
         size_t write_entry_impl(const std::uint8_t* buf, size_t size) override;
@@ -22,10 +25,17 @@ namespace pak_impl
         size_t max_file_count() const override;
         size_t entry_count() const override;
         const std::wstring& entry_name(size_t idx) const override;
+        std::vector<problem_t> verify_impl() const override;
+        bool notify_add(size_t cnt, std::uint64_t data_size) override;
+        std::unique_ptr<pak::entry_reader_i> open_reader_impl(size_t idx) const override;
+        bool seek_entry_impl(std::uint64_t pos) override;
+        std::optional<size_t> resume_impl(const std::filesystem::path& path, std::span<const journal_entry_t> done) override;
+        std::optional<std::tuple<std::uint64_t, std::uint64_t>> written_extent_impl() const override;
 
         virtual bool read_header();
+        void write_directory();
 
-        std::fstream m_pakfile;
+        file_c m_pakfile;
         size_t m_totread = 0;
         std::streamoff m_write_offs = 0;
         
@@ -33,9 +43,11 @@ namespace pak_impl
         {
             std::streamoff pos = 0;
             std::size_t len = 0;
-            std::wstring name;
+            lazy_name_c name;
         };
         std::vector<entry_t> m_files;
+        //Header and directory, which no entry data should overlap
+        std::vector<std::pair<std::streamoff, std::streamoff>> m_meta_ranges;
     };
 }
 #endif
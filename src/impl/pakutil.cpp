@@ -0,0 +1,373 @@
+#include "pakutil.h"
+#include <cstring>
+#include <algorithm>
+#include <boost/core/ignore_unused.hpp>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace pak_impl
+{
+#ifdef _WIN32
+    bool file_c::open(const fs::path& path, access a)
+    {
+        close();
+        constexpr DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE;
+        const DWORD desired = a == access::read ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+        const DWORD disposition = a == access::create ? CREATE_ALWAYS : OPEN_EXISTING;
+        const auto h = CreateFileW(path.wstring().c_str(), desired, share, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE)
+            return false;
+        m_handle = h;
+        return true;
+    }
+
+    void file_c::close() noexcept
+    {
+        trim();
+        if (m_handle != nullptr)
+            CloseHandle(m_handle);
+        m_handle = nullptr;
+    }
+
+    bool file_c::is_open() const noexcept
+    {
+        return m_handle != nullptr;
+    }
+
+    size_t file_c::read(void* data, size_t sz, uint64_t pos) const
+    {
+        size_t total = 0;
+        while (total < sz)
+        {
+            OVERLAPPED ov{};
+            ov.Offset = static_cast<DWORD>(pos + total);
+            ov.OffsetHigh = static_cast<DWORD>((pos + total) >> 32);
+            DWORD rd = 0;
+            const auto chunk = static_cast<DWORD>(min<size_t>(sz - total, 0x40000000u));
+            if (!ReadFile(m_handle, static_cast<char*>(data) + total, chunk, &rd, &ov))
+            {
+                if (GetLastError() == ERROR_HANDLE_EOF)
+                    break;
+                throw runtime_error("Read error.");
+            }
+            if (rd == 0)
+                break;
+            total += rd;
+        }
+        return total;
+    }
+
+    void file_c::write(const void* data, size_t sz, uint64_t pos)
+    {
+        size_t total = 0;
+        while (total < sz)
+        {
+            OVERLAPPED ov{};
+            ov.Offset = static_cast<DWORD>(pos + total);
+            ov.OffsetHigh = static_cast<DWORD>((pos + total) >> 32);
+            DWORD wr = 0;
+            const auto chunk = static_cast<DWORD>(min<size_t>(sz - total, 0x40000000u));
+            if (!WriteFile(m_handle, static_cast<const char*>(data) + total, chunk, &wr, &ov) || wr == 0)
+                throw runtime_error("Write error.");
+            total += wr;
+        }
+    }
+
+    uint64_t file_c::size() const
+    {
+        LARGE_INTEGER sz;
+        if (!GetFileSizeEx(m_handle, &sz))
+            throw runtime_error("Read error.");
+        return static_cast<uint64_t>(sz.QuadPart);
+    }
+
+    void file_c::reserve(uint64_t end) noexcept
+    {
+        //The allocation size can be larger than the end of file, which stays where it is
+        FILE_ALLOCATION_INFO info{};
+        info.AllocationSize.QuadPart = static_cast<LONGLONG>(end);
+        if (m_handle != nullptr && SetFileInformationByHandle(m_handle, FileAllocationInfo, &info, sizeof(info)))
+            m_reserved = true;
+    }
+
+    void file_c::trim() noexcept
+    {
+        if (!m_reserved)
+            return;
+        m_reserved = false;
+        FILE_STANDARD_INFO st;
+        if (GetFileInformationByHandleEx(m_handle, FileStandardInfo, &st, sizeof(st)))
+        {
+            FILE_ALLOCATION_INFO info{};
+            info.AllocationSize = st.EndOfFile;
+            SetFileInformationByHandle(m_handle, FileAllocationInfo, &info, sizeof(info));
+        }
+    }
+
+    void file_c::will_need(uint64_t pos, uint64_t len) const noexcept
+    {
+        //Windows reads ahead by itself
+        boost::ignore_unused(pos, len);
+    }
+
+    void file_c::sequential() const noexcept
+    {
+    }
+
+    bool clone_file(const fs::path& from, const fs::path& to) noexcept
+    {
+        //ReFS can share blocks too, but not as a single call
+        boost::ignore_unused(from, to);
+        return false;
+    }
+#else
+    bool file_c::open(const fs::path& path, access a)
+    {
+        close();
+        constexpr int modes[] = { O_RDONLY, O_RDWR, O_RDWR | O_CREAT | O_TRUNC };
+        const auto fd = ::open(path.c_str(), modes[static_cast<int>(a)] | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        m_fd = fd;
+        return true;
+    }
+
+    void file_c::close() noexcept
+    {
+        trim();
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+    }
+
+    bool file_c::is_open() const noexcept
+    {
+        return m_fd >= 0;
+    }
+
+    size_t file_c::read(void* data, size_t sz, uint64_t pos) const
+    {
+        size_t total = 0;
+        while (total < sz)
+        {
+            const auto r = ::pread(m_fd, static_cast<char*>(data) + total, sz - total, static_cast<off_t>(pos + total));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
+                throw runtime_error("Read error.");
+            if (r == 0)
+                break;
+            total += static_cast<size_t>(r);
+        }
+        return total;
+    }
+
+    void file_c::write(const void* data, size_t sz, uint64_t pos)
+    {
+        size_t total = 0;
+        while (total < sz)
+        {
+            const auto r = ::pwrite(m_fd, static_cast<const char*>(data) + total, sz - total, static_cast<off_t>(pos + total));
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                throw runtime_error("Write error.");
+            total += static_cast<size_t>(r);
+        }
+    }
+
+    uint64_t file_c::size() const
+    {
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0)
+            throw runtime_error("Read error.");
+        return static_cast<uint64_t>(st.st_size);
+    }
+
+    void file_c::reserve(uint64_t end) noexcept
+    {
+        struct stat st;
+        if (m_fd < 0 || ::fstat(m_fd, &st) != 0 || end <= static_cast<uint64_t>(st.st_size))
+            return;
+        const auto cur = static_cast<off_t>(st.st_size);
+        const auto len = static_cast<off_t>(end) - cur;
+#if defined(FALLOC_FL_KEEP_SIZE)
+        //posix_fallocate would move the end of file, which the formats append at
+        if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, cur, len) == 0)
+            m_reserved = true;
+#elif defined(F_PREALLOCATE)
+        fstore_t fst = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, len, 0 };
+        if (::fcntl(m_fd, F_PREALLOCATE, &fst) != -1)
+            m_reserved = true;
+        else
+        {
+            fst.fst_flags = F_ALLOCATEALL;
+            m_reserved = ::fcntl(m_fd, F_PREALLOCATE, &fst) != -1;
+        }
+#else
+        boost::ignore_unused(cur, len);
+#endif
+    }
+
+    void file_c::trim() noexcept
+    {
+        //Truncating to the current size frees the blocks past it
+        struct stat st;
+        if (m_reserved && ::fstat(m_fd, &st) == 0)
+            boost::ignore_unused(::ftruncate(m_fd, st.st_size));
+        m_reserved = false;
+    }
+
+    void file_c::will_need(uint64_t pos, uint64_t len) const noexcept
+    {
+#ifdef POSIX_FADV_WILLNEED
+        ::posix_fadvise(m_fd, static_cast<off_t>(pos), static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+#else
+        boost::ignore_unused(pos, len);
+#endif
+    }
+
+    void file_c::sequential() const noexcept
+    {
+#ifdef POSIX_FADV_SEQUENTIAL
+        ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    bool clone_file(const fs::path& from, const fs::path& to) noexcept
+    {
+#ifdef FICLONE
+        const auto src = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src < 0)
+            return false;
+        const auto dst = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (dst < 0)
+        {
+            ::close(src);
+            return false;
+        }
+        const auto cloned = ::ioctl(dst, FICLONE, src) == 0;
+        ::close(dst);
+        ::close(src);
+        if (!cloned)
+            ::unlink(to.c_str());
+        return cloned;
+#else
+        boost::ignore_unused(from, to);
+        return false;
+#endif
+    }
+#endif
+
+    file_cursor_c::~file_cursor_c()
+    {
+        try
+        {
+            flush();
+        }
+        catch (const exception&)
+        {
+        }
+    }
+
+    uint8_t* file_cursor_c::buffer()
+    {
+        if (!m_buf)
+            m_buf.reset(static_cast<uint8_t*>(::operator new[](buffer_size, buffer_align)));
+        return m_buf.get();
+    }
+
+    size_t file_cursor_c::read(void* data, size_t sz)
+    {
+        flush();
+        auto out = static_cast<uint8_t*>(data);
+        size_t total = 0;
+        while (total < sz)
+        {
+            if (m_pos >= m_buf_pos && m_pos < m_buf_pos + m_buf_len)
+            {
+                const auto offs = static_cast<size_t>(m_pos - m_buf_pos);
+                const auto n = min(sz - total, m_buf_len - offs);
+                memcpy(out + total, buffer() + offs, n);
+                total += n;
+                m_pos += n;
+            }
+            else if (sz - total >= buffer_size)
+            {
+                //Large reads go straight to the caller
+                const auto n = m_file.read(out + total, sz - total, m_pos);
+                total += n;
+                m_pos += n;
+                break;
+            }
+            else
+            {
+                m_buf_pos = m_pos;
+                m_buf_len = m_file.read(buffer(), buffer_size, m_pos);
+                if (m_buf_len == 0)
+                    break;
+            }
+        }
+        return total;
+    }
+
+    size_t file_cursor_c::write(const void* data, size_t sz)
+    {
+        //Small writes are collected, anything that doesn't continue them goes out first
+        if (!m_dirty || m_pos != m_buf_pos + m_buf_len || m_buf_len + sz > buffer_size)
+        {
+            flush();
+            m_buf_len = 0;
+            m_buf_pos = m_pos;
+        }
+
+        if (sz >= buffer_size)
+        {
+            m_file.write(data, sz, m_pos);
+        }
+        else
+        {
+            memcpy(buffer() + m_buf_len, data, sz);
+            m_buf_len += sz;
+            m_dirty = true;
+        }
+        m_pos += sz;
+        return sz;
+    }
+
+    void file_cursor_c::seek(uint64_t pos)
+    {
+        flush();
+        m_pos = pos;
+    }
+
+    void file_cursor_c::flush()
+    {
+        if (m_dirty)
+        {
+            m_dirty = false;
+            m_file.write(buffer(), m_buf_len, m_buf_pos);
+            //What was just written is still valid to read from
+        }
+    }
+
+    uint64_t file_cursor_c::size() const
+    {
+        return max({ m_file.size(), m_pos, m_dirty ? m_buf_pos + m_buf_len : 0 });
+    }
+}
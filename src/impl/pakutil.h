@@ -2,6 +2,22 @@
 #define PAKUTIL_H_INCLUDED
 #include <ranges>
 #include <fstream>
+#include <string_view>
+#include <filesystem>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/locale.hpp>
+#include "../pack.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PAKUTIL_SSE2
+#endif
 
 namespace pak_impl
 {
@@ -39,6 +55,304 @@ namespace pak_impl
             (auto v) { return std::ranges::find(fb, static_cast<int>(v)) != end(fb); }) == end(str);
     }
 
+    //Widens str if it is all ASCII, 16 bytes at a time where SSE2 is available
+    inline std::optional<std::wstring> widen_ascii(std::string_view str)
+    {
+        std::wstring out(str.size(), L'\0');
+        size_t i = 0;
+#ifdef PAKUTIL_SSE2
+        const auto zero = _mm_setzero_si128();
+        for (; i + 16 <= str.size(); i += 16)
+        {
+            const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str.data() + i));
+            if (_mm_movemask_epi8(v) != 0)
+                return {};
+
+            const auto lo = _mm_unpacklo_epi8(v, zero);
+            const auto hi = _mm_unpackhi_epi8(v, zero);
+            auto dst = reinterpret_cast<__m128i*>(out.data() + i);
+            if constexpr (sizeof(wchar_t) == 2)
+            {
+                _mm_storeu_si128(dst, lo);
+                _mm_storeu_si128(dst + 1, hi);
+            }
+            else
+            {
+                _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+            }
+        }
+#endif
+        //Eight bytes at a time for the check, the compiler vectorizes the copy
+        for (; i + 8 <= str.size(); i += 8)
+        {
+            std::uint64_t w;
+            std::memcpy(&w, str.data() + i, sizeof(w));
+            if (w & 0x8080808080808080ULL)
+                return {};
+            std::copy_n(reinterpret_cast<const unsigned char*>(str.data() + i), 8, out.data() + i);
+        }
+        for (; i < str.size(); ++i)
+        {
+            const auto c = static_cast<unsigned char>(str[i]);
+            if (c & 0x80u)
+                return {};
+            out[i] = c;
+        }
+        return out;
+    }
+
+    inline std::wstring from_ibm437(std::string_view str)
+    {
+        if (auto wide = widen_ascii(str))
+            return std::move(*wide);
+        return boost::locale::conv::to_utf<wchar_t>(std::string{ str }, "IBM437");
+    }
+
+    inline std::wstring from_text(std::string_view str)
+    {
+        namespace conv = boost::locale::conv;
+        //Let's hope it's ascii
+        if (auto wide = widen_ascii(str))
+            return std::move(*wide);
+
+        try
+        {
+            //Maybe someone stored it as utf-8?
+            return conv::utf_to_utf<wchar_t, char>(str.data(), str.data() + str.size(), conv::stop);
+        }
+        catch (const conv::conversion_error& )
+        {
+        }
+        //It must be some legacy encoding and we can't tell which so we guess Win1252
+        return conv::to_utf<wchar_t>(std::string{ str }, "Windows-1252");
+    }
+
+    //File accessed with positional reads and writes. There is no shared file pointer,
+    //so any number of threads can read from the same file_c at once.
+    class file_c
+    {
+    public:
+        enum class access { read, read_write, create };
+
+        file_c() = default;
+        file_c(const file_c&) = delete;
+        file_c& operator=(const file_c&) = delete;
+        ~file_c()
+        {
+            close();
+        }
+
+        bool open(const std::filesystem::path& path, access a);
+        void close() noexcept;
+        bool is_open() const noexcept;
+
+        //Both return less than sz only at the end of the file, errors throw
+        size_t read(void* data, size_t sz, std::uint64_t pos) const;
+        void write(const void* data, size_t sz, std::uint64_t pos);
+
+        std::uint64_t size() const;
+
+        //Allocates disk space up to end without changing the size, so the file can grow without
+        //fragmenting. Whatever isn't written is given back on close. Only a hint, it can fail quietly.
+        void reserve(std::uint64_t end) noexcept;
+
+        //Read-ahead hints, they do nothing where the system doesn't support them
+        void will_need(std::uint64_t pos, std::uint64_t len) const noexcept;
+        void sequential() const noexcept;
+    private:
+#ifdef _WIN32
+        void* m_handle = nullptr;
+#else
+        int m_fd = -1;
+#endif
+        bool m_reserved = false;
+
+        void trim() noexcept;
+    };
+
+    //Creates to as a copy of from that shares its data on disk (reflink), on file systems that can.
+    //false if it can't, to must not exist.
+    bool clone_file(const std::filesystem::path& from, const std::filesystem::path& to) noexcept;
+
+    //Buffered stream position in a file_c for code that wants to read and write
+    //like a stream, such as minizip. Every cursor has its own position and buffer.
+    class file_cursor_c
+    {
+    public:
+        explicit file_cursor_c(file_c& file) : m_file(file)
+        {
+        }
+        file_cursor_c(const file_cursor_c&) = delete;
+        file_cursor_c& operator=(const file_cursor_c&) = delete;
+        ~file_cursor_c();
+
+        size_t read(void* data, size_t sz);
+        size_t write(const void* data, size_t sz);
+        void seek(std::uint64_t pos);
+        std::uint64_t tell() const noexcept
+        {
+            return m_pos;
+        }
+        void flush();
+        std::uint64_t size() const;
+    private:
+        static constexpr size_t buffer_size = 0x40000;
+        static constexpr std::align_val_t buffer_align{ 4096 };
+
+        struct aligned_delete
+        {
+            void operator()(std::uint8_t* p) const noexcept
+            {
+                ::operator delete[](p, buffer_align);
+            }
+        };
+
+        file_c& m_file;
+        std::uint64_t m_pos = 0;
+        std::unique_ptr<std::uint8_t[], aligned_delete> m_buf;
+        std::uint64_t m_buf_pos = 0;    //File position of the buffer
+        size_t m_buf_len = 0;           //Bytes read into the buffer or waiting to be written
+        bool m_dirty = false;
+
+        std::uint8_t* buffer();
+    };
+
+    //Reads a byte range of a shared file_c. Positional reads don't move anything in the
+    //file, so any number of these can read at the same time.
+    class range_reader_c : public pak::entry_reader_i
+    {
+    public:
+        range_reader_c(const file_c& file, std::uint64_t pos, std::uint64_t len) noexcept
+            : m_file(file), m_start(pos), m_pos(pos), m_end(pos + len)
+        {
+        }
+
+        std::uint64_t tell() const noexcept
+        {
+            return m_pos - m_start;
+        }
+
+        bool seek(std::uint64_t pos) override
+        {
+            if (pos > m_end - m_start)
+                return false;
+            m_pos = m_start + pos;
+            return true;
+        }
+
+        size_t read(std::uint8_t* data, size_t sz) override
+        {
+            const auto len = static_cast<size_t>(std::min<std::uint64_t>(sz, m_end - m_pos));
+            const auto r = len > 0u ? m_file.read(data, len, m_pos) : size_t(0);
+            m_pos += r;
+            return r;
+        }
+    private:
+        const file_c& m_file;
+        std::uint64_t m_start, m_pos, m_end;
+    };
+
+    //Reader with a file of its own, for packs where entries are files
+    class file_reader_c : public pak::entry_reader_i
+    {
+    public:
+        explicit file_reader_c(const std::filesystem::path& path)
+        {
+            if (!m_file.open(path, file_c::access::read))
+                throw std::runtime_error("Could not open file.");
+            m_file.sequential();
+        }
+
+        size_t read(std::uint8_t* data, size_t sz) override
+        {
+            const auto r = m_file.read(data, sz, m_pos);
+            m_pos += r;
+            return r;
+        }
+
+        bool seek(std::uint64_t pos) override
+        {
+            if (pos > m_file.size())
+                return false;
+            m_pos = pos;
+            return true;
+        }
+    private:
+        file_c m_file;
+        std::uint64_t m_pos = 0;
+    };
+
+    //Entry name as stored in a pack. ASCII is widened right away since that is cheap,
+    //anything else is decoded when the name is first asked for. Opening a pack doesn't ask,
+    //the name index is built on the first lookup (see pack_i::find_entry), so packs that are
+    //only read in stored order or by index never decode their names.
+    class lazy_name_c
+    {
+    public:
+        using decode_func_t = std::wstring(*)(std::string_view);
+
+        lazy_name_c() = default;
+        lazy_name_c(std::wstring name) noexcept : m_name(std::move(name))
+        {
+        }
+        lazy_name_c(std::string_view raw, decode_func_t decode)
+        {
+            if (auto wide = widen_ascii(raw))
+            {
+                m_name = std::move(*wide);
+            }
+            else
+            {
+                m_raw = raw;
+                m_decode = decode;
+                m_pending = true;
+            }
+        }
+        lazy_name_c(const lazy_name_c& other) : m_name(other.get())
+        {
+        }
+        lazy_name_c(lazy_name_c&& other) noexcept
+            : m_name(std::move(other.m_name)), m_raw(std::move(other.m_raw)), m_decode(other.m_decode), m_pending(other.m_pending.load())
+        {
+        }
+        lazy_name_c& operator=(lazy_name_c other) noexcept
+        {
+            m_name = std::move(other.m_name);
+            m_raw = std::move(other.m_raw);
+            m_decode = other.m_decode;
+            m_pending = other.m_pending.load();
+            return *this;
+        }
+
+        const std::wstring& get() const
+        {
+            if (m_pending.load(std::memory_order_acquire))
+            {
+                //Names are decoded rarely enough that one lock for all of them will do
+                static std::mutex decode_lock;
+                std::lock_guard lock(decode_lock);
+                if (m_pending.load(std::memory_order_relaxed))
+                {
+                    m_name = m_decode(m_raw);
+                    m_pending.store(false, std::memory_order_release);
+                }
+            }
+            return m_name;
+        }
+        operator const std::wstring&() const
+        {
+            return get();
+        }
+    private:
+        mutable std::wstring m_name;
+        std::string m_raw;
+        decode_func_t m_decode = nullptr;
+        mutable std::atomic<bool> m_pending = false;
+    };
+
     inline void write_file(output_stream auto& file, const void* data, std::streamsize sz)
     {
         file.write(reinterpret_cast<const char*>(data), sz);
@@ -1,17 +1,202 @@
 #include "pk3_pack.h"
+#include "scan_pack.h"
 #include "pakutil.h"
+#include "ziputil.h"
+#include "../scheduler.h"
 #include <boost/locale.hpp>
 #include <boost/core/ignore_unused.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <array>
 #include <tuple>
 #include <ranges>
+#include <mutex>
+#include <span>
+#include <format>
 
 using namespace std;
 namespace fs = std::filesystem;
 
 namespace
 {
+    //Raw deflate, as stored in a zip, at the highest level with the given strategy and memory level
+    vector<uint8_t> deflate_raw(span<const uint8_t> data, int strategy, int mem_level)
+    {
+        z_stream zs{};
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, mem_level, strategy) != Z_OK)
+            throw runtime_error("Could not initialize deflate.");
+
+        vector<uint8_t> out;
+        array<uint8_t, 0x10000> buf;
+        size_t pos = 0;
+        auto r = Z_OK;
+        while (r != Z_STREAM_END)
+        {
+            //avail_in is 32 bits, so large entries go in one part at a time
+            const auto len = min<size_t>(data.size() - pos, 0x40000000u);
+            zs.next_in = const_cast<Bytef*>(data.data() + pos);
+            zs.avail_in = static_cast<uInt>(len);
+            pos += len;
+            const auto flush = pos == data.size() ? Z_FINISH : Z_NO_FLUSH;
+            do
+            {
+                zs.next_out = buf.data();
+                zs.avail_out = static_cast<uInt>(buf.size());
+                r = deflate(&zs, flush);
+                out.insert(end(out), buf.data(), buf.data() + (buf.size() - zs.avail_out));
+            } while (zs.avail_out == 0u && r != Z_STREAM_END);
+        }
+        deflateEnd(&zs);
+        return out;
+    }
+
+    //Inflates an entry straight from the file, so it doesn't need the unzFile and its current entry.
+    //The index is only asked for on the first seek, entries that are read through don't get one.
+    class inflate_reader_c : public pak::entry_reader_i
+    {
+    public:
+        using index_func_t = function<shared_ptr<pak_impl::inflate_index_t>()>;
+
+        inflate_reader_c(const pak_impl::file_c& file, uint64_t pos, uint64_t csize, uint64_t len, uint32_t crc, index_func_t index_func)
+            : m_in(file, pos, csize), m_len(len), m_crc(crc), m_index_func(std::move(index_func))
+        {
+            if (inflateInit2(&m_zs, -MAX_WBITS) != Z_OK)
+                throw runtime_error("Could not initialize inflate.");
+        }
+        ~inflate_reader_c() override
+        {
+            inflateEnd(&m_zs);
+        }
+
+        size_t read(uint8_t* data, size_t sz) override
+        {
+            sz = static_cast<size_t>(min<uint64_t>(sz, m_len - m_out));
+            const auto total = inflate_to(data, sz, Z_NO_FLUSH);
+            if (total < sz)
+                throw runtime_error("Compressed data is truncated.");
+
+            //The CRC covers the whole entry, so it can't be checked once the reader has seeked
+            if (m_check_crc)
+            {
+                m_crc_got = crc32(m_crc_got, data, static_cast<uInt>(total));
+                if (m_out == m_len && m_crc_got != m_crc)
+                    throw runtime_error("CRC error.");
+            }
+            return total;
+        }
+
+        bool seek(uint64_t pos) override
+        {
+            if (pos > m_len)
+                return false;
+            if (!m_index)
+                m_index = m_index_func();
+            m_check_crc = false;
+
+            //Starts over at the closest point before pos, unless the reader is closer already
+            optional<pak_impl::inflate_index_t::point_t> start;
+            {
+                lock_guard lock(m_index->lock);
+                const auto& points = m_index->points;
+                if (auto p = ranges::upper_bound(points, pos, {}, &pak_impl::inflate_index_t::point_t::out); p != begin(points))
+                {
+                    if (prev(p)->out > m_out || pos < m_out)
+                        start = *prev(p);
+                }
+            }
+            if (start)
+                restart(*start);
+            else if (pos < m_out)
+                restart({});
+
+            //Inflates up to pos a block at a time, leaving points for the next seek
+            vector<uint8_t> skip(0x10000);
+            while (m_out < pos)
+            {
+                if (m_ended)
+                    throw runtime_error("Compressed data is truncated.");
+                inflate_to(skip.data(), static_cast<size_t>(min<uint64_t>(skip.size(), pos - m_out)), Z_BLOCK);
+                if ((m_zs.data_type & 128) && !(m_zs.data_type & 64))
+                    add_point();
+            }
+            return true;
+        }
+    private:
+        pak_impl::range_reader_c m_in;
+        z_stream m_zs{};
+        array<uint8_t, 0x10000> m_buf;
+        uint64_t m_len;
+        uint64_t m_out = 0;
+        uint32_t m_crc;
+        uLong m_crc_got = crc32(0, nullptr, 0);
+        bool m_check_crc = true;
+        bool m_ended = false;
+        index_func_t m_index_func;
+        shared_ptr<pak_impl::inflate_index_t> m_index;
+
+        //With Z_BLOCK this returns at the end of every deflate block, maybe before sz
+        size_t inflate_to(uint8_t* data, size_t sz, int flush)
+        {
+            size_t total = 0;
+            while (total < sz)
+            {
+                if (m_zs.avail_in == 0u)
+                {
+                    m_zs.next_in = m_buf.data();
+                    m_zs.avail_in = static_cast<uInt>(m_in.read(m_buf.data(), m_buf.size()));
+                    if (m_zs.avail_in == 0u)
+                        throw runtime_error("Compressed data is truncated.");
+                }
+                const auto len = min<size_t>(sz - total, 0x40000000u);
+                m_zs.next_out = data + total;
+                m_zs.avail_out = static_cast<uInt>(len);
+                const auto r = inflate(&m_zs, flush);
+                total += len - m_zs.avail_out;
+                if (r == Z_STREAM_END)
+                {
+                    m_ended = true;
+                    break;
+                }
+                else if (r != Z_OK)
+                    throw runtime_error("Compressed data is corrupt.");
+                else if (flush == Z_BLOCK && (m_zs.data_type & 128))
+                    break;
+            }
+            m_out += total;
+            return total;
+        }
+
+        void restart(const pak_impl::inflate_index_t::point_t& point)
+        {
+            inflateReset(&m_zs);
+            m_zs.avail_in = 0;
+            m_ended = false;
+            m_in.seek(point.in - (point.bits ? 1u : 0u));
+            if (point.bits)
+            {
+                uint8_t prev_byte = 0;
+                m_in.read(&prev_byte, 1);
+                inflatePrime(&m_zs, point.bits, prev_byte >> (8 - point.bits));
+            }
+            if (!point.window.empty())
+                inflateSetDictionary(&m_zs, point.window.data(), static_cast<uInt>(point.window.size()));
+            m_out = point.out;
+        }
+
+        void add_point()
+        {
+            lock_guard lock(m_index->lock);
+            auto& points = m_index->points;
+            if (m_out < (points.empty() ? 0u : points.back().out) + pak_impl::inflate_index_t::span)
+                return;
+
+            pak_impl::inflate_index_t::point_t point{ m_out, m_in.tell() - m_zs.avail_in, m_zs.data_type & 7, vector<uint8_t>(32768) };
+            uInt len = 0;
+            inflateGetDictionary(&m_zs, point.window.data(), &len);
+            point.window.resize(len);
+            points.push_back(std::move(point));
+        }
+    };
+
     optional<pak::pack_i::filetime_t> convert_time(const tm_unz& ztime)
     {
         using namespace boost::posix_time;
@@ -25,50 +210,39 @@ namespace
             hours(ztime.tm_hour) + minutes(ztime.tm_min) + seconds(ztime.tm_sec)
         };
     }
-
-    auto compression_level(const string& name) noexcept
-    {
-        auto nmv = name | views::reverse;
-        if (auto r = ranges::find(nmv, '.'); r != end(nmv))
-        {
-            constexpr array uncomp_ext = { "jpg"sv, "jpeg"sv, "png"sv, "mp3"sv, "ogg"sv, "opus"sv, "flac"sv };
-            //Skip compression of already compressed files
-            const auto ext = string_view{ r.base(), end(name) };
-            if (ranges::find(uncomp_ext, ext) != end(uncomp_ext)) 
-                return make_tuple(0, Z_NO_COMPRESSION);
-        }
-        return make_tuple(Z_DEFLATED, Z_BEST_COMPRESSION);
-    }
 }
 
 namespace pak_impl
 {
+    //Every handle minizip opens gets a cursor of its own over the shared file
     //static
     ZCALLBACK ZPOS64_T pk3_pack_c::ztell(void* opaque, void* stream)
     {
-        auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-        return static_cast<ZPOS64_T>(stream == &p->m_zin ? p->m_pakfile.tellg() : p->m_pakfile.tellp()); 
+        boost::ignore_unused(opaque);
+        return static_cast<file_cursor_c*>(stream)->tell();
     }
     //static
     ZCALLBACK long pk3_pack_c::zseek(void* opaque, void* stream, ZPOS64_T offset, int origin)
     {
-        constexpr array whence =
+        boost::ignore_unused(opaque);
+        auto cur = static_cast<file_cursor_c*>(stream);
+        try
         {
-            tuple{ ZLIB_FILEFUNC_SEEK_SET, ios::beg },
-            tuple{ ZLIB_FILEFUNC_SEEK_CUR, ios::cur },
-            tuple{ ZLIB_FILEFUNC_SEEK_END, ios::end }
-        };
-        
-        if (auto r = ranges::find(whence | views::keys, origin).base(); r != end(whence))
+            switch (origin)
+            {
+            case ZLIB_FILEFUNC_SEEK_SET:
+                cur->seek(offset);
+                return 0;
+            case ZLIB_FILEFUNC_SEEK_CUR:
+                cur->seek(cur->tell() + offset);
+                return 0;
+            case ZLIB_FILEFUNC_SEEK_END:
+                cur->seek(cur->size() + offset);
+                return 0;
+            }
+        }
+        catch (const exception&)
         {
-            const auto pos = static_cast<streamoff>(offset);
-            auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-            if (stream == &p->m_zin)
-                p->m_pakfile.seekg(pos, get<1>(*r));
-            else
-                p->m_pakfile.seekp(pos, get<1>(*r));
-            
-            return p->m_pakfile.fail() ? -1 : 0;
         }
         return -1;
     }
@@ -78,80 +252,85 @@ namespace pak_impl
         const auto path = fs::path(reinterpret_cast<const wchar_t*>(filename));
         auto p = reinterpret_cast<pk3_pack_c*>(opaque);
 
-        auto m = ios::binary;
-        if (mode & ZLIB_FILEFUNC_MODE_CREATE)
-            m |= ios::trunc;
-        if ((mode & ZLIB_FILEFUNC_MODE_EXISTING) || p->m_opened_write)
-            m |= ios::out;
-        if (mode & ZLIB_FILEFUNC_MODE_READ)
-            m |= ios::in;
-
         if (!p->m_pakfile.is_open())
-        {            
-            p->m_pakfile.open(path, m);
-            if (!p->m_pakfile.is_open())
-                return nullptr;
-        }
-        else
         {
-            if (mode & ios::in)
-                p->m_pakfile.seekg(0, ios::beg);
-            if (mode & ios::out)
-                p->m_pakfile.seekp(0, ios::beg);
+            auto a = file_c::access::read;
+            if (mode & ZLIB_FILEFUNC_MODE_CREATE)
+                a = file_c::access::create;
+            else if ((mode & ZLIB_FILEFUNC_MODE_EXISTING) || p->m_opened_write)
+                a = file_c::access::read_write;
+
+            if (!p->m_pakfile.open(path, a))
+                return nullptr;
         }
-        return (mode & (ZLIB_FILEFUNC_MODE_EXISTING | ZLIB_FILEFUNC_MODE_CREATE)) ? &p->m_zout : &p->m_zin;
+        auto cur = new file_cursor_c(p->m_pakfile);
+        //Only the zip handle writes, its position is where the next local header goes
+        if (mode & ZLIB_FILEFUNC_MODE_WRITE)
+            p->m_out_cursor = cur;
+        return cur;
     }
     //static
     ZCALLBACK uLong pk3_pack_c::zread(void* opaque, void* stream, void* buf, uLong sz)
     {
-        boost::ignore_unused(stream);
-
-        auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-        p->m_pakfile.read(reinterpret_cast<char*>(buf), static_cast<streamsize>(sz));
-        if (p->m_pakfile.fail())
-            return 0;
-        return static_cast<uLong>(p->m_pakfile.gcount());
+        boost::ignore_unused(opaque);
+        try
+        {
+            return static_cast<uLong>(static_cast<file_cursor_c*>(stream)->read(buf, sz));
+        }
+        catch (const exception&)
+        {
+        }
+        return 0;
     }
     //static
     ZCALLBACK uLong pk3_pack_c::zwrite(void* opaque, void* stream, const void* buf, uLong sz)
     {
-        boost::ignore_unused(stream);
-        
-        auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-        const auto pos = p->m_pakfile.tellp();
-        p->m_pakfile.write(reinterpret_cast<const char*>(buf), static_cast<streamsize>(sz));
-        if (p->m_pakfile.fail())
-            return 0;
-        
-        return static_cast<uLong>(p->m_pakfile.tellp() - pos);
+        boost::ignore_unused(opaque);
+        try
+        {
+            return static_cast<uLong>(static_cast<file_cursor_c*>(stream)->write(buf, sz));
+        }
+        catch (const exception&)
+        {
+        }
+        return 0;
     }
     //static
     ZCALLBACK int pk3_pack_c::zclose(void* opaque, void* stream)
     {
-        boost::ignore_unused(stream);
-
-        auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-        if (p->m_zin == nullptr && p->m_zout == nullptr)
-            p->m_pakfile.close();
+        boost::ignore_unused(opaque);
+        auto cur = static_cast<file_cursor_c*>(stream);
+        try
+        {
+            cur->flush();
+        }
+        catch (const exception&)
+        {
+            delete cur;
+            return Z_ERRNO;
+        }
+        delete cur;
         return 0;
     }
     //static
     ZCALLBACK int pk3_pack_c::zerror(void* opaque, void* stream)
     {
-        boost::ignore_unused(stream);
-
-        auto p = reinterpret_cast<pk3_pack_c*>(opaque);
-        return p->m_pakfile.fail() ? Z_ERRNO : 0;
+        //Errors are returned from every call instead
+        boost::ignore_unused(opaque, stream);
+        return 0;
     }
 
     bool pk3_pack_c::open_pack_impl(const std::filesystem::path& path, bool w)
     {
         m_files.clear();
+        if (m_zin)
+            unzClose(m_zin);
         m_zin = unzOpen2_64(path.wstring().c_str(), &m_funcdef);
         if (m_zin == nullptr)
             return false;
         
         vector<char> filename(1 + 0xFFFF);
+        vector<uint8_t> extra(0xFFFF);
         auto cancelret = [this]()
         {
             unzClose(m_zin);
@@ -162,31 +341,38 @@ namespace pak_impl
         for (auto r = unzGoToFirstFile(m_zin); ; r = unzGoToNextFile(m_zin))
         {
             if (r == UNZ_END_OF_LIST_OF_FILE)
-                return true;
+                break;
             else if (r != UNZ_OK)
                 return cancelret();
             
             unz_file_info64 info;
-            if (unzGetCurrentFileInfo64(m_zin, &info, filename.data(), static_cast<uLong>(filename.size()), nullptr, 0u, nullptr, 0u) != UNZ_OK)
+            if (unzGetCurrentFileInfo64(m_zin, &info, filename.data(), static_cast<uLong>(filename.size()),
+                extra.data(), static_cast<uLong>(extra.size()), nullptr, 0u) != UNZ_OK)
                 return cancelret();
 
-            m_files.emplace_back();
-            m_files.back().len = info.uncompressed_size;
-
-            m_files.back().name = (info.flag & (1u << 11))
-                ? boost::locale::conv::utf_to_utf<wchar_t, char>(filename.data())
-                : boost::locale::conv::to_utf<wchar_t>(filename.data(), "IBM437");
-            
-            if (m_files.back().name.ends_with('/'))
-            {
-                m_files.pop_back();
-            }
-            else
+            //Folders are skipped, they are created along with the files in them
+            const auto rawname = string_view{ filename.data(), min<size_t>(info.size_filename, filename.size() - 1) };
+            if (!rawname.ends_with('/'))
             {
+                m_files.emplace_back();
+                m_files.back().len = info.uncompressed_size;
+                m_files.back().csize = info.compressed_size;
+                m_files.back().crc = static_cast<uint32_t>(info.crc);
+                m_files.back().method = static_cast<uint16_t>(info.compression_method);
+                m_files.back().name = (info.flag & zip_flag_utf8)
+                    ? lazy_name_c{ rawname, [](string_view v) { return boost::locale::conv::utf_to_utf<wchar_t, char>(v.data(), v.data() + v.size()); } }
+                    : lazy_name_c{ rawname, &from_ibm437 };
+
                 m_files.back().ts = convert_time(info.tmu_date);
 
                 if (unzGetFilePos64(m_zin, &m_files.back().pos) != UNZ_OK)
                     return cancelret();
+
+                //minizip doesn't tell where the data is, so it's taken from the central directory header
+                array<uint8_t, 42> central;
+                if (m_pakfile.read(central.data(), central.size(), m_files.back().pos.pos_in_zip_directory + sizeof(uint32_t)) != central.size())
+                    return cancelret();
+                m_files.back().offset = zip_local_offset(central, span{ extra }.first(info.size_file_extra));
             }
         }
 
@@ -194,7 +380,10 @@ namespace pak_impl
         {
             m_zout = zipOpen2_64(path.wstring().c_str(), APPEND_STATUS_ADDINZIP, nullptr, &m_funcdef);
             if (m_zout == nullptr)
+            {
+                m_out_cursor = nullptr;
                 return cancelret();
+            }
         }
         return true;
     }
@@ -202,12 +391,16 @@ namespace pak_impl
     bool pk3_pack_c::create_pack_impl(const fs::path& path)
     {
         m_zout = zipOpen2_64(path.wstring().c_str(), APPEND_STATUS_CREATE, nullptr, &m_funcdef);
-        
+        if (m_zout == nullptr)
+            m_out_cursor = nullptr;
+
         return m_zout != nullptr;
     }
 
     bool pk3_pack_c::open_entry_impl(size_t idx)
     {
+        //Local header is small, but the name and extra field can be up to 64 kB each
+        m_pakfile.will_need(m_files[idx].offset, m_files[idx].csize + 0x100);
         return m_zin
             && unzGoToFilePos64(m_zin, &m_files[idx].pos) == UNZ_OK
             && unzOpenCurrentFile(m_zin) == Z_OK;
@@ -218,14 +411,35 @@ namespace pak_impl
         return m_files[idx].ts;
     }
 
-    optional<size_t> pk3_pack_c::new_entry_impl(const wstring& name, const std::optional<filetime_t>& ft)
+    pak::pack_i::entry_info_t pk3_pack_c::entry_info_impl(size_t idx) const
+    {
+        const auto& e = m_files[idx];
+        entry_info_t info;
+        info.size = e.len;
+        info.stored_size = e.csize;
+        info.method = e.method;
+        info.crc = e.crc;
+        info.offset = e.offset;
+        return info;
+    }
+
+    uint64_t pk3_pack_c::space_needed_impl(const wstring& name, uint64_t size) const
+    {
+        const auto padding = m_write_opts.align > 1u ? 6u + m_write_opts.align - 1u : 0u;
+        return zip_entry_space(boost::locale::conv::utf_to_utf<char>(name).length(), size) + padding;
+    }
+
+    uint64_t pk3_pack_c::empty_size_impl() const
+    {
+        return zip_end_space;
+    }
+
+    //static
+    zip_fileinfo pk3_pack_c::zip_info(const string& filename, const std::optional<filetime_t>& ft)
     {
         static constexpr auto utf8_filename_flag = 1u << 11;
-        const auto filename = boost::locale::conv::utf_to_utf<char, wchar_t>(name);
-        
         const auto ts = ft.has_value() ? *ft : boost::posix_time::second_clock::local_time();
-        
-        const zip_fileinfo zfi
+        return
         {
             .tmz_date =
             {
@@ -238,19 +452,92 @@ namespace pak_impl
             },
             .dosDate = 0u, .internal_fa = 0u, .external_fa = is_ascii(filename) ? 0u : utf8_filename_flag
         };
-        
+    }
+
+    optional<size_t> pk3_pack_c::new_entry_impl(const wstring& name, const std::optional<filetime_t>& ft)
+    {
+        const auto filename = boost::locale::conv::utf_to_utf<char, wchar_t>(name);
+        const auto zfi = zip_info(filename, ft);
         const auto [method, level] = compression_level(filename);
-        if (zipOpenNewFileInZip64(m_zout, filename.c_str(), &zfi, nullptr, 0u,
-            nullptr, 0u, nullptr, method, level, 0) == ZIP_OK)
+        if (m_zout == nullptr)
+            return {};
+
+        if (m_write_opts.optimize && method == Z_DEFLATED)
+            m_pending = pending_t{ .filename = filename, .zfi = zfi, .data = {} };
+        else if (!open_zip_entry(filename, zfi, method, level, false))
+            return {};
+
+        m_files.emplace_back(entry_t{ .crc = {}, .method = static_cast<uint16_t>(method), .name = name, .ts = {} });
+        return m_files.size() -1;
+    }
+
+    bool pk3_pack_c::open_zip_entry(const string& filename, const zip_fileinfo& zfi, int method, int level, bool raw)
+    {
+        //Stored data can be memory mapped straight from the pack if it is aligned. minizip writes
+        //the local header at once, with a zip64 block of 20 bytes if it starts past 4 GB.
+        vector<uint8_t> extra;
+        m_entry_start = m_out_cursor != nullptr ? m_out_cursor->tell() : 0u;
+        if (method == 0 && m_write_opts.align > 1u && m_out_cursor != nullptr)
         {
-            m_files.emplace_back(entry_t{ .name = name, .ts = {} });
-            return m_files.size() -1;
+            const auto header_pos = m_entry_start;
+            const auto zip64_len = header_pos >= 0xFFFFFFFFu ? 20u : 0u;
+            extra = zip_align_extra(header_pos + 30u + filename.size() + zip64_len, m_write_opts.align);
         }
-        return {};
+
+        return zipOpenNewFileInZip2_64(m_zout, filename.c_str(), &zfi, extra.empty() ? nullptr : extra.data(), static_cast<uInt>(extra.size()),
+            nullptr, 0u, nullptr, method, level, raw ? 1 : 0, 0) == ZIP_OK;
+    }
+
+    void pk3_pack_c::reserve_entry_impl(uint64_t size)
+    {
+        if (m_pending.has_value() && size <= numeric_limits<size_t>::max())
+            m_pending->data.reserve(static_cast<size_t>(size));
+    }
+
+    bool pk3_pack_c::write_optimized(pending_t& pending)
+    {
+        //Settings that are tried, different data compresses best with different ones.
+        //The window is always the largest, a smaller one never makes the output smaller.
+        constexpr array settings =
+        {
+            tuple{ Z_DEFAULT_STRATEGY, 8 }, tuple{ Z_DEFAULT_STRATEGY, 9 },
+            tuple{ Z_FILTERED, 8 }, tuple{ Z_FILTERED, 9 },
+            tuple{ Z_RLE, 9 }, tuple{ Z_HUFFMAN_ONLY, 9 }
+        };
+        const auto data = span<const uint8_t>{ pending.data };
+        vector<vector<uint8_t>> results(settings.size());
+        pak::task_group_c tasks;
+        for (size_t i = 0; i < settings.size(); ++i)
+            tasks.run([&, i]() { results[i] = deflate_raw(data, get<0>(settings[i]), get<1>(settings[i])); });
+        tasks.wait();
+
+        //Data that deflate can't make smaller is stored instead
+        const auto& best = *ranges::min_element(results, {}, &vector<uint8_t>::size);
+        const auto stored = best.size() >= data.size();
+        const auto out = stored ? data : span<const uint8_t>{ best };
+        if (!open_zip_entry(pending.filename, pending.zfi, stored ? 0 : Z_DEFLATED, Z_BEST_COMPRESSION, true))
+            return false;
+
+        constexpr size_t chunk = 0x10000000;
+        for (size_t pos = 0; pos < out.size(); pos += chunk)
+        {
+            const auto len = static_cast<unsigned>(min(chunk, out.size() - pos));
+            if (zipWriteInFileInZip(m_zout, out.data() + pos, len) != ZIP_OK)
+                return false;
+        }
+
+        uLong crc = crc32(0L, Z_NULL, 0);
+        for (size_t pos = 0; pos < data.size(); pos += chunk)
+            crc = crc32(crc, data.data() + pos, static_cast<uInt>(min(chunk, data.size() - pos)));
+
+        m_files.back().method = stored ? 0u : static_cast<uint16_t>(Z_DEFLATED);
+        return zipCloseFileInZipRaw64(m_zout, data.size(), crc) == ZIP_OK;
     }
 
     size_t pk3_pack_c::read_entry_impl(std::uint8_t* buf, size_t sz)
     {
+        if (m_seek_reader)
+            return m_seek_reader->read(buf, sz);
         if (m_zin == nullptr || sz > numeric_limits<int>::max())
             return 0;
 
@@ -266,14 +553,29 @@ namespace pak_impl
         if (m_zout == nullptr || size > numeric_limits<unsigned>::max())
             return 0;
 
+        if (m_pending.has_value())
+        {
+            m_pending->data.insert(end(m_pending->data), buf, buf + size);
+            return size;
+        }
+
         if (zipWriteInFileInZip(m_zout, buf, static_cast<unsigned>(size)) == ZIP_OK)
             return size;
         
         return 0;
     }
 
+    bool pk3_pack_c::seek_entry_impl(uint64_t pos)
+    {
+        //Reading goes on from the reader, the entry open in minizip is left alone
+        if (!m_seek_reader)
+            m_seek_reader = open_reader_impl(*m_read_idx);
+        return m_seek_reader && m_seek_reader->seek(pos);
+    }
+
     void pk3_pack_c::close_read_impl()
     {
+        m_seek_reader.reset();
         if (m_zin)
             unzCloseCurrentFile(m_zin);
     }
@@ -282,14 +584,204 @@ namespace pak_impl
     {
         if (m_zout)
         {
-            zipCloseFileInZip(m_zout);
-            if (m_zin)
+            if (m_pending.has_value())
+            {
+                auto pending = std::move(*m_pending);
+                m_pending.reset();
+                if (!write_optimized(pending))
+                    throw runtime_error("Write failed.");
+            }
+            else
+                zipCloseFileInZip(m_zout);
+
+            writing_done();
+        }
+    }
+
+    void pk3_pack_c::writing_done()
+    {
+        //minizip writes over the central directory the reader has, so entries can't
+        //be read any more until the pack is opened again
+        if (m_zin)
+        {
+            close_read_impl();
+            unzClose(m_zin);
+            m_zin = nullptr;
+        }
+    }
+
+    optional<size_t> pk3_pack_c::copy_stored_impl(const pak::pack_i& src, size_t idx, const wstring& name, const optional<filetime_t>& ft)
+    {
+        //The local header is made again for the new name and time, only the data is copied
+        const auto zsrc = dynamic_cast<const pk3_pack_c*>(&src);
+        if (zsrc == nullptr || m_zout == nullptr || idx >= zsrc->m_files.size())
+            return {};
+        const auto& e = zsrc->m_files[idx];
+        if (!zsrc->m_zin || !e.crc || (e.method != 0u && e.method != Z_DEFLATED))
+            return {};
+        const auto pos = zsrc->data_pos(e);
+        if (!pos)
+            return {};
+
+        const auto filename = boost::locale::conv::utf_to_utf<char, wchar_t>(name);
+        if (!open_zip_entry(filename, zip_info(filename, ft), e.method, Z_BEST_COMPRESSION, true))
+            return {};
+
+        zsrc->m_pakfile.will_need(*pos, e.csize);
+        range_reader_c in(zsrc->m_pakfile, *pos, e.csize);
+        vector<uint8_t> buf(0x40000);
+        for (auto r = in.read(buf.data(), buf.size()); r > 0; r = in.read(buf.data(), buf.size()))
+        {
+            if (zipWriteInFileInZip(m_zout, buf.data(), static_cast<unsigned>(r)) != ZIP_OK)
+                throw runtime_error("Write failed.");
+        }
+        if (in.tell() != e.csize || zipCloseFileInZipRaw64(m_zout, e.len, *e.crc) != ZIP_OK)
+            throw runtime_error("Write failed.");
+        writing_done();
+
+        m_files.emplace_back(entry_t{ .crc = {}, .method = e.method, .name = name, .ts = {} });
+        return m_files.size() - 1;
+    }
+
+    optional<size_t> pk3_pack_c::resume_impl(const fs::path& path, span<const journal_entry_t> done)
+    {
+        using namespace boost::endian;
+        constexpr uint32_t max32 = numeric_limits<uint32_t>::max();
+        constexpr uint16_t max16 = numeric_limits<uint16_t>::max();
+
+        //The central directory is written last, so it has to be made again from the local
+        //headers of the entries in the journal. They follow each other from the start.
+        struct found_t
+        {
+            array<uint8_t, 30> local;
+            string filename;
+            uint64_t offset, len, csize;
+        };
+        vector<found_t> found;
+        uint64_t end = 0;
+        if (!m_pakfile.open(path, file_c::access::read))
+            return {};
+        for (const auto& e : done)
+        {
+            found_t f{ .local = {}, .filename = boost::locale::conv::utf_to_utf<char>(e.name), .offset = e.offset, .len = 0, .csize = 0 };
+            auto& h = f.local;
+            if (e.offset != end || m_pakfile.read(h.data(), h.size(), e.offset) != h.size() || load_little_u32(&h[0]) != zip_local_sig)
+                break;
+
+            const auto name_len = load_little_u16(&h[26]);
+            const auto extra_len = load_little_u16(&h[28]);
+            string filename(name_len, '\0');
+            vector<uint8_t> extra(extra_len);
+            if (m_pakfile.read(filename.data(), name_len, e.offset + h.size()) != name_len
+                || m_pakfile.read(extra.data(), extra_len, e.offset + h.size() + name_len) != extra_len
+                || filename != f.filename)
+                break;
+
+            //Sizes that don't fit are in the zip64 extra field, in this order
+            f.len = load_little_u32(&h[22]);
+            f.csize = load_little_u32(&h[18]);
+            const auto z64 = find_extra_field(extra, zip64_extra_id);
+            size_t z64_pos = 0;
+            for (auto v : { &f.len, &f.csize })
             {
-                close_read_impl();
-                if (!open_pack_impl(m_filepath, false))
-                    throw runtime_error("Reopen failed.");
+                if (*v != max32)
+                    continue;
+                if (!z64 || z64->size() < z64_pos + 8u)
+                    break;
+                *v = load_little_u64(&(*z64)[z64_pos]);
+                z64_pos += 8u;
             }
+
+            const auto data_end = e.offset + h.size() + name_len + extra_len + f.csize;
+            const auto descriptor = (load_little_u16(&h[6]) & zip_flag_descriptor) ? 24u : 0u;
+            if (f.len != e.size || load_little_u32(&h[14]) != e.crc || e.end < data_end || e.end > data_end + descriptor)
+                break;
+            end = e.end;
+            found.push_back(std::move(f));
         }
+        m_pakfile.close();
+
+        vector<uint8_t> cd;
+        auto put = [&cd]<typename T>(T v)
+        {
+            const auto le = native_to_little(v);
+            const auto p = reinterpret_cast<const uint8_t*>(&le);
+            cd.insert(cd.end(), p, p + sizeof(le));
+        };
+        for (const auto& f : found)
+        {
+            vector<uint64_t> ext;
+            if (f.len >= max32)
+                ext.push_back(f.len);
+            if (f.csize >= max32)
+                ext.push_back(f.csize);
+            if (f.offset >= max32)
+                ext.push_back(f.offset);
+
+            put(zip_central_sig);
+            put(zip_version_zip64);                     //Version made by (MS-DOS)
+            cd.insert(cd.end(), f.local.begin() + 4, f.local.begin() + 18);  //Version needed to CRC
+            put(static_cast<uint32_t>(min(f.csize, uint64_t(max32))));
+            put(static_cast<uint32_t>(min(f.len, uint64_t(max32))));
+            put(static_cast<uint16_t>(f.filename.length()));
+            put(static_cast<uint16_t>(ext.empty() ? 0u : 4u + ext.size() * sizeof(uint64_t)));
+            put(uint16_t(0));   //Comment
+            put(uint16_t(0));   //Disk
+            put(uint16_t(0));   //Internal attributes
+            put(uint32_t(0));   //External attributes
+            put(static_cast<uint32_t>(min(f.offset, uint64_t(max32))));
+            cd.insert(cd.end(), f.filename.begin(), f.filename.end());
+            if (!ext.empty())
+            {
+                put(zip64_extra_id);
+                put(static_cast<uint16_t>(ext.size() * sizeof(uint64_t)));
+                for (auto v : ext)
+                    put(v);
+            }
+        }
+
+        const auto cd_size = static_cast<uint64_t>(cd.size());
+        const auto count = static_cast<uint64_t>(found.size());
+        if (count >= max16 || cd_size >= max32 || end >= max32)
+        {
+            put(zip64_end_sig);
+            put(uint64_t(44));  //Size of the rest of the record
+            put(zip_version_zip64);
+            put(zip_version_zip64);
+            put(uint32_t(0));
+            put(uint32_t(0));
+            put(count);
+            put(count);
+            put(cd_size);
+            put(end);
+
+            put(zip64_locator_sig);
+            put(uint32_t(0));
+            put(end + cd_size);
+            put(uint32_t(1));
+        }
+        put(zip_end_sig);
+        put(uint16_t(0));
+        put(uint16_t(0));
+        put(static_cast<uint16_t>(min(count, uint64_t(max16))));
+        put(static_cast<uint16_t>(min(count, uint64_t(max16))));
+        put(static_cast<uint32_t>(min(cd_size, uint64_t(max32))));
+        put(static_cast<uint32_t>(min(end, uint64_t(max32))));
+        put(uint16_t(0));   //Comment
+
+        fs::resize_file(path, end);
+        if (!m_pakfile.open(path, file_c::access::read_write))
+            return {};
+        m_pakfile.write(cd.data(), cd.size(), end);
+        m_pakfile.close();
+        return found.size();
+    }
+
+    optional<tuple<uint64_t, uint64_t>> pk3_pack_c::written_extent_impl() const
+    {
+        if (m_out_cursor == nullptr)
+            return {};
+        return tuple{ m_entry_start, m_out_cursor->tell() };
     }
 
     bool pk3_pack_c::close_pack_impl()
@@ -297,18 +789,142 @@ namespace pak_impl
         if (m_zin)
         {
             close_read_impl();
+            unzClose(m_zin);
             m_zin = nullptr;
         }
+        m_indexes.clear();
         if (m_zout)
         {
             close_write_impl();
             zipClose(m_zout, nullptr);
             m_zout = nullptr;
+            m_out_cursor = nullptr;
         }
         m_pakfile.close();
         return true;
     }
 
+    vector<pak::pack_i::problem_t> pk3_pack_c::verify_impl() const
+    {
+        //Entries are queued in file order so the disk is read mostly from start to end
+        vector<const entry_t*> by_offset;
+        ranges::transform(m_files, back_inserter(by_offset), [](const auto& e) { return &e; });
+        ranges::sort(by_offset, {}, &entry_t::offset);
+
+        //Every task borrows an unzip handle with a cursor of its own over the shared file. Only the end
+        //of the central directory is read when opening, entries are found from the stored positions.
+        using handle_t = unique_ptr<void, int(*)(unzFile)>;
+        mutex lock;
+        vector<handle_t> handles;
+        vector<problem_t> problems;
+        auto funcdef = m_funcdef;
+
+        pak::task_group_c tasks;
+        auto check = [&](const entry_t& e)
+        {
+            handle_t zin{ nullptr, &unzClose };
+            {
+                lock_guard l(lock);
+                if (!handles.empty())
+                {
+                    zin = std::move(handles.back());
+                    handles.pop_back();
+                }
+            }
+            if (zin == nullptr)
+                zin = handle_t{ unzOpen2_64(m_filepath.wstring().c_str(), &funcdef), &unzClose };
+            if (zin == nullptr)
+            {
+                lock_guard l(lock);
+                if (!tasks.cancelled())
+                    problems.emplace_back(L"", L"Could not open.");
+                tasks.cancel();
+                return;
+            }
+
+            auto found = verify_entry(zin.get(), e);
+            lock_guard l(lock);
+            handles.push_back(std::move(zin));
+            if (found.has_value())
+                problems.push_back(std::move(*found));
+        };
+
+        for (const auto e : by_offset)
+            tasks.run([&check, e]() { check(*e); });
+        tasks.wait();
+        return problems;
+    }
+
+    optional<pak::pack_i::problem_t> pk3_pack_c::verify_entry(unzFile zin, const entry_t& e)
+    {
+        if (unzGoToFilePos64(zin, &e.pos) != UNZ_OK)
+            return problem_t{ e.name.get(), L"Bad central directory entry." };
+
+        unz_file_info64 info;
+        if (unzGetCurrentFileInfo64(zin, &info, nullptr, 0u, nullptr, 0u, nullptr, 0u) == UNZ_OK
+            && (info.flag & zip_flag_encrypted))
+            return problem_t{ e.name.get(), L"Encrypted, can't be checked." };
+
+        if (const auto r = unzOpenCurrentFile(zin); r != UNZ_OK)
+            return problem_t{ e.name.get(), r == UNZ_BADZIPFILE ? L"Bad local header." : L"Unsupported compression." };
+
+        vector<uint8_t> buf(0x10000);
+        uint64_t total = 0;
+        int r = 0;
+        while ((r = unzReadCurrentFile(zin, buf.data(), static_cast<unsigned>(buf.size()))) > 0)
+            total += static_cast<uint64_t>(r);
+
+        //The CRC is only compared when the whole entry has been read
+        if (const auto c = unzCloseCurrentFile(zin); r < 0)
+            return problem_t{ e.name.get(), r == Z_DATA_ERROR ? L"Compressed data is corrupt."s : format(L"Read error ({}).", r) };
+        else if (total != e.len)
+            return problem_t{ e.name.get(), format(L"Size is {}, expected {}.", total, e.len) };
+        else if (c == UNZ_CRCERROR)
+            return problem_t{ e.name.get(), L"CRC error." };
+        return {};
+    }
+
+    optional<uint64_t> pk3_pack_c::data_pos(const entry_t& e) const
+    {
+        using namespace boost::endian;
+        array<uint8_t, 30> local;
+        if (m_pakfile.read(local.data(), local.size(), e.offset) != local.size()
+            || load_little_u32(&local[0]) != zip_local_sig)
+            throw runtime_error("Bad local header.");
+        if (load_little_u16(&local[6]) & zip_flag_encrypted)
+            return {};
+        return e.offset + local.size() + load_little_u16(&local[26]) + load_little_u16(&local[28]);
+    }
+
+    unique_ptr<pak::entry_reader_i> pk3_pack_c::open_reader_impl(size_t idx) const
+    {
+        //Entries written since opening aren't in the file yet
+        const auto& e = m_files[idx];
+        if (!m_zin || !e.crc)
+            return nullptr;
+
+        const auto pos = data_pos(e);
+        if (!pos)
+            return nullptr;
+        m_pakfile.will_need(*pos, e.csize);
+        switch (e.method)
+        {
+        case 0:
+            return make_unique<range_reader_c>(m_pakfile, *pos, e.len);
+        case Z_DEFLATED:
+            return make_unique<inflate_reader_c>(m_pakfile, *pos, e.csize, e.len, *e.crc, [this, idx]()
+            {
+                lock_guard lock(m_index_lock);
+                auto& index = m_indexes[idx];
+                if (!index)
+                    index = make_shared<inflate_index_t>();
+                return index;
+            });
+        default:
+            return nullptr;
+        }
+    }
+
     size_t pk3_pack_c::entry_count() const
     {
         return m_files.size();
@@ -316,7 +932,7 @@ namespace pak_impl
 
     const wstring& pk3_pack_c::entry_name(size_t idx) const
     {
-        return m_files[idx].name;
+        return m_files[idx].name.get();
     }
 
     size_t pk3_pack_c::max_filename_len_impl() const
@@ -328,4 +944,100 @@ namespace pak_impl
     {
         return numeric_limits<uint32_t>::max();
     }
+
+    pk3_scan_c::~pk3_scan_c()
+    {
+        if (m_zin)
+            unzClose(m_zin);
+    }
+
+    //static
+    ZCALLBACK void* pk3_scan_c::zopen(void* opaque, const void* filename, int mode)
+    {
+        boost::ignore_unused(mode);
+        auto p = reinterpret_cast<pk3_scan_c*>(opaque);
+        if (!p->m_file.is_open() && !p->m_file.open(fs::path(reinterpret_cast<const wchar_t*>(filename)), file_c::access::read))
+            return nullptr;
+        return new file_cursor_c(p->m_file);
+    }
+
+    bool pk3_scan_c::open(const fs::path& path)
+    {
+        zlib_filefunc64_def funcdef
+        {
+            .zopen64_file = &pk3_scan_c::zopen,
+            .zread_file = &pk3_pack_c::zread,
+            .zwrite_file = &pk3_pack_c::zwrite,
+            .ztell64_file = &pk3_pack_c::ztell,
+            .zseek64_file = &pk3_pack_c::zseek,
+            .zclose_file = &pk3_pack_c::zclose,
+            .zerror_file = &pk3_pack_c::zerror,
+            .opaque = this
+        };
+        m_zin = unzOpen2_64(path.wstring().c_str(), &funcdef);
+        return m_zin != nullptr;
+    }
+
+    optional<wstring> pk3_scan_c::next_entry()
+    {
+        if (m_entry_open && unzCloseCurrentFile(m_zin) == UNZ_CRCERROR)
+            emit_warning(m_name, L"CRC error.");
+        m_entry_open = false;
+        m_totread = 0;
+
+        //minizip only keeps the current central directory record, whatever the number of entries
+        array<char, 1 + 0xFFFF> filename;
+        array<uint8_t, 0xFFFF> extra;
+        for (auto r = m_started ? unzGoToNextFile(m_zin) : unzGoToFirstFile(m_zin); ; r = unzGoToNextFile(m_zin))
+        {
+            m_started = true;
+            if (r == UNZ_END_OF_LIST_OF_FILE)
+                return {};
+            
+            unz_file_info64 info;
+            unz64_file_pos pos;
+            if (r != UNZ_OK || unzGetCurrentFileInfo64(m_zin, &info, filename.data(), static_cast<uLong>(filename.size()),
+                extra.data(), static_cast<uLong>(extra.size()), nullptr, 0u) != UNZ_OK || unzGetFilePos64(m_zin, &pos) != UNZ_OK)
+            {
+                emit_warning(L"", L"Central directory is damaged.");
+                return {};
+            }
+
+            const auto rawname = string_view{ filename.data(), min<size_t>(info.size_filename, filename.size() - 1) };
+            if (rawname.ends_with('/'))
+                continue;
+
+            m_name = (info.flag & zip_flag_utf8)
+                ? boost::locale::conv::utf_to_utf<wchar_t, char>(rawname.data(), rawname.data() + rawname.size())
+                : from_ibm437(rawname);
+
+            m_info = {};
+            m_info.size = info.uncompressed_size;
+            m_info.stored_size = info.compressed_size;
+            m_info.method = static_cast<uint16_t>(info.compression_method);
+            m_info.crc = static_cast<uint32_t>(info.crc);
+            m_info.timestamp = convert_time(info.tmu_date);
+
+            array<uint8_t, 42> central;
+            if (m_file.read(central.data(), central.size(), pos.pos_in_zip_directory + sizeof(uint32_t)) == central.size())
+                m_info.offset = zip_local_offset(central, span{ extra }.first(info.size_file_extra));
+            return m_name;
+        }
+    }
+
+    size_t pk3_scan_c::read(uint8_t* data, size_t sz)
+    {
+        if (!m_entry_open)
+        {
+            if (unzOpenCurrentFile(m_zin) != UNZ_OK)
+                return 0;
+            m_entry_open = true;
+        }
+
+        const auto r = unzReadCurrentFile(m_zin, data, static_cast<unsigned>(min<size_t>(sz, numeric_limits<int>::max())));
+        if (r < 0)
+            throw runtime_error("Read error.");
+        m_totread += static_cast<uint64_t>(r);
+        return static_cast<size_t>(r);
+    }
 };
\ No newline at end of file
@@ -1,12 +1,35 @@
 #ifndef PK3_PACK_H_INCLUDED
 #define PK3_PACK_H_INCLUDED
 #include "../pack.h"
-#include <fstream>
+#include "pakutil.h"
 #include <minizip/unzip.h>
 #include <minizip/zip.h>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
 
 namespace pak_impl
 {
+    //Points where inflating a deflated entry can start over, so it can be read from the middle.
+    //Built up as readers seek through the entry and shared by all readers of it.
+    struct inflate_index_t
+    {
+        //How far apart the points are at least. Each keeps a 32 kB window,
+        //so the index takes up to 1/32 of the part of the entry that it covers.
+        static constexpr std::uint64_t span = 0x100000;
+
+        struct point_t
+        {
+            std::uint64_t out = 0;  //Position in the entry
+            std::uint64_t in = 0;   //Position in the compressed data
+            int bits = 0;           //Bits of the byte before in that belong to the block
+            std::vector<std::uint8_t> window;
+        };
+
+        std::mutex lock;
+        std::vector<point_t> points;    //By out
+    };
+
     class pk3_pack_c : public pak::pack_i
     {
     protected:
@@ -14,6 +37,9 @@ namespace pak_impl
         bool create_pack_impl(const std::filesystem::path& path) override;
         bool open_entry_impl(size_t idx) override;
         std::optional<filetime_t> entry_timestamp_impl(size_t idx) const override;
+        entry_info_t entry_info_impl(size_t idx) const override;
+        std::uint64_t space_needed_impl(const std::wstring& name, std::uint64_t size) const override;
+        std::uint64_t empty_size_impl() const override;
         std::optional<size_t> new_entry_impl(const std::wstring& name, const std::optional<filetime_t>& ft) override;
         size_t read_entry_impl(std::uint8_t* buf, size_t sz) override;
         size_t write_entry_impl(const std::uint8_t* buf, size_t size) override;
@@ -24,10 +50,23 @@ namespace pak_impl
         size_t max_file_count() const override;
         size_t entry_count() const override;
         const std::wstring& entry_name(size_t idx) const override;
+        std::vector<problem_t> verify_impl() const override;
+        void reserve_entry_impl(std::uint64_t size) override;
+        std::unique_ptr<pak::entry_reader_i> open_reader_impl(size_t idx) const override;
+        bool seek_entry_impl(std::uint64_t pos) override;
+        std::optional<size_t> resume_impl(const std::filesystem::path& path, std::span<const journal_entry_t> done) override;
+        std::optional<std::tuple<std::uint64_t, std::uint64_t>> written_extent_impl() const override;
+        std::optional<size_t> copy_stored_impl(const pak::pack_i& src, size_t idx, const std::wstring& name,
+            const std::optional<filetime_t>& ft) override;
     private:
-        std::fstream m_pakfile;
+        //Shares the file callbacks
+        friend class pk3_scan_c;
+
+        file_c m_pakfile;
         unzFile m_zin = nullptr;
         zipFile m_zout = nullptr;
+        file_cursor_c* m_out_cursor = nullptr;  //Owned by m_zout
+        std::uint64_t m_entry_start = 0;        //Local header of the entry being written
 
         static ZCALLBACK ZPOS64_T ztell(void* opaque, void* stream);
         static ZCALLBACK long zseek(void* opaque, void* stream, ZPOS64_T offset, int origin);
@@ -53,10 +92,38 @@ namespace pak_impl
         {
             unz64_file_pos pos = { 0ULL, 0ULL };
             uint64_t len = 0ULL;
-            std::wstring name;
+            uint64_t csize = 0ULL;
+            uint64_t offset = 0ULL;
+            std::optional<uint32_t> crc;    //Not known for entries written since opening
+            uint16_t method = 0;
+            lazy_name_c name;
             std::optional<filetime_t> ts;
         };
         std::vector<entry_t> m_files;
+
+        //Entry written with write_options_t::optimize. Nothing goes to the file until it is
+        //closed, since the method in the local header depends on what compresses best.
+        struct pending_t
+        {
+            std::string filename;
+            zip_fileinfo zfi;
+            std::vector<std::uint8_t> data;
+        };
+        std::optional<pending_t> m_pending;
+
+        //Current entry after it has been seeked in, minizip can only read on from the start
+        std::unique_ptr<pak::entry_reader_i> m_seek_reader;
+        mutable std::mutex m_index_lock;
+        mutable std::unordered_map<size_t, std::shared_ptr<inflate_index_t>> m_indexes;
+
+        static std::optional<problem_t> verify_entry(unzFile zin, const entry_t& e);
+        //Where the data of an entry starts, nothing if it is encrypted
+        std::optional<std::uint64_t> data_pos(const entry_t& e) const;
+        static zip_fileinfo zip_info(const std::string& filename, const std::optional<filetime_t>& ft);
+        //Closes the reader once something is written, see close_write_impl
+        void writing_done();
+        bool open_zip_entry(const std::string& filename, const zip_fileinfo& zfi, int method, int level, bool raw);
+        bool write_optimized(pending_t& pending);
     };
 }
 #endif
@@ -0,0 +1,296 @@
+#include "pk3_stream_pack.h"
+#include "pakutil.h"
+#include "ziputil.h"
+#include <boost/endian.hpp>
+#include <boost/locale.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <iostream>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+using namespace boost::endian;
+
+namespace pak_impl
+{
+    constexpr uint32_t max32 = numeric_limits<uint32_t>::max();
+    constexpr uint16_t max16 = numeric_limits<uint16_t>::max();
+
+    pk3_stream_pack_c::~pk3_stream_pack_c()
+    {
+        if (m_zinit)
+            deflateEnd(&m_zs);
+    }
+
+    template <typename T>
+    void pk3_stream_pack_c::put(T v)
+    {
+        write_file(*m_out, native_to_little(v));
+        m_offset += sizeof(v);
+    }
+
+    void pk3_stream_pack_c::put(const void* data, size_t sz)
+    {
+        write_file(*m_out, data, static_cast<streamsize>(sz));
+        m_offset += sz;
+    }
+
+    bool pk3_stream_pack_c::open_pack_impl(const fs::path& path, bool w)
+    {
+        //Nothing to read from
+        boost::ignore_unused(path, w);
+        return false;
+    }
+
+    bool pk3_stream_pack_c::create_pack_impl(const fs::path& path)
+    {
+        if (path != L"-")
+            return false;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        m_out = &cout;
+        m_offset = 0;
+        m_files.clear();
+        m_outbuf.resize(0x10000);
+        return true;
+    }
+
+    bool pk3_stream_pack_c::open_entry_impl(size_t idx)
+    {
+        boost::ignore_unused(idx);
+        return false;
+    }
+
+    optional<pak::pack_i::filetime_t> pk3_stream_pack_c::entry_timestamp_impl(size_t idx) const
+    {
+        boost::ignore_unused(idx);
+        return {};
+    }
+
+    pak::pack_i::entry_info_t pk3_stream_pack_c::entry_info_impl(size_t idx) const
+    {
+        const auto& e = m_files[idx];
+        entry_info_t info;
+        info.size = e.len;
+        info.stored_size = e.csize;
+        info.method = Z_DEFLATED;
+        info.crc = e.crc;
+        info.offset = e.offset;
+        return info;
+    }
+
+    uint64_t pk3_stream_pack_c::space_needed_impl(const wstring& name, uint64_t size) const
+    {
+        return zip_entry_space(boost::locale::conv::utf_to_utf<char>(name).length(), size);
+    }
+
+    uint64_t pk3_stream_pack_c::empty_size_impl() const
+    {
+        return zip_end_space;
+    }
+
+    optional<size_t> pk3_stream_pack_c::new_entry_impl(const wstring& name, const optional<filetime_t>& ft)
+    {
+        if (m_out == nullptr)
+            return {};
+
+        entry_t e{ .name = name, .filename = boost::locale::conv::utf_to_utf<char, wchar_t>(name) };
+        e.flags = zip_flag_descriptor | (is_ascii(e.filename) ? 0u : zip_flag_utf8);
+        tie(e.dos_date, e.dos_time) = to_dos_time(ft.has_value() ? *ft : boost::posix_time::second_clock::local_time());
+        e.offset = m_offset;
+
+        //Entries that would normally be stored are deflated without compression instead,
+        //a stored entry with a data descriptor can't be read back from a stream
+        const auto level = get<1>(compression_level(e.filename));
+        if (m_zinit)
+            deflateEnd(&m_zs);
+        m_zinit = deflateInit2(&m_zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!m_zinit)
+            return {};
+
+        put(zip_local_sig);
+        put(zip_version_zip64);
+        put(e.flags);
+        put(static_cast<uint16_t>(Z_DEFLATED));
+        put(e.dos_time);
+        put(e.dos_date);
+        put(uint32_t(0));   //CRC and sizes come in the data descriptor
+        put(uint32_t(0));
+        put(uint32_t(0));
+        put(static_cast<uint16_t>(e.filename.length()));
+        put(uint16_t(20));
+        put(e.filename.data(), e.filename.length());
+        //Zip64 extra field makes the descriptor use 64 bit sizes
+        put(zip64_extra_id);
+        put(uint16_t(16));
+        put(uint64_t(0));
+        put(uint64_t(0));
+
+        m_files.push_back(std::move(e));
+        return m_files.size() - 1;
+    }
+
+    size_t pk3_stream_pack_c::read_entry_impl(uint8_t* buf, size_t sz)
+    {
+        boost::ignore_unused(buf, sz);
+        return 0;
+    }
+
+    void pk3_stream_pack_c::deflate_out(int flush)
+    {
+        auto& e = m_files[*m_write_idx];
+        do
+        {
+            m_zs.next_out = m_outbuf.data();
+            m_zs.avail_out = static_cast<uInt>(m_outbuf.size());
+            if (deflate(&m_zs, flush) == Z_STREAM_ERROR)
+                throw runtime_error("Deflate error.");
+
+            const auto n = m_outbuf.size() - m_zs.avail_out;
+            put(m_outbuf.data(), n);
+            e.csize += n;
+        } while (m_zs.avail_out == 0);
+    }
+
+    size_t pk3_stream_pack_c::write_entry_impl(const uint8_t* buf, size_t size)
+    {
+        if (m_out == nullptr || !m_zinit || size > numeric_limits<uInt>::max())
+            return 0;
+
+        auto& e = m_files[*m_write_idx];
+        e.crc = static_cast<uint32_t>(crc32_z(e.crc, buf, size));
+        e.len += size;
+
+        m_zs.next_in = const_cast<Bytef*>(buf);
+        m_zs.avail_in = static_cast<uInt>(size);
+        deflate_out(Z_NO_FLUSH);
+        return size;
+    }
+
+    void pk3_stream_pack_c::close_read_impl()
+    {
+    }
+
+    void pk3_stream_pack_c::close_write_impl()
+    {
+        if (m_out == nullptr || !m_zinit)
+            return;
+
+        deflate_out(Z_FINISH);
+
+        const auto& e = m_files[*m_write_idx];
+        put(zip_descriptor_sig);
+        put(e.crc);
+        put(e.csize);
+        put(e.len);
+    }
+
+    void pk3_stream_pack_c::write_central_dir()
+    {
+        const auto cd_start = m_offset;
+        for (const auto& e : m_files)
+        {
+            vector<uint64_t> ext;
+            if (e.len >= max32)
+                ext.push_back(e.len);
+            if (e.csize >= max32)
+                ext.push_back(e.csize);
+            if (e.offset >= max32)
+                ext.push_back(e.offset);
+
+            put(zip_central_sig);
+            put(zip_version_zip64);     //Version made by (MS-DOS)
+            put(zip_version_zip64);     //Version needed
+            put(e.flags);
+            put(static_cast<uint16_t>(Z_DEFLATED));
+            put(e.dos_time);
+            put(e.dos_date);
+            put(e.crc);
+            put(static_cast<uint32_t>(min<uint64_t>(e.csize, max32)));
+            put(static_cast<uint32_t>(min<uint64_t>(e.len, max32)));
+            put(static_cast<uint16_t>(e.filename.length()));
+            put(static_cast<uint16_t>(ext.empty() ? 0u : 4u + ext.size() * sizeof(uint64_t)));
+            put(uint16_t(0));   //Comment
+            put(uint16_t(0));   //Disk
+            put(uint16_t(0));   //Internal attributes
+            put(uint32_t(0));   //External attributes
+            put(static_cast<uint32_t>(min<uint64_t>(e.offset, max32)));
+            put(e.filename.data(), e.filename.length());
+            if (!ext.empty())
+            {
+                put(zip64_extra_id);
+                put(static_cast<uint16_t>(ext.size() * sizeof(uint64_t)));
+                for (auto v : ext)
+                    put(v);
+            }
+        }
+
+        const auto cd_size = m_offset - cd_start;
+        const auto count = static_cast<uint64_t>(m_files.size());
+        if (count >= max16 || cd_size >= max32 || cd_start >= max32)
+        {
+            const auto end64_pos = m_offset;
+            put(zip64_end_sig);
+            put(uint64_t(44));  //Size of the rest of the record
+            put(zip_version_zip64);
+            put(zip_version_zip64);
+            put(uint32_t(0));
+            put(uint32_t(0));
+            put(count);
+            put(count);
+            put(cd_size);
+            put(cd_start);
+
+            put(zip64_locator_sig);
+            put(uint32_t(0));
+            put(end64_pos);
+            put(uint32_t(1));
+        }
+
+        put(zip_end_sig);
+        put(uint16_t(0));
+        put(uint16_t(0));
+        put(static_cast<uint16_t>(min<uint64_t>(count, max16)));
+        put(static_cast<uint16_t>(min<uint64_t>(count, max16)));
+        put(static_cast<uint32_t>(min<uint64_t>(cd_size, max32)));
+        put(static_cast<uint32_t>(min<uint64_t>(cd_start, max32)));
+        put(uint16_t(0));   //Comment
+    }
+
+    bool pk3_stream_pack_c::close_pack_impl()
+    {
+        if (m_out == nullptr)
+            return true;
+
+        write_central_dir();
+        m_out->flush();
+        const auto ok = !m_out->fail();
+        m_out = nullptr;
+        m_files.clear();
+        return ok;
+    }
+
+    size_t pk3_stream_pack_c::max_filename_len_impl() const
+    {
+        return numeric_limits<uint16_t>::max() - 1;
+    }
+
+    size_t pk3_stream_pack_c::max_file_count() const
+    {
+        return numeric_limits<uint32_t>::max();
+    }
+
+    size_t pk3_stream_pack_c::entry_count() const
+    {
+        return m_files.size();
+    }
+
+    const wstring& pk3_stream_pack_c::entry_name(size_t idx) const
+    {
+        return m_files[idx].name;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef PK3_STREAM_PACK_H_INCLUDED
+#define PK3_STREAM_PACK_H_INCLUDED
+#include "../pack.h"
+#include <vector>
+#include <ostream>
+#include <zlib.h>
+
+namespace pak_impl
+{
+    //Write-only .pk3 for non-seekable outputs like stdout. Sizes and CRCs go in
+    //data descriptors after each entry since local headers can't be patched afterwards.
+    class pk3_stream_pack_c : public pak::pack_i
+    {
+    public:
+        ~pk3_stream_pack_c() override;
+    protected:
+        bool open_pack_impl(const std::filesystem::path& path, bool w) override;
+        bool create_pack_impl(const std::filesystem::path& path) override;
+        bool open_entry_impl(size_t idx) override;
+        std::optional<filetime_t> entry_timestamp_impl(size_t idx) const override;
+        entry_info_t entry_info_impl(size_t idx) const override;
+        std::uint64_t space_needed_impl(const std::wstring& name, std::uint64_t size) const override;
+        std::uint64_t empty_size_impl() const override;
+        std::optional<size_t> new_entry_impl(const std::wstring& name, const std::optional<filetime_t>& ft) override;
+        size_t read_entry_impl(std::uint8_t* buf, size_t sz) override;
+        size_t write_entry_impl(const std::uint8_t* buf, size_t size) override;
+        bool close_pack_impl() override;
+        void close_read_impl() override;
+        void close_write_impl() override;
+        size_t max_filename_len_impl() const override;
+        size_t max_file_count() const override;
+        size_t entry_count() const override;
+        const std::wstring& entry_name(size_t idx) const override;
+    private:
+        struct entry_t
+        {
+            std::wstring name;
+            std::string filename;
+            std::uint16_t flags = 0;
+            std::uint16_t dos_date = 0, dos_time = 0;
+            std::uint32_t crc = 0;
+            std::uint64_t csize = 0, len = 0;
+            std::uint64_t offset = 0;
+        };
+        std::vector<entry_t> m_files;
+        std::ostream* m_out = nullptr;
+        std::uint64_t m_offset = 0;
+        z_stream m_zs{};
+        bool m_zinit = false;
+        std::vector<std::uint8_t> m_outbuf;
+
+        template <typename T>
+        void put(T v);
+        void put(const void* data, size_t sz);
+        void deflate_out(int flush);
+        void write_central_dir();
+    };
+}
+
+#endif
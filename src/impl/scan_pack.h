@@ -0,0 +1,103 @@
+#ifndef SCAN_PACK_H_INCLUDED
+#define SCAN_PACK_H_INCLUDED
+#include "../pack.h"
+#include "pakutil.h"
+#include <vector>
+#include <fstream>
+#include <minizip/unzip.h>
+
+namespace pak_impl
+{
+    //Base of the readers behind stream_pack_i::scan_pack. Only the current entry is kept,
+    //the directory is read a block at a time as the scan moves on.
+    class scan_reader_c : public pak::stream_pack_i
+    {
+    public:
+        explicit scan_reader_c(pak::pack_i::warning_func_t warn_func) : m_warn_func(warn_func)
+        {
+        }
+
+        std::optional<filetime_t> entry_timestamp() const override
+        {
+            return m_info.timestamp;
+        }
+        std::optional<pak::pack_i::entry_info_t> entry_info() const override
+        {
+            auto info = m_info;
+            info.name = m_name;
+            return info;
+        }
+    protected:
+        void emit_warning(const std::wstring& entry, const std::wstring& message) const
+        {
+            if (m_warn_func)
+                m_warn_func(entry, message);
+        }
+
+        pak::pack_i::warning_func_t m_warn_func;
+        std::wstring m_name;
+        pak::pack_i::entry_info_t m_info;
+        std::uint64_t m_totread = 0;
+    };
+
+    //.pak and .grp, where entry data is read straight from the offsets in the directory
+    class dir_scan_c : public scan_reader_c
+    {
+    public:
+        using scan_reader_c::scan_reader_c;
+
+        bool open_pak(const std::filesystem::path& path);
+        bool open_grp(const std::filesystem::path& path);
+
+        std::optional<std::wstring> next_entry() override;
+        size_t read(std::uint8_t* data, size_t sz) override;
+    private:
+        static constexpr size_t block_records = 4096;
+
+        file_c m_file;
+        bool m_grp = false;
+        size_t m_rec_size = 0;
+        std::uint64_t m_dir_pos = 0;
+        std::uint64_t m_records_left = 0;
+        std::uint64_t m_grp_data = 0;
+        std::vector<std::uint8_t> m_block;
+        size_t m_block_pos = 0;
+    };
+
+    class pk3_scan_c : public scan_reader_c
+    {
+    public:
+        using scan_reader_c::scan_reader_c;
+        ~pk3_scan_c() override;
+
+        bool open(const std::filesystem::path& path);
+
+        std::optional<std::wstring> next_entry() override;
+        size_t read(std::uint8_t* data, size_t sz) override;
+    private:
+        file_c m_file;
+        unzFile m_zin = nullptr;
+        bool m_started = false;
+        bool m_entry_open = false;
+
+        static ZCALLBACK void* zopen(void* opaque, const void* filename, int mode);
+    };
+
+    class fs_scan_c : public scan_reader_c
+    {
+    public:
+        using scan_reader_c::scan_reader_c;
+
+        bool open(const std::filesystem::path& path);
+
+        std::optional<std::wstring> next_entry() override;
+        size_t read(std::uint8_t* data, size_t sz) override;
+    private:
+        std::filesystem::path m_base_path;
+        std::filesystem::recursive_directory_iterator m_it;
+        std::filesystem::path m_cur_path;
+        std::ifstream m_infile;
+    };
+}
+
+#endif
@@ -0,0 +1,208 @@
+#include "../scheduler.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+    //Set on worker threads so tasks they start go to their own deque
+    thread_local const pak::scheduler_c* t_scheduler = nullptr;
+    thread_local size_t t_worker = 0;
+
+    atomic<unsigned> default_threads = 0;
+}
+
+namespace pak
+{
+    scheduler_c::scheduler_c(unsigned threads)
+        : m_thread_count(threads == 0 ? max(1u, thread::hardware_concurrency()) : threads)
+    {
+        for (auto i = 1u; i < m_thread_count; ++i)
+            m_queues.push_back(make_unique<queue_t>());
+        for (size_t i = 0; i < m_queues.size(); ++i)
+            m_workers.emplace_back(&scheduler_c::worker, this, i);
+    }
+
+    scheduler_c::~scheduler_c()
+    {
+        {
+            lock_guard lock(m_sleep_lock);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& w : m_workers)
+            w.join();
+    }
+
+    //static
+    scheduler_c& scheduler_c::instance()
+    {
+        static scheduler_c sched(default_threads);
+        return sched;
+    }
+
+    //static
+    void scheduler_c::set_default_threads(unsigned threads)
+    {
+        default_threads = threads;
+    }
+
+    void scheduler_c::post(function<void()> task)
+    {
+        if (m_workers.empty())
+            task();
+        else
+            push({ std::move(task), nullptr });
+    }
+
+    void scheduler_c::push(task_t task)
+    {
+        auto& q = t_scheduler == this ? *m_queues[t_worker] : m_shared;
+        const auto group = task.group != nullptr;
+        {
+            lock_guard lock(q.lock);
+            if (task.group)
+                ++task.group->m_queued;
+            q.tasks.push_back(std::move(task));
+            ++m_queued;
+        }
+        {
+            //Taken so a thread that just found nothing to do is asleep before it is woken
+            lock_guard lock(m_sleep_lock);
+        }
+        m_wake.notify_one();
+        //A thread waiting for the group may be the only one free to run it
+        if (group)
+            m_wait_wake.notify_all();
+    }
+
+    bool scheduler_c::run_one(task_group_c* group)
+    {
+        auto take = [this, group](queue_t& q, bool newest)
+        {
+            task_t task;
+            lock_guard lock(q.lock);
+            auto of_group = [group](const task_t& t) { return group == nullptr || t.group == group; };
+            auto it = end(q.tasks);
+            if (newest)
+            {
+                auto rit = find_if(rbegin(q.tasks), rend(q.tasks), of_group);
+                if (rit != rend(q.tasks))
+                    it = prev(rit.base());
+            }
+            else
+                it = find_if(begin(q.tasks), end(q.tasks), of_group);
+            if (it != end(q.tasks))
+            {
+                task = std::move(*it);
+                q.tasks.erase(it);
+                if (task.group)
+                    --task.group->m_queued;
+                --m_queued;
+            }
+            return task;
+        };
+
+        //Own tasks first, newest first since their data is most likely still in the cache.
+        //Stolen tasks are the oldest, which tend to be the largest pieces of work.
+        task_t task;
+        if (t_scheduler == this)
+            task = take(*m_queues[t_worker], true);
+        if (!task.run)
+            task = take(m_shared, false);
+        for (size_t i = 0; !task.run && i < m_queues.size(); ++i)
+            task = take(*m_queues[(m_next_victim++) % m_queues.size()], false);
+
+        if (!task.run)
+            return false;
+        task.run();
+        return true;
+    }
+
+    void scheduler_c::worker(size_t idx)
+    {
+        t_scheduler = this;
+        t_worker = idx;
+        for (;;)
+        {
+            if (run_one())
+                continue;
+
+            unique_lock lock(m_sleep_lock);
+            m_wake.wait(lock, [this]() { return m_stop || m_queued > 0u; });
+            if (m_stop)
+                return;
+        }
+    }
+
+    void scheduler_c::wake_waiters()
+    {
+        {
+            lock_guard lock(m_sleep_lock);
+        }
+        m_wait_wake.notify_all();
+    }
+
+    void scheduler_c::sleep_until(const function<bool()>& done)
+    {
+        unique_lock lock(m_sleep_lock);
+        m_wait_wake.wait(lock, done);
+    }
+
+    task_group_c::~task_group_c()
+    {
+        //Tasks refer to the group, so it can't go away before they are done
+        cancel();
+        try
+        {
+            wait();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void task_group_c::run(function<void()> task)
+    {
+        ++m_active;
+        m_sched.push({ [this, &sched = m_sched, task = std::move(task)]()
+        {
+            if (!m_cancelled)
+            {
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    lock_guard lock(m_error_lock);
+                    if (!m_error)
+                        m_error = current_exception();
+                    m_cancelled = true;
+                }
+            }
+            //The group may be gone as soon as the count reaches zero
+            if (--m_active == 0u)
+                sched.wake_waiters();
+        }, this });
+    }
+
+    void task_group_c::wait()
+    {
+        while (m_active > 0u)
+        {
+            if (!m_sched.run_one(this))
+                m_sched.sleep_until([this]() { return m_queued > 0u || m_active == 0u; });
+        }
+
+        //Everything has finished, so the group can be used again
+        m_cancelled = false;
+        lock_guard lock(m_error_lock);
+        if (m_error)
+        {
+            exception_ptr error;
+            swap(error, m_error);
+            rethrow_exception(error);
+        }
+    }
+}
@@ -0,0 +1,434 @@
+#include "stream_pack.h"
+#include "pakutil.h"
+#include "ziputil.h"
+#include <boost/endian.hpp>
+#include <boost/locale.hpp>
+#include <random>
+#include <format>
+
+using namespace std;
+namespace fs = std::filesystem;
+namespace conv = boost::locale::conv;
+using namespace boost::endian;
+
+namespace pak_impl
+{
+    static constexpr auto PACK = "PACK"sv;
+    static constexpr auto KEN = "KenSilverman"sv;
+    static constexpr auto ZIP_LOCAL = "PK\x03\x04"sv;
+    static constexpr auto ZIP_EMPTY = "PK\x05\x06"sv;
+
+    size_t stream_source_c::fill(size_t n)
+    {
+        if (m_end - m_pos >= n)
+            return m_end - m_pos;
+
+        if (m_pos > 0)
+        {
+            copy(begin(m_buf) + m_pos, begin(m_buf) + m_end, begin(m_buf));
+            m_end -= m_pos;
+            m_pos = 0;
+        }
+        if (n > m_buf.size())
+            m_buf.resize(n);
+
+        while (m_end < n && m_is)
+        {
+            m_is.read(reinterpret_cast<char*>(m_buf.data() + m_end), static_cast<streamsize>(m_buf.size() - m_end));
+            m_end += static_cast<size_t>(m_is.gcount());
+        }
+        if (m_is.bad())
+            throw runtime_error("Read error.");
+        return m_end - m_pos;
+    }
+
+    size_t stream_source_c::read(void* data, size_t sz)
+    {
+        const auto n = min(fill(), sz);
+        copy_n(m_buf.data() + m_pos, n, reinterpret_cast<uint8_t*>(data));
+        consume(n);
+        return n;
+    }
+
+    void stream_source_c::read_exact(void* data, size_t sz)
+    {
+        auto p = reinterpret_cast<uint8_t*>(data);
+        for (size_t done = 0; done < sz; )
+        {
+            const auto r = read(p + done, sz - done);
+            if (r == 0)
+                throw runtime_error("Unexpected end of stream.");
+            done += r;
+        }
+    }
+
+    void stream_source_c::skip(uint64_t n)
+    {
+        while (n > 0)
+        {
+            const auto avail = fill();
+            if (avail == 0)
+                throw runtime_error("Unexpected end of stream.");
+            const auto s = static_cast<size_t>(min<uint64_t>(avail, n));
+            consume(s);
+            n -= s;
+        }
+    }
+
+    spool_c::~spool_c()
+    {
+        if (m_file.is_open())
+        {
+            m_file.close();
+            error_code ec;
+            fs::remove(m_filepath, ec);
+        }
+    }
+
+    void spool_c::append(const uint8_t* data, size_t sz)
+    {
+        if (!m_file.is_open() && m_mem.size() + sz > mem_limit)
+        {
+            random_device rd;
+            m_filepath = fs::temp_directory_path() / format("paktool-{:08x}{:08x}.spool", rd(), rd());
+            m_file.open(m_filepath, ios::binary | ios::in | ios::out | ios::trunc);
+            if (!m_file.is_open())
+                throw runtime_error("Could not create temporary file.");
+            write_file(m_file, m_mem);
+            m_mem = {};
+        }
+
+        if (m_file.is_open())
+        {
+            if (!seek_write(m_file, 0, ios::end))
+                throw runtime_error("Write error.");
+            write_file(m_file, data, static_cast<streamsize>(sz));
+        }
+        else
+        {
+            m_mem.insert(end(m_mem), data, data + sz);
+        }
+        m_size += sz;
+    }
+
+    void spool_c::read_at(uint64_t pos, uint8_t* data, size_t sz)
+    {
+        if (pos + sz > m_size)
+            throw runtime_error("Read error.");
+
+        if (m_file.is_open())
+        {
+            if (!seek_read(m_file, static_cast<streamoff>(pos)) || read_file(m_file, data, static_cast<streamsize>(sz)) != static_cast<streamsize>(sz))
+                throw runtime_error("Read error.");
+        }
+        else
+        {
+            copy_n(m_mem.data() + pos, sz, data);
+        }
+    }
+
+    bool dir_stream_reader_c::read_pak_header()
+    {
+        char buf[PACK.length()];
+        m_src->read_exact(buf, sizeof(buf));
+        if (string_view{ buf, size(buf) } != PACK)
+            return false;
+
+        const auto ft_offset = little_to_native(m_src->read<int32_t>());
+        const auto ft_size = little_to_native(m_src->read<int32_t>());
+        if (ft_size < 0 || static_cast<uint64_t>(ft_offset) < m_src->position())
+            return false;
+
+        //The directory is normally at the end, so everything in front of it
+        //has to be kept until we know which entries it belongs to
+        m_spool_base = m_src->position();
+        while (m_src->position() < static_cast<uint64_t>(ft_offset))
+        {
+            const auto avail = m_src->fill();
+            if (avail == 0)
+                return false;
+            const auto n = static_cast<size_t>(min<uint64_t>(avail, ft_offset - m_src->position()));
+            m_spool.append(m_src->data().data(), n);
+            m_src->consume(n);
+        }
+
+        const size_t file_cnt = ft_size / 64u;
+        m_files.reserve(file_cnt);
+        for (size_t i = 0; i < file_cnt; ++i)
+        {
+            char nmbuf[56];
+            m_src->read_exact(nmbuf, sizeof(nmbuf));
+            const auto pos = little_to_native(m_src->read<int32_t>());
+            const auto len = little_to_native(m_src->read<int32_t>());
+            if (pos < 0 || len < 0)
+                return false;
+
+            m_files.emplace_back(entry_t{
+                .pos = static_cast<uint64_t>(pos),
+                .len = static_cast<uint64_t>(len),
+                .name = from_text({ begin(nmbuf), ranges::find(nmbuf, '\0') })
+            });
+        }
+        m_src->skip(ft_size % 64u);
+
+        //Serve entries in the order of their data
+        ranges::stable_sort(m_files, {}, &entry_t::pos);
+        return true;
+    }
+
+    bool dir_stream_reader_c::read_grp_header()
+    {
+        char ken[KEN.length()];
+        m_src->read_exact(ken, sizeof(ken));
+        if (string_view{ begin(ken), end(ken) } != KEN)
+            return false;
+
+        const auto file_cnt = little_to_native(m_src->read<uint32_t>());
+        uint64_t offs = KEN.length() + sizeof(uint32_t) + file_cnt * 16ULL;
+        for (auto i = 0u; i < file_cnt; ++i)
+        {
+            char filenbuf[12];
+            m_src->read_exact(filenbuf, sizeof(filenbuf));
+            const auto filesz = little_to_native(m_src->read<uint32_t>());
+
+            m_files.emplace_back(entry_t{
+                .pos = offs,
+                .len = filesz,
+                .name = conv::to_utf<wchar_t>({ begin(filenbuf), ranges::find(filenbuf, '\0') }, "IBM437") });
+            offs += filesz;
+        }
+        return true;
+    }
+
+    optional<wstring> dir_stream_reader_c::next_entry()
+    {
+        m_cur = m_cur.has_value() ? *m_cur + 1 : 0;
+        m_totread = 0;
+
+        for (; *m_cur < m_files.size(); ++*m_cur)
+        {
+            const auto& e = m_files[*m_cur];
+            m_from_spool = e.pos >= m_spool_base && e.pos < m_spool_base + m_spool.size();
+            if (m_from_spool && e.pos + e.len <= m_spool_base + m_spool.size())
+                return e.name;
+            else if (!m_from_spool && e.pos >= m_src->position())
+            {
+                m_src->skip(e.pos - m_src->position());
+                return e.name;
+            }
+            emit_warning(e.name, L"Entry data overlaps other data and can't be read from a stream.");
+        }
+        return {};
+    }
+
+    optional<pak::pack_i::filetime_t> dir_stream_reader_c::entry_timestamp() const
+    {
+        //Neither pak nor grp has time stamps
+        return {};
+    }
+
+    size_t dir_stream_reader_c::read(uint8_t* data, size_t sz)
+    {
+        if (!m_cur.has_value() || *m_cur >= m_files.size())
+            return 0;
+
+        const auto& e = m_files[*m_cur];
+        const auto n = static_cast<size_t>(min<uint64_t>(sz, e.len - m_totread));
+        if (n == 0)
+            return 0;
+
+        if (m_from_spool)
+            m_spool.read_at(e.pos - m_spool_base + m_totread, data, n);
+        else
+            m_src->read_exact(data, n);
+
+        m_totread += n;
+        return n;
+    }
+
+    zip_stream_reader_c::~zip_stream_reader_c()
+    {
+        if (m_zinit)
+            inflateEnd(&m_zs);
+    }
+
+    optional<wstring> zip_stream_reader_c::next_entry()
+    {
+        finish_entry();
+
+        while (!m_end)
+        {
+            //Local headers come first, anything else means we've reached the central directory
+            if (m_src->fill(sizeof(uint32_t)) < sizeof(uint32_t) || little_to_native(m_src->read<uint32_t>()) != zip_local_sig)
+            {
+                m_end = true;
+                break;
+            }
+
+            entry_t e;
+            little_to_native(m_src->read<uint16_t>());   //Version needed
+            e.flags = little_to_native(m_src->read<uint16_t>());
+            e.method = little_to_native(m_src->read<uint16_t>());
+            const auto dos_time = little_to_native(m_src->read<uint16_t>());
+            const auto dos_date = little_to_native(m_src->read<uint16_t>());
+            e.crc = little_to_native(m_src->read<uint32_t>());
+            e.csize = little_to_native(m_src->read<uint32_t>());
+            e.len = little_to_native(m_src->read<uint32_t>());
+            const auto name_len = little_to_native(m_src->read<uint16_t>());
+            const auto extra_len = little_to_native(m_src->read<uint16_t>());
+
+            string filename(name_len, '\0');
+            m_src->read_exact(filename.data(), filename.size());
+            vector<uint8_t> extra(extra_len);
+            m_src->read_exact(extra.data(), extra.size());
+
+            if (const auto z64 = find_extra_field(extra, zip64_extra_id); z64 && z64->size() >= 16)
+            {
+                e.zip64 = true;
+                e.len = load_little_u64(&(*z64)[0]);
+                e.csize = load_little_u64(&(*z64)[8]);
+            }
+
+            e.name = (e.flags & zip_flag_utf8)
+                ? conv::utf_to_utf<wchar_t, char>(filename)
+                : conv::to_utf<wchar_t>(filename, "IBM437");
+            e.ts = from_dos_time(dos_date, dos_time);
+
+            if (e.flags & zip_flag_encrypted)
+                throw runtime_error(format("{}: Encrypted entries are not supported.", filename));
+            if (e.method != 0 && e.method != Z_DEFLATED)
+                throw runtime_error(format("{}: Unsupported compression method {}.", filename, e.method));
+            if (e.method == 0 && (e.flags & zip_flag_descriptor))
+                throw runtime_error(format("{}: Stored entry without size can't be read from a stream.", filename));
+
+            if (e.method == Z_DEFLATED)
+            {
+                const auto r = m_zinit ? inflateReset(&m_zs) : inflateInit2(&m_zs, -MAX_WBITS);
+                if (r != Z_OK)
+                    throw runtime_error("Inflate error.");
+                m_zinit = true;
+            }
+
+            m_cur = std::move(e);
+            m_totread = m_compread = 0;
+            m_crc = crc32(0, nullptr, 0);
+            m_done = false;
+
+            if (!m_cur->name.ends_with(L'/'))
+                return m_cur->name;
+            finish_entry();
+        }
+        return {};
+    }
+
+    optional<pak::pack_i::filetime_t> zip_stream_reader_c::entry_timestamp() const
+    {
+        return m_cur.has_value() ? m_cur->ts : nullopt;
+    }
+
+    size_t zip_stream_reader_c::read(uint8_t* data, size_t sz)
+    {
+        if (!m_cur.has_value() || m_done)
+            return 0;
+
+        sz = min<size_t>(sz, numeric_limits<uInt>::max());
+        size_t produced = 0;
+        if (m_cur->method == 0)
+        {
+            const auto n = static_cast<size_t>(min<uint64_t>(sz, m_cur->csize - m_compread));
+            produced = n > 0 ? m_src->read(data, n) : 0;
+            if (n > 0 && produced == 0)
+                throw runtime_error("Unexpected end of stream.");
+            m_compread += produced;
+            m_done = m_compread == m_cur->csize;
+        }
+        else
+        {
+            m_zs.next_out = data;
+            m_zs.avail_out = static_cast<uInt>(sz);
+            while (m_zs.avail_out > 0)
+            {
+                auto in = m_src->data();
+                if (in.empty() && m_src->fill() > 0)
+                    in = m_src->data();
+                if (!(m_cur->flags & zip_flag_descriptor))
+                    in = in.first(static_cast<size_t>(min<uint64_t>(in.size(), m_cur->csize - m_compread)));
+                if (in.empty())
+                    throw runtime_error("Unexpected end of stream.");
+
+                m_zs.next_in = const_cast<Bytef*>(in.data());
+                m_zs.avail_in = static_cast<uInt>(min<size_t>(in.size(), numeric_limits<uInt>::max()));
+                const auto r = inflate(&m_zs, Z_NO_FLUSH);
+                const auto consumed = in.size() - m_zs.avail_in;
+                m_src->consume(consumed);
+                m_compread += consumed;
+
+                if (r == Z_STREAM_END)
+                {
+                    m_done = true;
+                    break;
+                }
+                else if (r != Z_OK)
+                {
+                    throw runtime_error("Inflate error.");
+                }
+            }
+            produced = sz - m_zs.avail_out;
+        }
+
+        m_crc = crc32_z(m_crc, data, produced);
+        m_totread += produced;
+        return produced;
+    }
+
+    void zip_stream_reader_c::finish_entry()
+    {
+        if (!m_cur.has_value())
+            return;
+
+        uint8_t buf[0x4000];
+        while (!m_done)
+            read(buf, size(buf));
+
+        if (m_cur->flags & zip_flag_descriptor)
+        {
+            //The signature is optional
+            if (m_src->fill(sizeof(uint32_t)) >= sizeof(uint32_t)
+                && load_little_u32(m_src->data().data()) == zip_descriptor_sig)
+            {
+                m_src->consume(sizeof(uint32_t));
+            }
+            m_cur->crc = little_to_native(m_src->read<uint32_t>());
+            m_cur->csize = m_cur->zip64 ? little_to_native(m_src->read<uint64_t>()) : little_to_native(m_src->read<uint32_t>());
+            m_cur->len = m_cur->zip64 ? little_to_native(m_src->read<uint64_t>()) : little_to_native(m_src->read<uint32_t>());
+        }
+
+        if (m_cur->crc != m_crc || m_cur->len != m_totread)
+            emit_warning(m_cur->name, L"CRC error.");
+        m_cur.reset();
+    }
+}
+
+namespace pak
+{
+    //static
+    unique_ptr<stream_pack_i> stream_pack_i::open_stream(istream& is, pack_i::warning_func_t warn_func)
+    {
+        auto src = make_unique<pak_impl::stream_source_c>(is);
+        src->fill(pak_impl::KEN.length());
+        const auto magic = string_view{ reinterpret_cast<const char*>(src->data().data()), src->data().size() };
+
+        if (magic.starts_with(pak_impl::ZIP_LOCAL) || magic.starts_with(pak_impl::ZIP_EMPTY))
+            return make_unique<pak_impl::zip_stream_reader_c>(std::move(src), warn_func);
+
+        const auto is_pak = magic.starts_with(pak_impl::PACK);
+        const auto is_grp = magic.starts_with(pak_impl::KEN);
+        if (is_pak || is_grp)
+        {
+            auto ppak = make_unique<pak_impl::dir_stream_reader_c>(std::move(src), warn_func);
+            if (is_pak ? ppak->read_pak_header() : ppak->read_grp_header())
+                return ppak;
+        }
+        return nullptr;
+    }
+}
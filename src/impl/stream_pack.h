@@ -0,0 +1,154 @@
+#ifndef STREAM_PACK_H_INCLUDED
+#define STREAM_PACK_H_INCLUDED
+#include "../pack.h"
+#include <vector>
+#include <span>
+#include <fstream>
+#include <zlib.h>
+
+namespace pak_impl
+{
+    //Buffered forward-only byte source on top of an istream
+    class stream_source_c
+    {
+    public:
+        explicit stream_source_c(std::istream& is) : m_is(is), m_buf(buf_size)
+        {
+        }
+
+        //Tries to make at least n bytes available, returns how many there are
+        size_t fill(size_t n = 1);
+        std::span<const std::uint8_t> data() const noexcept
+        {
+            return { m_buf.data() + m_pos, m_end - m_pos };
+        }
+        void consume(size_t n) noexcept
+        {
+            m_pos += n;
+            m_total += n;
+        }
+        size_t read(void* data, size_t sz);
+        void read_exact(void* data, size_t sz);
+        template <typename T>
+        T read()
+        {
+            T v;
+            read_exact(&v, sizeof(v));
+            return v;
+        }
+        void skip(std::uint64_t n);
+        std::uint64_t position() const noexcept
+        {
+            return m_total;
+        }
+    private:
+        static constexpr size_t buf_size = 0x40000;
+
+        std::istream& m_is;
+        std::vector<std::uint8_t> m_buf;
+        size_t m_pos = 0, m_end = 0;
+        std::uint64_t m_total = 0;
+    };
+
+    //Holds data that has to be kept until the directory of a pack has been seen.
+    //Small amounts stay in memory, the rest goes to a temporary file.
+    class spool_c
+    {
+    public:
+        ~spool_c();
+
+        void append(const std::uint8_t* data, size_t sz);
+        void read_at(std::uint64_t pos, std::uint8_t* data, size_t sz);
+        std::uint64_t size() const noexcept
+        {
+            return m_size;
+        }
+    private:
+        static constexpr size_t mem_limit = 32u << 20;
+
+        std::vector<std::uint8_t> m_mem;
+        std::fstream m_file;
+        std::filesystem::path m_filepath;
+        std::uint64_t m_size = 0;
+    };
+
+    class stream_reader_c : public pak::stream_pack_i
+    {
+    public:
+        stream_reader_c(std::unique_ptr<stream_source_c> src, pak::pack_i::warning_func_t warn_func)
+            : m_src(std::move(src)), m_warn_func(warn_func)
+        {
+        }
+    protected:
+        void emit_warning(const std::wstring& entry, const std::wstring& message) const
+        {
+            if (m_warn_func)
+                m_warn_func(entry, message);
+        }
+
+        std::unique_ptr<stream_source_c> m_src;
+        pak::pack_i::warning_func_t m_warn_func;
+    };
+
+    //Reads .pak and .grp where the directory gives offsets and sizes of all entries
+    class dir_stream_reader_c : public stream_reader_c
+    {
+    public:
+        using stream_reader_c::stream_reader_c;
+
+        //Expects the magic to be available in the source
+        bool read_pak_header();
+        bool read_grp_header();
+
+        std::optional<std::wstring> next_entry() override;
+        std::optional<filetime_t> entry_timestamp() const override;
+        size_t read(std::uint8_t* data, size_t sz) override;
+    private:
+        struct entry_t
+        {
+            std::uint64_t pos = 0;
+            std::uint64_t len = 0;
+            std::wstring name;
+        };
+        std::vector<entry_t> m_files;
+        std::optional<size_t> m_cur;
+        std::uint64_t m_totread = 0;
+        std::uint64_t m_spool_base = 0;
+        bool m_from_spool = false;
+        spool_c m_spool;
+    };
+
+    class zip_stream_reader_c : public stream_reader_c
+    {
+    public:
+        using stream_reader_c::stream_reader_c;
+        ~zip_stream_reader_c() override;
+
+        std::optional<std::wstring> next_entry() override;
+        std::optional<filetime_t> entry_timestamp() const override;
+        size_t read(std::uint8_t* data, size_t sz) override;
+    private:
+        struct entry_t
+        {
+            std::wstring name;
+            std::uint16_t flags = 0;
+            std::uint16_t method = 0;
+            std::uint32_t crc = 0;
+            std::uint64_t csize = 0;
+            std::uint64_t len = 0;
+            bool zip64 = false;
+            std::optional<filetime_t> ts;
+        };
+        std::optional<entry_t> m_cur;
+        std::uint64_t m_totread = 0, m_compread = 0;
+        std::uint32_t m_crc = 0;
+        bool m_done = true;
+        bool m_end = false;
+        bool m_zinit = false;
+        z_stream m_zs{};
+
+        void finish_entry();
+    };
+}
+
+#endif
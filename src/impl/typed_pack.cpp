@@ -0,0 +1,50 @@
+#include "typed_pack.h"
+#include <array>
+#include <memory>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+    using namespace pak_impl;
+    using copy_func_t = bool(*)(pak::pack_i&, pak::pack_i&);
+
+    template<typename Src, typename Dst>
+    bool copy_loop(pak::pack_i& src, pak::pack_i& dst)
+    {
+        auto& in = static_cast<typed_pack_c<Src>&>(src);
+        auto& out = static_cast<typed_pack_c<Dst>&>(dst);
+        constexpr auto chunk = min(copy_chunk<Src>, copy_chunk<Dst>);
+        const auto buf = make_unique_for_overwrite<uint8_t[]>(chunk);
+        for (auto s = in.read_direct(buf.get(), chunk); s > 0; s = in.read_direct(buf.get(), chunk))
+        {
+            if (out.write_direct(buf.get(), s) != s)
+                return false;
+        }
+        return true;
+    }
+
+    template<typename Src, size_t... D>
+    constexpr auto copy_row(index_sequence<D...>)
+    {
+        return array<copy_func_t, sizeof...(D)>{ &copy_loop<Src, tuple_element_t<D, backends_t>>... };
+    }
+
+    template<size_t... S>
+    constexpr auto copy_table(index_sequence<S...> seq)
+    {
+        return array{ copy_row<tuple_element_t<S, backends_t>>(seq)... };
+    }
+
+    //One loop for every pair of formats, by backend ids minus one
+    constexpr auto copy_funcs = copy_table(make_index_sequence<tuple_size_v<backends_t>>{});
+}
+
+namespace pak_impl
+{
+    bool typed_copy(pak::pack_i& src, uint8_t src_id, pak::pack_i& dst, uint8_t dst_id)
+    {
+        return copy_funcs[src_id - 1u][dst_id - 1u](src, dst);
+    }
+}
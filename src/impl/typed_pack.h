@@ -0,0 +1,56 @@
+#ifndef TYPED_PACK_H_INCLUDED
+#define TYPED_PACK_H_INCLUDED
+#include "../pack.h"
+#include "pak_pack.h"
+#include "grp_pack.h"
+#include "fs_pack.h"
+#include "pk3_pack.h"
+#include "pk3_stream_pack.h"
+#include <tuple>
+
+namespace pak_impl
+{
+    //Every backend, the position is its backend id minus one. 0 is a pack_i that isn't a typed_pack_c.
+    using backends_t = std::tuple<pak_pack_c, grp_pack_c, fs_pack_c, pk3_pack_c, pk3_stream_pack_c>;
+
+    template<typename Backend, size_t I = 0>
+    constexpr std::uint8_t backend_id() noexcept
+    {
+        if constexpr (std::is_same_v<Backend, std::tuple_element_t<I, backends_t>>)
+            return static_cast<std::uint8_t>(I + 1u);
+        else
+            return backend_id<Backend, I + 1u>();
+    }
+
+    //What copying loops need to know about a backend. Stored formats read and write the file
+    //as is, so they take large chunks. zlib works on smaller ones and minizip takes 32-bit sizes.
+    template<typename Backend>
+    constexpr size_t copy_chunk = std::is_base_of_v<pk3_pack_c, Backend> || std::is_base_of_v<pk3_stream_pack_c, Backend>
+        ? 0x40000u : 0x100000u;
+
+    //Backend whose type is known where it is used, so calls go straight to its functions
+    //instead of through pack_i. open_pack creates these, which behave as the backend otherwise.
+    template<typename Backend>
+    class typed_pack_c final : public Backend
+    {
+    public:
+        typed_pack_c()
+        {
+            this->m_backend_id = backend_id<Backend>();
+        }
+
+        size_t read_direct(std::uint8_t* buf, size_t sz)
+        {
+            return Backend::read_entry_impl(buf, sz);
+        }
+        size_t write_direct(const std::uint8_t* buf, size_t sz)
+        {
+            return Backend::write_entry_impl(buf, sz);
+        }
+    };
+
+    //Copies the rest of the open entry of src to the open entry of dst with a loop made for their
+    //formats. Both must be typed_pack_c with an entry open and not served from a cache.
+    bool typed_copy(pak::pack_i& src, std::uint8_t src_id, pak::pack_i& dst, std::uint8_t dst_id);
+}
+#endif
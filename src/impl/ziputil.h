@@ -0,0 +1,148 @@
+#ifndef ZIPUTIL_H_INCLUDED
+#define ZIPUTIL_H_INCLUDED
+#include "../pack.h"
+#include <zlib.h>
+#include <array>
+#include <tuple>
+#include <string_view>
+#include <span>
+#include <optional>
+#include <vector>
+#include <algorithm>
+#include <boost/endian.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace pak_impl
+{
+    //Zip record signatures and flags that are needed when the zip format is handled
+    //without minizip (e.g. when streaming)
+    constexpr std::uint32_t zip_local_sig = 0x04034b50u;
+    constexpr std::uint32_t zip_descriptor_sig = 0x08074b50u;
+    constexpr std::uint32_t zip_central_sig = 0x02014b50u;
+    constexpr std::uint32_t zip_end_sig = 0x06054b50u;
+    constexpr std::uint32_t zip64_end_sig = 0x06064b50u;
+    constexpr std::uint32_t zip64_locator_sig = 0x07064b50u;
+    constexpr std::uint16_t zip64_extra_id = 0x0001u;
+
+    constexpr std::uint16_t zip_flag_encrypted = 1u << 0;
+    constexpr std::uint16_t zip_flag_descriptor = 1u << 3;
+    constexpr std::uint16_t zip_flag_utf8 = 1u << 11;
+
+    constexpr std::uint16_t zip_version_zip64 = 45u;
+
+    inline auto compression_level(const std::string& name) noexcept
+    {
+        using namespace std::literals;
+        auto nmv = name | std::views::reverse;
+        if (auto r = std::ranges::find(nmv, '.'); r != end(nmv))
+        {
+            constexpr std::array uncomp_ext = { "jpg"sv, "jpeg"sv, "png"sv, "mp3"sv, "ogg"sv, "opus"sv, "flac"sv };
+            //Skip compression of already compressed files
+            const auto ext = std::string_view{ r.base(), end(name) };
+            if (std::ranges::find(uncomp_ext, ext) != end(uncomp_ext))
+                return std::make_tuple(0, Z_NO_COMPRESSION);
+        }
+        return std::make_tuple(Z_DEFLATED, Z_BEST_COMPRESSION);
+    }
+
+    //Contents of the extra field block with id, if there is one
+    inline std::optional<std::span<const std::uint8_t>> find_extra_field(std::span<const std::uint8_t> extra, std::uint16_t id) noexcept
+    {
+        using namespace boost::endian;
+        for (size_t i = 0; i + 4 <= extra.size(); )
+        {
+            const auto len = load_little_u16(&extra[i + 2]);
+            if (i + 4 + len > extra.size())
+                break;
+            if (load_little_u16(&extra[i]) == id)
+                return extra.subspan(i + 4, len);
+            i += 4 + len;
+        }
+        return {};
+    }
+
+    //Local header offset from a central directory header (without signature) and its extra field
+    inline std::uint64_t zip_local_offset(std::span<const std::uint8_t, 42> central, std::span<const std::uint8_t> extra) noexcept
+    {
+        using namespace boost::endian;
+        constexpr auto no_value = 0xFFFFFFFFu;
+        const auto offset = load_little_u32(&central[38]);
+        if (offset != no_value)
+            return offset;
+
+        //The zip64 extra field only has the values that didn't fit, in this order
+        const auto skip = (load_little_u32(&central[20]) == no_value ? 8u : 0u) + (load_little_u32(&central[16]) == no_value ? 8u : 0u);
+        if (const auto z64 = find_extra_field(extra, zip64_extra_id); z64 && z64->size() >= skip + 8u)
+            return load_little_u64(&(*z64)[skip]);
+        return offset;
+    }
+
+    //Upper bound of what an entry costs: local and central headers with zip64 extra fields,
+    //a data descriptor and data that deflate couldn't make any smaller (as zlib's deflateBound)
+    constexpr std::uint64_t zip_entry_space(std::size_t name_len, std::uint64_t size) noexcept
+    {
+        return 30u + 46u + 2u * (name_len + 4u + 24u) + 24u
+            + size + (size >> 12) + (size >> 14) + (size >> 25) + 7u;
+    }
+
+    //Extra field id Android's zipalign pads local headers with
+    constexpr std::uint16_t zip_align_extra_id = 0xD935u;
+
+    //Local extra field that moves entry data from data_pos to the next multiple of align.
+    //It holds the alignment followed by zeros, so it is at least 6 bytes even when the data already is aligned.
+    inline std::vector<std::uint8_t> zip_align_extra(std::uint64_t data_pos, std::uint32_t align)
+    {
+        using namespace boost::endian;
+        const auto pad = static_cast<std::uint16_t>((align - (data_pos + 6u) % align) % align);
+        std::vector<std::uint8_t> extra(6u + pad);
+        store_little_u16(&extra[0], zip_align_extra_id);
+        store_little_u16(&extra[2], static_cast<std::uint16_t>(2u + pad));
+        store_little_u16(&extra[4], static_cast<std::uint16_t>(std::min(align, 0xFFFFu)));
+        return extra;
+    }
+
+    //End of central directory with the zip64 records
+    constexpr std::uint64_t zip_end_space = 22u + 56u + 20u;
+
+    inline std::optional<pak::pack_i::filetime_t> from_dos_time(std::uint16_t dos_date, std::uint16_t dos_time)
+    {
+        using namespace boost::posix_time;
+        using namespace boost::gregorian;
+        const auto year = 1980 + (dos_date >> 9);
+        const auto month = (dos_date >> 5) & 0xF;
+        const auto day = dos_date & 0x1F;
+        if (month < 1 || month > 12 || day < 1)
+            return {};
+        try
+        {
+            return pak::pack_i::filetime_t
+            {
+                date{ uint16_t(year), uint16_t(month), uint16_t(day) },
+                hours(dos_time >> 11) + minutes((dos_time >> 5) & 0x3F) + seconds(2 * (dos_time & 0x1F))
+            };
+        }
+        catch (const std::out_of_range&)
+        {
+        }
+        return {};
+    }
+
+    //Returns DOS date and time, in that order
+    inline std::tuple<std::uint16_t, std::uint16_t> to_dos_time(const pak::pack_i::filetime_t& ts)
+    {
+        using namespace boost::posix_time;
+        using boost::gregorian::date;
+        //Anything outside what DOS time can hold becomes its first or last moment
+        const ptime first{ date{ 1980, 1, 1 } };
+        const ptime last{ date{ 2107, 12, 31 }, hours(23) + minutes(59) + seconds(58) };
+        const auto t = ts.is_pos_infinity() ? last : ts.is_special() || ts < first ? first : ts > last ? last : ts;
+        return
+        {
+            static_cast<std::uint16_t>(((t.date().year() - 1980) << 9) | (t.date().month() << 5) | t.date().day()),
+            static_cast<std::uint16_t>((t.time_of_day().hours() << 11) | (t.time_of_day().minutes() << 5)
+                | (t.time_of_day().seconds() / 2))
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+#include "pack.h"
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace pak
+{
+    //Entries written to a pack, kept in a file of its own next to it so that writing the pack
+    //can be continued with pack_i::resume_pack() if the process is stopped. Every entry is
+    //flushed to the file as soon as it is complete in the pack. An entry that was being added
+    //when the process stopped is left out when the journal is read.
+    class journal_c
+    {
+    public:
+        //With resume the entries of the journal that is there are read, otherwise it is emptied.
+        //Throws if the file can't be written or isn't a journal.
+        journal_c(const std::filesystem::path& path, bool resume);
+        journal_c(const journal_c&) = delete;
+        journal_c& operator=(const journal_c&) = delete;
+
+        const std::vector<pack_i::journal_entry_t>& entries() const noexcept
+        {
+            return m_entries;
+        }
+
+        void add(pack_i::journal_entry_t entry);
+        //Drops the entries after the first count
+        void keep(size_t count);
+        //Deletes the file, for when the pack is done
+        void remove();
+    private:
+        std::filesystem::path m_path;
+        std::ofstream m_file;
+        std::vector<pack_i::journal_entry_t> m_entries;
+        std::vector<std::uint64_t> m_ends;     //Where the line of every entry ends in the file
+
+        void reopen();
+    };
+}
+#endif
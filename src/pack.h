@@ -1,6 +1,7 @@
 #ifndef PACK_H_INCLUDED
 #define PACK_H_INCLUDED
 #include <string>
+#include <istream>
 #include <memory>
 #include <cstdint>
 #include <filesystem>
@@ -8,18 +9,84 @@
 #include <optional>
 #include <ranges>
 #include <algorithm>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <span>
+#include <tuple>
 #include <boost/algorithm/string.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
+#include "filter.h"
 
 namespace pak
 {
+    class entry_cache_c;
+    class journal_c;
+
+    //Read position in one entry that doesn't depend on the pack's current entry. Readers of
+    //the same pack can be used on different threads at the same time, as long as the pack
+    //isn't written to meanwhile. They must not outlive the pack.
+    class entry_reader_i
+    {
+    public:
+        virtual ~entry_reader_i() = default;
+
+        //Returns less than sz only at the end of the entry, errors throw
+        virtual size_t read(std::uint8_t* data, size_t sz) = 0;
+        //false if pos is past the end. Compressed entries may be decompressed up to pos
+        //the first time, after that they continue from the closest checkpoint.
+        virtual bool seek(std::uint64_t pos) = 0;
+    };
+
     class pack_i
     {
     public:
         using warning_func_t = std::function<void(std::wstring, std::wstring)>;
         using filetime_t = boost::posix_time::ptime;
+        //Entry name (empty for the pack itself) and what is wrong with it
+        using problem_t = std::tuple<std::wstring, std::wstring>;
 
         enum class mode { read_only, read_write, rw_new };
+        //stored is the order of the directory, which needs no sorting at all
+        enum class order { name, offset, stored };
+
+        //What the directory says about an entry, available without opening it
+        struct entry_info_t
+        {
+            std::wstring_view name;
+            std::uint64_t size = 0;                 //Uncompressed
+            std::uint64_t stored_size = 0;          //Space the data takes in the pack, same as size unless compressed
+            std::uint16_t method = 0;               //Zip compression method, 0 when stored as is
+            std::optional<std::uint32_t> crc;       //CRC-32 of the uncompressed data, if the format keeps one
+            std::optional<std::uint64_t> offset;    //Where the entry starts in the pack file, if it is in one
+            std::optional<filetime_t> timestamp;
+            size_t index = 0;                       //Position in the directory, lets open_entry() skip the name lookup
+        };
+
+        //What a folder does with a file whose content was written before
+        enum class link { none, reflink, hardlink };
+
+        //How new entries are laid out in the file. Formats ignore what they can't do.
+        struct write_options_t
+        {
+            std::uint32_t align = 0;    //Data of entries stored without compression starts at a multiple of this (.pk3)
+            bool optimize = false;      //Try several deflate settings on every entry and keep the smallest (.pk3)
+            //Files with the same content as one any folder in the process has written are made a
+            //reflink (falling back to a hard link) or a hard link to it instead of written again (folders)
+            link dedupe = link::none;
+        };
+
+        //Entry that was completely written, as recorded in a journal_c. offset and end are
+        //where it starts and ends in the file, headers included.
+        struct journal_entry_t
+        {
+            std::wstring name;
+            std::uint64_t size = 0;
+            std::uint32_t crc = 0;                  //CRC-32 of the data
+            std::uint64_t offset = 0;
+            std::uint64_t end = 0;
+        };
     protected:
         pack_i()
         {
@@ -29,6 +96,8 @@ namespace pak
         virtual bool create_pack_impl(const std::filesystem::path& path) = 0;
         virtual bool open_entry_impl(size_t idx) = 0;
         virtual std::optional<filetime_t> entry_timestamp_impl(size_t idx) const = 0;
+        //Size, stored size, crc and offset of an entry. Name and time stamp are filled in by pack_i.
+        virtual entry_info_t entry_info_impl(size_t idx) const = 0;
         virtual std::optional<size_t> new_entry_impl(const std::wstring& name, const std::optional<filetime_t>& ft) = 0;
         virtual size_t read_entry_impl(std::uint8_t* buf, size_t sz) = 0;
         virtual size_t write_entry_impl(const std::uint8_t* buf, size_t size) = 0;
@@ -39,7 +108,26 @@ namespace pak
         virtual bool close_pack_impl() = 0;
         virtual size_t entry_count() const = 0;
         virtual const std::wstring& entry_name(size_t idx) const = 0;
-        virtual bool notify_add(size_t cnt);
+        //Called before cnt entries with about data_size bytes in total are added
+        virtual bool notify_add(size_t cnt, std::uint64_t data_size);
+        //Called after new_entry_impl when the size of the coming data is known
+        virtual void reserve_entry_impl(std::uint64_t size);
+        virtual std::vector<problem_t> verify_impl() const;
+        virtual std::uint64_t space_needed_impl(const std::wstring& name, std::uint64_t size) const;
+        virtual std::uint64_t empty_size_impl() const;
+        //Reader for an entry, nullptr if the format or entry can't be read that way
+        virtual std::unique_ptr<entry_reader_i> open_reader_impl(size_t idx) const;
+        virtual bool seek_entry_impl(std::uint64_t pos);
+        //Cuts a pack that was being written when the process stopped back to the entries in done,
+        //so open_pack_impl can open it. Entries that aren't found as they were written are dropped
+        //with all that follow. Returns how many are kept, nothing if the format can't be resumed.
+        virtual std::optional<size_t> resume_impl(const std::filesystem::path& path, std::span<const journal_entry_t> done);
+        //Start and end in the file of the entry that was just closed, for formats that can be resumed
+        virtual std::optional<std::tuple<std::uint64_t, std::uint64_t>> written_extent_impl() const;
+        //Adds entry idx of src with its data as src stores it. Returns the new entry's index,
+        //nothing if src is another format or the entry can't be copied that way.
+        virtual std::optional<size_t> copy_stored_impl(const pack_i& src, size_t idx, const std::wstring& name,
+            const std::optional<filetime_t>& ft);
 
         virtual bool next_output();
 
@@ -54,12 +142,17 @@ namespace pak
         bool m_opened_write = false;
         std::optional<size_t> m_read_idx, m_write_idx;
         std::filesystem::path m_filepath;
+        write_options_t m_write_opts;
+        std::uint8_t m_backend_id = 0;  //Set by typed_pack_c, 0 when the backend isn't known
     public:
 
         virtual ~pack_i() = default;
 
-        bool new_entry(const std::wstring& name, const std::optional<filetime_t>& ft = {});
+        //size_hint is how much will be written, if known, so the space can be allocated at once
+        bool new_entry(const std::wstring& name, const std::optional<filetime_t>& ft = {}, std::uint64_t size_hint = 0);
         bool open_entry(const std::wstring& name);
+        //Opens the entry info came from, without building the name index if it hasn't been
+        bool open_entry(const entry_info_t& info);
         bool contains_entry(const std::wstring& name) const
         {
              return find_entry(name).has_value();
@@ -69,47 +162,268 @@ namespace pak
             return m_read_idx ? entry_timestamp_impl(*m_read_idx) : std::nullopt;
         }
 
+        //Reads an entry without opening it, so several entries can be read at the same time.
+        //nullptr if there is no such entry or it can only be read with open_entry().
+        std::unique_ptr<entry_reader_i> open_reader(const std::wstring& name) const;
+        //Reader for the entry info came from, without building the name index if it hasn't been
+        std::unique_ptr<entry_reader_i> open_reader(const entry_info_t& info) const;
+
+        //Uncompressed size of an entry
+        std::optional<std::uint64_t> entry_size(const std::wstring& name) const
+        {
+            const auto idx = find_entry(name);
+            return idx ? std::optional{ entry_info_impl(*idx).size } : std::nullopt;
+        }
+
+        std::optional<entry_info_t> entry_info(const std::wstring& name) const
+        {
+            const auto idx = find_entry(name);
+            return idx ? std::optional{ make_info(*idx) } : std::nullopt;
+        }
+
+        //Info of the n:th entry in name order, like file_names()
+        entry_info_t entry_info(size_t n) const
+        {
+            return make_info(sorted_idx().at(n));
+        }
+
+        //Upper bounds of the file size, used to plan volumes before anything is written.
+        //An empty pack needs empty_size() and every entry adds space_needed() to that.
+        std::uint64_t space_needed(const std::wstring& name, std::uint64_t size) const
+        {
+            return space_needed_impl(name, size);
+        }
+        std::uint64_t empty_size() const
+        {
+            return empty_size_impl();
+        }
+        size_t max_entries() const
+        {
+            return max_file_count();
+        }
+
+        //Applies to entries added after the call
+        void set_write_options(const write_options_t& opts)
+        {
+            m_write_opts = opts;
+        }
+
+        //open_entry() takes entries from the cache, or reads them into it, when they are small enough
+        void set_entry_cache(std::shared_ptr<entry_cache_c> cache)
+        {
+            m_cache = std::move(cache);
+        }
+
+        //Every entry written after the call is added to the journal once it is complete, so the
+        //pack can be continued with resume_pack() if the process is stopped. Only .pak, .pk3 and
+        //folders can be resumed, other formats leave the journal alone.
+        void set_journal(std::shared_ptr<journal_c> journal)
+        {
+            m_journal = std::move(journal);
+        }
+
         void close_read_entry();
         void close_write_entry();
-        bool pre_reserve(size_t file_count)
+        //Makes room for file_count entries and data_size bytes of data in one go.
+        //Sizes can come from entry_info() of the source.
+        bool pre_reserve(size_t file_count, std::uint64_t data_size = 0)
         {
-            if (m_opened_write && file_count > 0u)
-                return notify_add(file_count);
-            return file_count == 0u;
+            if (m_opened_write && (file_count > 0u || data_size > 0u))
+                return notify_add(file_count, data_size);
+            return file_count == 0u && data_size == 0u;
         }
 
         size_t read(std::uint8_t* data, size_t sz);
         size_t write(const std::uint8_t* data, size_t sz);
+        //Copies the rest of the entry open in src to the entry open here, false on write errors.
+        //Packs from open_pack use a loop made for their two formats.
+        bool write_from(pack_i& src);
+        //Adds the entry of src that info came from as a new entry, with its data copied as it is
+        //stored instead of decompressed and compressed again. Takes the name, size and CRC from info.
+        //False if the formats can't do that or the name is taken, nothing is added then.
+        bool copy_stored(const pack_i& src, const entry_info_t& info, const std::optional<filetime_t>& ft = {});
+        //Moves the read position in the open entry, false if the format can't or pos is past the end
+        bool seek(std::uint64_t pos);
 
         bool close_pack();
-        auto file_names() const noexcept
+
+        //Checks the pack for damage without extracting it. Formats with checksums
+        //have their entries decompressed as tasks on scheduler_c::instance(),
+        //others have their directory checked against the file.
+        std::vector<problem_t> verify() const;
+
+        auto file_names() const
         {
-            return m_file_idx
+            return sorted_idx()
                 | std::views::transform([this](auto v) { return std::wstring_view{ entry_name(v) }; }); 
         }
 
+        //Names that start with prefix (case insensitive), looked up in the sorted index
+        auto file_names(const std::wstring& prefix) const
+        {
+            const auto lprefix = fold_name(prefix);
+            auto lowered = [this](auto v) { return fold_name(entry_name(v)); };
+
+            const auto& idx = sorted_idx();
+            const auto first = std::ranges::lower_bound(idx, lprefix, {}, lowered);
+            const auto last = std::ranges::partition_point(first, std::end(idx),
+                [&](auto v) { return lowered(v).starts_with(lprefix); });
+
+            return std::ranges::subrange(first, last)
+                | std::views::transform([this](auto v) { return std::wstring_view{ entry_name(v) }; });
+        }
+
+        //Names that pass filter, in index order. Only the matching index ranges
+        //are visited if the filter is anchored to folders. order::offset sorts them by
+        //where they are in the file instead, which makes reading every entry sequential.
+        std::vector<std::wstring_view> file_names(const name_filter& filter, order o = order::name) const;
+
+        //Info of all entries in name order, read from the directory only
+        auto entries() const
+        {
+            return sorted_idx()
+                | std::views::transform([this](auto v) { return make_info(v); });
+        }
+
+        //Info of the entries that pass filter, ordered like file_names(filter, o)
+        std::vector<entry_info_t> entries(const name_filter& filter, order o = order::name) const;
+
         size_t count(std::function<bool(std::wstring_view)> filter = nullptr) const noexcept
         {
             if (filter == nullptr)
-                return m_file_idx.size();
+                return entry_count();
 
             auto files = std::views::filter(file_names(), filter);
             return static_cast<size_t>(std::distance(std::begin(files), std::end(files)));
-        }        
+        }
+
+        size_t count(const name_filter& filter) const
+        {
+            return filter.empty() ? entry_count() : file_names(filter).size();
+        }
+
+        //Name of volume number volume (0 is first) of a pack split over several files.
+        //In name_template {name} is replaced by the name of first without any number at the end
+        //and {n} by the number it ended with plus volume. Without a number the first volume is 1.
+        //The default is {name}{n}, so pak0.pak is followed by pak1.pak and music.pk3 by music2.pk3.
+        static std::filesystem::path volume_path(const std::filesystem::path& first, size_t volume, const std::wstring& name_template = {});
 
+        //A path of "-" creates a streamed .pk3 on stdout (rw_new only)
         static std::unique_ptr<pack_i> open_pack(const std::filesystem::path& path, mode m, warning_func_t warn_func = nullptr);
+        //Pack of the format open_pack(path, mode::rw_new) would create, with nothing created yet.
+        //Only good for planning the output with space_needed(), empty_size() and max_entries().
+        static std::unique_ptr<pack_i> plan_pack(const std::filesystem::path& path)
+        {
+            return make_pack(path, mode::rw_new);
+        }
+        //Opens a pack that was being written with journal when the process stopped, for writing
+        //more entries. Entries of the journal whose data is damaged or missing are cut off, along
+        //with all after them, and dropped from the journal, which then has what the pack has.
+        //nullptr if the pack can't be opened or its format can't be resumed.
+        static std::unique_ptr<pack_i> resume_pack(const std::filesystem::path& path, journal_c& journal, warning_func_t warn_func = nullptr);
     private:
+        friend class entry_cache_c;
+
         warning_func_t m_warn_func;
-        std::vector<size_t> m_file_idx;
 
-        void rebuild_idx()
+        //Entries sorted by folded name. It is built on the first lookup or sorted listing, not
+        //on open, since going through every entry once in stored order doesn't need it. Entries
+        //written after that go in m_added until a sorted listing merges them in, so writing many
+        //entries doesn't sort again after each one. m_idx_ready is set when neither has to be done.
+        mutable std::vector<size_t> m_file_idx;
+        mutable std::unordered_map<std::wstring, size_t> m_added;
+        mutable bool m_idx_built = false;
+        mutable std::atomic<bool> m_idx_ready = false;
+        mutable std::mutex m_idx_lock;
+        std::uint64_t m_generation = new_generation();  //Tells packs and their contents apart in caches
+        std::shared_ptr<entry_cache_c> m_cache;
+        std::shared_ptr<const std::vector<std::uint8_t>> m_cached;  //Current entry if it came from the cache
+        std::uint64_t m_cached_pos = 0;
+        std::shared_ptr<journal_c> m_journal;
+        std::uint32_t m_journal_crc = 0;    //Of the entry being written
+        std::uint64_t m_journal_size = 0;
+
+        static std::uint64_t new_generation() noexcept;
+        static std::unique_ptr<pack_i> make_pack(const std::filesystem::path& path, mode m);
+        //Checks that name can be added and converts it, nothing if it is already there
+        std::optional<std::wstring> check_new_name(const std::wstring& name);
+        //Journals and indexes the entry at m_write_idx once it is complete
+        void entry_written();
+
+        //Lower case name the index is sorted by. Most names are ASCII, which doesn't need the locale.
+        static std::wstring fold_name(std::wstring_view name)
         {
+            std::wstring folded{ name };
+            if (!std::ranges::all_of(name, [](auto c) { return static_cast<std::uint32_t>(c) < 128u; }))
+                return boost::to_lower_copy(folded);
+
+            for (auto& c : folded)
+            {
+                if (c >= L'A' && c <= L'Z')
+                    c += L'a' - L'A';
+            }
+            return folded;
+        }
+
+        entry_info_t make_info(size_t idx) const
+        {
+            auto info = entry_info_impl(idx);
+            info.name = entry_name(idx);
+            info.timestamp = entry_timestamp_impl(idx);
+            info.index = idx;
+            return info;
+        }
+
+        std::vector<size_t> filtered_idx(const name_filter& filter, order o) const;
+        bool open_idx(size_t idx);
+        const std::vector<size_t>& sorted_idx() const;
+
+        //With m_idx_lock held
+        void build_idx() const
+        {
+            //Keys are made once instead of in every comparison
+            std::vector<std::tuple<std::wstring, size_t>> keys;
+            keys.reserve(entry_count());
+            for (size_t i = 0; i < entry_count(); ++i)
+                keys.emplace_back(fold_name(entry_name(i)), i);
+            std::ranges::sort(keys);
+
             std::vector<size_t> file_idx;
-            file_idx.reserve(entry_count());
-            std::ranges::copy(std::views::iota(size_t(0)) | std::views::take(entry_count()), back_inserter(file_idx));
-            std::ranges::sort(file_idx, {}, [this](auto v) { return boost::to_lower_copy(entry_name(v)); });
+            file_idx.reserve(keys.size());
+            std::ranges::copy(keys | std::views::elements<1>, back_inserter(file_idx));
             m_file_idx = std::move(file_idx);
+            m_added.clear();
+            m_idx_built = true;
+        }
+    };
+
+    //Forward-only reader for packs that come from a non-seekable source such as a pipe.
+    //Entries are visited in the order they appear in the stream.
+    class stream_pack_i
+    {
+    public:
+        using filetime_t = pack_i::filetime_t;
+
+        virtual ~stream_pack_i() = default;
+
+        //Moves to the next entry, skipping whatever is left of the current one
+        virtual std::optional<std::wstring> next_entry() = 0;
+        virtual std::optional<filetime_t> entry_timestamp() const = 0;
+        virtual size_t read(std::uint8_t* data, size_t sz) = 0;
+
+        //What is known about the current entry before reading it, if anything. The name is valid until next_entry().
+        virtual std::optional<pack_i::entry_info_t> entry_info() const
+        {
+            return {};
         }
+
+        //Format is detected from the leading bytes of the stream
+        static std::unique_ptr<stream_pack_i> open_stream(std::istream& is, pack_i::warning_func_t warn_func = nullptr);
+
+        //Walks the directory of a pack file or folder once, in the order it is stored, without
+        //building an index, so memory use doesn't grow with the number of entries.
+        //Format is chosen by extension like open_pack.
+        static std::unique_ptr<stream_pack_i> scan_pack(const std::filesystem::path& path, pack_i::warning_func_t warn_func = nullptr);
     };
 }
  #endif
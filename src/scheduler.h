@@ -0,0 +1,118 @@
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+
+namespace pak
+{
+    class task_group_c;
+
+    //Work-stealing thread pool that everything parallel in paklib and paktool runs on.
+    //Every worker has a deque of its own that it takes the newest task from, while idle
+    //workers steal the oldest tasks of the others. Tasks added from other threads go to a
+    //shared queue. A thread waiting for a task_group_c runs queued tasks of that group
+    //meanwhile, so a task can start tasks of its own and wait for them without tying up a
+    //worker. Tasks of other groups are left to the workers, a task that waits doesn't end up
+    //with unrelated long running work nested on its stack.
+    class scheduler_c
+    {
+    public:
+        //threads counts the thread that waits for the tasks, so threads - 1 workers are
+        //started. 0 is one thread per core and 1 runs everything on the waiting thread.
+        explicit scheduler_c(unsigned threads = 0);
+        scheduler_c(const scheduler_c&) = delete;
+        scheduler_c& operator=(const scheduler_c&) = delete;
+        ~scheduler_c();
+
+        unsigned threads() const noexcept
+        {
+            return m_thread_count;
+        }
+
+        //The scheduler task groups use unless told otherwise. It is created on first use,
+        //set_default_threads has no effect after that.
+        static scheduler_c& instance();
+        static void set_default_threads(unsigned threads);
+
+        //Runs a task nobody waits for, on the calling thread if there are no workers.
+        //It must not throw.
+        void post(std::function<void()> task);
+    private:
+        friend class task_group_c;
+        struct task_t
+        {
+            std::function<void()> run;
+            task_group_c* group = nullptr;      //nullptr for posted tasks
+        };
+
+        struct queue_t
+        {
+            std::mutex lock;
+            std::deque<task_t> tasks;
+        };
+
+        unsigned m_thread_count;
+        std::vector<std::unique_ptr<queue_t>> m_queues;     //One per worker
+        queue_t m_shared;
+        std::vector<std::thread> m_workers;
+        std::atomic<size_t> m_queued = 0;                   //Tasks in all queues, only changed with a queue locked
+        std::atomic<size_t> m_next_victim = 0;
+        std::mutex m_sleep_lock;
+        std::condition_variable m_wake;         //Idle workers
+        std::condition_variable m_wait_wake;    //Threads waiting for a task_group_c
+        bool m_stop = false;
+
+        void push(task_t task);
+        //Runs a queued task, only one of group if it isn't nullptr. False if there was none.
+        bool run_one(task_group_c* group = nullptr);
+        void worker(size_t idx);
+        void wake_waiters();
+
+        //Sleeps until done() is true, it is checked whenever a task is queued or a group finishes
+        void sleep_until(const std::function<bool()>& done);
+    };
+
+    //Tasks that are waited for together. cancel() skips the tasks that haven't started,
+    //running ones can check cancelled() to stop early. The first exception thrown by a task
+    //cancels the group and is rethrown by wait(). The group can be used again once wait()
+    //has returned. A group that is destroyed while tasks are left is cancelled and waited for.
+    class task_group_c
+    {
+    public:
+        explicit task_group_c(scheduler_c& sched = scheduler_c::instance()) : m_sched(sched)
+        {
+        }
+        task_group_c(const task_group_c&) = delete;
+        task_group_c& operator=(const task_group_c&) = delete;
+        ~task_group_c();
+
+        void run(std::function<void()> task);
+        void wait();
+
+        void cancel() noexcept
+        {
+            m_cancelled = true;
+        }
+        bool cancelled() const noexcept
+        {
+            return m_cancelled;
+        }
+    private:
+        friend class scheduler_c;
+
+        scheduler_c& m_sched;
+        std::atomic<size_t> m_active = 0;
+        std::atomic<size_t> m_queued = 0;      //Tasks not taken from the queues yet, only changed with a queue locked
+        std::atomic<bool> m_cancelled = false;
+        std::mutex m_error_lock;
+        std::exception_ptr m_error;
+    };
+}
+#endif